@@ -0,0 +1,691 @@
+// Micro-benchmarks for ProstVM (the prost_bench target).
+//
+// Every .pa file in the corpus directory is a benchmark. Its header holds a
+// "; ops: N" line giving the number of operations one run performs, and
+// ns/op is the run time of p_run divided by N. Assembling and loading are
+// not timed for these. Three more benchmarks are built in: "assemble" (a large
+// generated source, per instruction), "assemble-jobs" (the same on one thread
+// per CPU) and "load" (its .pco, per instruction).
+//
+// Each benchmark runs --warmup times untimed, then --reps times timed, and
+// reports the median, mean, variance and range of ns/op. --json writes the
+// same numbers, plus the build configuration, so runs of different builds
+// can be compared.
+//
+// --threads N measures throughput instead: each corpus program runs in
+// 1, 2, 4, ... N threads at once, every run in its own fresh VM.
+//
+// --fibers N runs a generated fan-out workload on 1, 2, 4, ... N workers two
+// ways: one VM that spawns a fiber per task and joins them all, and one VM
+// per thread, each calling the task for its share. Both include creating,
+// loading and freeing the VMs.
+#define PROST_IMPLEMENTATION
+#include "../prost/prost.h"
+#include "../prost/std.h"
+#include "../prost/assembler.h"
+#include <dirent.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#ifndef PROST_BENCH_DIR
+    #define PROST_BENCH_DIR "bench"
+#endif
+
+#define BENCH_GEN_FUNCTIONS 2000 // functions in the generated source
+#define BENCH_FIBER_TASKS 10000 // tasks in the --fibers workload
+#define BENCH_FIBER_WORK 1000 // loop iterations per task
+
+typedef struct {
+    char *name;
+    uint64_t ops;
+    size_t reps;
+    double median, mean, variance, min, max; // ns/op
+} BenchResult;
+
+typedef struct {
+    int warmup;
+    int reps;
+    const char *filter;
+} BenchOptions;
+
+typedef struct {
+    char *name;
+    int threads;
+    double runs_per_sec;
+    double mops_per_sec; // million ops per second, over all threads
+    double speedup; // over one thread
+} ScalingResult;
+
+typedef struct {
+    int workers;
+    double fiber_tasks_per_sec; // one VM, a fiber per task
+    double vm_tasks_per_sec; // a VM per thread
+} FiberResult;
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Sorts samples
+static double bench_median(double *samples, size_t count) {
+    qsort(samples, count, sizeof(double), compare_double);
+    return count % 2 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+}
+
+static BenchResult bench_summarize(const char *name, uint64_t ops, double *samples, size_t count) {
+    BenchResult r = {.name = strdup(name), .ops = ops, .reps = count};
+    r.median = bench_median(samples, count);
+    r.min = samples[0];
+    r.max = samples[count - 1];
+    for (size_t i = 0; i < count; i++) r.mean += samples[i];
+    r.mean /= count;
+    for (size_t i = 0; i < count; i++) r.variance += (samples[i] - r.mean) * (samples[i] - r.mean);
+    r.variance = count > 1 ? r.variance / (count - 1) : 0;
+    return r;
+}
+
+// Reads N from a "; ops: N" line before the first function.
+static uint64_t bench_ops(const char *src) {
+    const char *p = strstr(src, "; ops:");
+    return p ? strtoull(p + 6, NULL, 10) : 0;
+}
+
+static ProstVM *bench_vm(void) {
+    ProstVM *vm = p_init();
+    register_std(vm);
+    return vm;
+}
+
+static size_t bench_instruction_count(ProstVM *vm) {
+    size_t count = 0;
+    for (size_t i = 0; i < xvec_len(&vm->function_list); i++) {
+        count += ((Function *) xvec_get(&vm->function_list, i)->as_pointer)->instructions.count;
+    }
+    return count;
+}
+
+// Assembles src once and keeps its bytecode. Each repetition loads it into a
+// fresh VM and times p_run alone.
+static bool bench_program(const char *name, const char *src, const BenchOptions *opt, BenchResult *out) {
+    uint64_t ops = bench_ops(src);
+    if (ops == 0) {
+        fprintf(stderr, "Error: '%s' has no '; ops: N' line\n", name);
+        return false;
+    }
+
+    ProstVM *vm = bench_vm();
+    if (assemble(vm, src) != P_OK || p_link(vm) != P_OK) {
+        fprintf(stderr, "Error: Failed to assemble '%s'\n", name);
+        p_free(vm);
+        return false;
+    }
+    ByteBuf bytecode = p_to_bytecode(vm);
+    p_free(vm);
+
+    double *samples = malloc(opt->reps * sizeof(double));
+    bool ok = true;
+    for (int i = -opt->warmup; i < opt->reps && ok; i++) {
+        vm = bench_vm();
+        if (p_from_bytecode_n(vm, (const char *) bytecode.data, bytecode.len) != P_OK) {
+            fprintf(stderr, "Error: Failed to load '%s'\n", name);
+            ok = false;
+        } else {
+            uint64_t start = bench_now();
+            ProstStatus status = p_run(vm);
+            uint64_t elapsed = bench_now() - start;
+            if (status != P_OK) {
+                fprintf(stderr, "Error: '%s' failed (status %d)\n", name, status);
+                ok = false;
+            } else if (i >= 0) {
+                samples[i] = (double) elapsed / ops;
+            }
+        }
+        p_free(vm);
+    }
+    if (ok) *out = bench_summarize(name, ops, samples, opt->reps);
+    free(samples);
+    bb_free(&bytecode);
+    return ok;
+}
+
+typedef struct {
+    const ByteBuf *bytecode;
+    int runs;
+    atomic_bool *go;
+    bool ok;
+} ScalingWorker;
+
+// Runs the program `runs` times, each in a fresh VM, once all workers are
+// started.
+static void *scaling_worker(void *arg) {
+    ScalingWorker *w = arg;
+    while (!atomic_load(w->go)) sched_yield();
+    w->ok = true;
+    for (int i = 0; i < w->runs && w->ok; i++) {
+        ProstVM *vm = bench_vm();
+        w->ok = p_from_bytecode_n(vm, (const char *) w->bytecode->data, w->bytecode->len) == P_OK && p_run(vm) == P_OK;
+        p_free(vm);
+    }
+    return NULL;
+}
+
+// Wall time in ns for `threads` threads to each run the program `runs`
+// times, or 0 on failure.
+static uint64_t scaling_round(const ByteBuf *bytecode, int threads, int runs) {
+    atomic_bool go;
+    atomic_init(&go, false);
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    ScalingWorker *workers = malloc(threads * sizeof(ScalingWorker));
+    int started = 0;
+    for (; started < threads; started++) {
+        workers[started] = (ScalingWorker){.bytecode = bytecode, .runs = runs, .go = &go};
+        if (pthread_create(&ids[started], NULL, scaling_worker, &workers[started]) != 0) break;
+    }
+    uint64_t start = bench_now();
+    atomic_store(&go, true);
+    bool ok = started == threads;
+    for (int i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+        ok = ok && workers[i].ok;
+    }
+    uint64_t elapsed = bench_now() - start;
+    free(ids);
+    free(workers);
+    return ok ? elapsed : 0;
+}
+
+// Measures the throughput of the program on 1, 2, 4, ... max_threads threads.
+// Appends one result per thread count.
+static bool bench_scaling(const char *name, const char *src, const BenchOptions *opt, int max_threads,
+                          ScalingResult *out, size_t *out_count) {
+    uint64_t ops = bench_ops(src);
+    ProstVM *vm = bench_vm();
+    bool ok = assemble(vm, src) == P_OK && p_link(vm) == P_OK;
+    ByteBuf bytecode = {0};
+    if (ok) bytecode = p_to_bytecode(vm);
+    p_free(vm);
+    if (!ok) {
+        fprintf(stderr, "Error: Failed to assemble '%s'\n", name);
+        return false;
+    }
+
+    double base = 0;
+    for (int warm = 0; warm < opt->warmup && ok; warm++) ok = scaling_round(&bytecode, 1, opt->reps) != 0;
+    for (int threads = 1; ok; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+        uint64_t elapsed = scaling_round(&bytecode, threads, opt->reps);
+        if (elapsed == 0) {
+            fprintf(stderr, "Error: '%s' failed on %d threads\n", name, threads);
+            ok = false;
+            break;
+        }
+        double runs_per_sec = (double) threads * opt->reps * 1e9 / elapsed;
+        if (threads == 1) base = runs_per_sec;
+        ScalingResult *r = &out[(*out_count)++];
+        *r = (ScalingResult){.name = strdup(name), .threads = threads, .runs_per_sec = runs_per_sec,
+                             .mops_per_sec = runs_per_sec * ops / 1e6, .speedup = runs_per_sec / base};
+        printf("%-14s %8d %14.1f %14.2f %10.2fx\n", name, threads, r->runs_per_sec, r->mops_per_sec, r->speedup);
+        if (threads == max_threads) break;
+    }
+    bb_free(&bytecode);
+    return ok;
+}
+
+// The --fibers workload. `task` counts to BENCH_FIBER_WORK. With fibers,
+// __entry spawns BENCH_FIBER_TASKS of them and joins each; otherwise it calls
+// task `calls` times.
+static char *bench_fiber_source(bool fibers, int calls) {
+    char *src = malloc(4096);
+    int len = sprintf(src, "task {\n    push 0\n    .loop:\n    push 1\n    add\n    dup\n    push %d\n    gte\n"
+                           "    jmpif .loop\n    add\n    return\n}\n\n", BENCH_FIBER_WORK - 1);
+    if (fibers) {
+        sprintf(src + len, "__entry {\n    push 0\n    .spawn:\n    dup\n    spawn task\n    swap\n    push 1\n    add\n"
+                           "    dup\n    push %d\n    gte\n    jmpif .spawn\n    drop\n    push %d\n    pop r0\n"
+                           "    .join:\n    join\n    drop\n    push r0\n    push -1\n    add\n    dup\n    pop r0\n"
+                           "    push 0\n    lt\n    jmpif .join\n    halt\n}\n",
+                BENCH_FIBER_TASKS - 1, BENCH_FIBER_TASKS);
+    } else {
+        sprintf(src + len, "__entry {\n    push 0\n    .loop:\n    dup\n    call task\n    drop\n    push 1\n    add\n"
+                           "    dup\n    push %d\n    gte\n    jmpif .loop\n    drop\n    halt\n}\n", calls - 1);
+    }
+    return src;
+}
+
+static bool bench_fiber_bytecode(bool fibers, int calls, ByteBuf *out) {
+    char *src = bench_fiber_source(fibers, calls);
+    ProstVM *vm = bench_vm();
+    bool ok = assemble(vm, src) == P_OK && p_link(vm) == P_OK;
+    if (ok) *out = p_to_bytecode(vm);
+    else fprintf(stderr, "Error: Failed to assemble the fiber workload\n");
+    p_free(vm);
+    free(src);
+    return ok;
+}
+
+// Median wall time in ns of the fiber version on `workers` workers, or 0 on
+// failure
+static uint64_t bench_fiber_round(const ByteBuf *bytecode, int workers, const BenchOptions *opt) {
+    double *samples = malloc(opt->reps * sizeof(double));
+    bool ok = true;
+    for (int i = -opt->warmup; i < opt->reps && ok; i++) {
+        uint64_t start = bench_now();
+        ProstVM *vm = bench_vm();
+        vm->fiber_workers = workers;
+        ok = p_from_bytecode_n(vm, (const char *) bytecode->data, bytecode->len) == P_OK && p_run(vm) == P_OK;
+        p_free(vm);
+        if (i >= 0) samples[i] = (double) (bench_now() - start);
+    }
+    uint64_t median = ok ? (uint64_t) bench_median(samples, opt->reps) : 0;
+    free(samples);
+    return median;
+}
+
+// The same for one VM per thread, each running its share of the tasks
+static uint64_t bench_vm_round(const ByteBuf *bytecode, int threads, const BenchOptions *opt) {
+    double *samples = malloc(opt->reps * sizeof(double));
+    bool ok = true;
+    for (int i = -opt->warmup; i < opt->reps && ok; i++) {
+        uint64_t elapsed = scaling_round(bytecode, threads, 1);
+        ok = elapsed != 0;
+        if (i >= 0) samples[i] = (double) elapsed;
+    }
+    uint64_t median = ok ? (uint64_t) bench_median(samples, opt->reps) : 0;
+    free(samples);
+    return median;
+}
+
+// A large program: functions with labels, jumps, register traffic and calls
+// to their neighbours.
+static char *bench_generate_source(void) {
+    size_t capacity = 1 << 20, len = 0;
+    char *src = malloc(capacity);
+    for (int f = 0; f < BENCH_GEN_FUNCTIONS; f++) {
+        if (capacity - len < 4096) {
+            capacity *= 2;
+            src = realloc(src, capacity);
+        }
+        len += sprintf(src + len, "fn_%d {\n    push %d\n    .loop_%d:\n", f, f, f);
+        for (int i = 0; i < 8; i++) {
+            len += sprintf(src + len, "    push r%d\n    push %d\n    add\n    pop r%d\n", i % 4, f + i, i % 4);
+        }
+        len += sprintf(src + len, "    push -1\n    add\n    dup\n    push 0\n    lt\n    jmpif .loop_%d\n", f);
+        len += sprintf(src + len, "    push \"fn_%d\"\n    drop\n", f);
+        if (f + 1 < BENCH_GEN_FUNCTIONS) len += sprintf(src + len, "    call fn_%d\n", f + 1);
+        len += sprintf(src + len, "    return\n}\n\n");
+    }
+    len += sprintf(src + len, "__entry {\n    push 1\n    call fn_0\n    halt\n}\n");
+    return src;
+}
+
+static bool bench_assemble(const char *name, int threads, const char *src, const BenchOptions *opt, BenchResult *out) {
+    double *samples = malloc(opt->reps * sizeof(double));
+    uint64_t ops = 0;
+    bool ok = true;
+    for (int i = -opt->warmup; i < opt->reps && ok; i++) {
+        ProstVM *vm = bench_vm();
+        uint64_t start = bench_now();
+        ok = assemble_jobs(vm, src, threads) == P_OK && p_link(vm) == P_OK;
+        uint64_t elapsed = bench_now() - start;
+        ops = bench_instruction_count(vm);
+        if (i >= 0) samples[i] = (double) elapsed / ops;
+        p_free(vm);
+    }
+    if (ok) *out = bench_summarize(name, ops, samples, opt->reps);
+    else fprintf(stderr, "Error: Failed to assemble the generated source for '%s'\n", name);
+    free(samples);
+    return ok;
+}
+
+static bool bench_load(const char *src, const BenchOptions *opt, BenchResult *out) {
+    char path[] = "/tmp/prost_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not create a temporary file\n");
+        return false;
+    }
+    ProstVM *vm = bench_vm();
+    if (assemble(vm, src) != P_OK || p_link(vm) != P_OK) {
+        fprintf(stderr, "Error: Failed to assemble the generated source for 'load'\n");
+        p_free(vm);
+        close(fd);
+        unlink(path);
+        return false;
+    }
+    uint64_t ops = bench_instruction_count(vm);
+    ByteBuf bytecode = p_to_bytecode(vm);
+    p_free(vm);
+    bool ok = write(fd, bytecode.data, bytecode.len) == (ssize_t) bytecode.len;
+    close(fd);
+    bb_free(&bytecode);
+
+    double *samples = malloc(opt->reps * sizeof(double));
+    for (int i = -opt->warmup; i < opt->reps && ok; i++) {
+        vm = bench_vm();
+        uint64_t start = bench_now();
+        ok = p_load_file(vm, path) == P_OK;
+        uint64_t elapsed = bench_now() - start;
+        if (i >= 0) samples[i] = (double) elapsed / ops;
+        p_free(vm);
+    }
+    if (ok) *out = bench_summarize("load", ops, samples, opt->reps);
+    else fprintf(stderr, "Error: Failed to load the generated bytecode\n");
+    free(samples);
+    unlink(path);
+    return ok;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static bool bench_selected(const BenchOptions *opt, const char *name) {
+    return !opt->filter || strstr(name, opt->filter) != NULL;
+}
+
+static void bench_write_json(FILE *f, BenchResult *results, size_t count, const BenchOptions *opt) {
+    fprintf(f, "{\n  \"config\": {\"nanbox\": %s, \"jit\": %s, \"computed_goto\": %s, \"warmup\": %d, \"reps\": %d},\n",
+#ifdef PROST_NANBOX
+            "true",
+#else
+            "false",
+#endif
+#ifdef PROST_JIT
+            "true",
+#else
+            "false",
+#endif
+#ifdef P_COMPUTED_GOTO
+            "true",
+#else
+            "false",
+#endif
+            opt->warmup, opt->reps);
+    fprintf(f, "  \"benchmarks\": [\n");
+    for (size_t i = 0; i < count; i++) {
+        BenchResult *r = &results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"ops\": %llu, \"reps\": %zu, \"median_ns_per_op\": %.4f, \"mean_ns_per_op\": %.4f, "
+                   "\"variance\": %.6f, \"min_ns_per_op\": %.4f, \"max_ns_per_op\": %.4f}%s\n",
+                r->name, (unsigned long long) r->ops, r->reps, r->median, r->mean, r->variance, r->min, r->max,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+static void bench_write_scaling_json(FILE *f, ScalingResult *results, size_t count, const BenchOptions *opt) {
+    fprintf(f, "{\n  \"config\": {\"reps\": %d},\n  \"scaling\": [\n", opt->reps);
+    for (size_t i = 0; i < count; i++) {
+        ScalingResult *r = &results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"threads\": %d, \"runs_per_sec\": %.3f, \"mops_per_sec\": %.3f, "
+                   "\"speedup\": %.4f}%s\n",
+                r->name, r->threads, r->runs_per_sec, r->mops_per_sec, r->speedup, i + 1 < count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+// The --threads mode: bench_scaling for every selected corpus program.
+// Returns the number of failures.
+static int run_scaling(const char *dir, char **names, size_t file_count, const BenchOptions *opt, int max_threads,
+                       const char *json_file) {
+    ScalingResult *scaling = calloc(file_count * (2 + (size_t) log2(max_threads)) + 1, sizeof(ScalingResult));
+    size_t scaling_count = 0;
+    int failures = 0;
+    printf("%-14s %8s %14s %14s %11s\n", "benchmark", "threads", "runs/s", "Mops/s", "speedup");
+    for (size_t i = 0; i < file_count; i++) {
+        char name[256];
+        snprintf(name, sizeof(name), "%.*s", (int) (strlen(names[i]) - 3), names[i]);
+        if (!bench_selected(opt, name)) continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        char *src = read_file(path);
+        if (!src || !bench_scaling(name, src, opt, max_threads, scaling, &scaling_count)) failures++;
+        free(src);
+    }
+    if (json_file) {
+        FILE *f = fopen(json_file, "w");
+        if (f) {
+            bench_write_scaling_json(f, scaling, scaling_count, opt);
+            fclose(f);
+        } else {
+            fprintf(stderr, "Error: Could not write to file '%s'\n", json_file);
+            failures++;
+        }
+    }
+    for (size_t i = 0; i < scaling_count; i++) free(scaling[i].name);
+    free(scaling);
+    return failures;
+}
+
+static void bench_write_fibers_json(FILE *f, FiberResult *results, size_t count, const BenchOptions *opt) {
+    fprintf(f, "{\n  \"config\": {\"tasks\": %d, \"work\": %d, \"warmup\": %d, \"reps\": %d},\n  \"fibers\": [\n",
+            BENCH_FIBER_TASKS, BENCH_FIBER_WORK, opt->warmup, opt->reps);
+    for (size_t i = 0; i < count; i++) {
+        FiberResult *r = &results[i];
+        fprintf(f, "    {\"workers\": %d, \"fiber_tasks_per_sec\": %.1f, \"vm_tasks_per_sec\": %.1f}%s\n",
+                r->workers, r->fiber_tasks_per_sec, r->vm_tasks_per_sec, i + 1 < count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+// The --fibers mode. Returns the number of failures.
+static int run_fibers(const BenchOptions *opt, int max_workers, const char *json_file) {
+    ByteBuf fiber_code;
+    if (!bench_fiber_bytecode(true, 0, &fiber_code)) return 1;
+
+    FiberResult *results = calloc(2 + (size_t) log2(max_workers), sizeof(FiberResult));
+    size_t count = 0;
+    int failures = 0;
+    printf("%d tasks of %d iterations\n", BENCH_FIBER_TASKS, BENCH_FIBER_WORK);
+    printf("%8s %16s %18s %8s\n", "workers", "fibers tasks/s", "VM/thread tasks/s", "ratio");
+    for (int workers = 1;; workers = workers * 2 < max_workers ? workers * 2 : max_workers) {
+        // Each thread runs its share; a remainder goes uncounted
+        int calls = BENCH_FIBER_TASKS / workers;
+        ByteBuf vm_code;
+        if (!bench_fiber_bytecode(false, calls, &vm_code)) {
+            failures++;
+            break;
+        }
+        uint64_t fiber_ns = bench_fiber_round(&fiber_code, workers, opt);
+        uint64_t vm_ns = bench_vm_round(&vm_code, workers, opt);
+        bb_free(&vm_code);
+        if (fiber_ns == 0 || vm_ns == 0) {
+            fprintf(stderr, "Error: The fiber workload failed on %d workers\n", workers);
+            failures++;
+            break;
+        }
+
+        FiberResult *r = &results[count++];
+        *r = (FiberResult){.workers = workers, .fiber_tasks_per_sec = BENCH_FIBER_TASKS * 1e9 / fiber_ns,
+                           .vm_tasks_per_sec = (double) calls * workers * 1e9 / vm_ns};
+        printf("%8d %16.1f %18.1f %7.2fx\n", workers, r->fiber_tasks_per_sec, r->vm_tasks_per_sec,
+               r->fiber_tasks_per_sec / r->vm_tasks_per_sec);
+        if (workers == max_workers) break;
+    }
+
+    if (json_file) {
+        FILE *f = fopen(json_file, "w");
+        if (f) {
+            bench_write_fibers_json(f, results, count, opt);
+            fclose(f);
+        } else {
+            fprintf(stderr, "Error: Could not write to file '%s'\n", json_file);
+            failures++;
+        }
+    }
+    free(results);
+    bb_free(&fiber_code);
+    return failures;
+}
+
+static void print_usage(const char *prog) {
+    printf("Usage: %s [OPTIONS]\n\n", prog);
+    printf("Options:\n");
+    printf("  -h, --help           Show this help message\n");
+    printf("  -d, --dir DIR        Benchmark corpus (default: %s)\n", PROST_BENCH_DIR);
+    printf("  -f, --filter TEXT    Only run benchmarks whose name contains TEXT\n");
+    printf("  -w, --warmup N       Untimed runs before measuring (default: 2)\n");
+    printf("  -n, --reps N         Timed runs (default: 10)\n");
+    printf("  -j, --json FILE      Also write the results as JSON\n");
+    printf("  -t, --threads N      Measure throughput of the corpus on 1, 2, 4, ... N threads instead,\n");
+    printf("                       0 for up to one per CPU (--reps runs per thread)\n");
+    printf("  -F, --fibers N       Compare a fan-out workload on fibers with one VM per thread, on\n");
+    printf("                       1, 2, 4, ... N workers, 0 for up to one per CPU\n");
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opt = {.warmup = 2, .reps = 10, .filter = NULL};
+    const char *dir = PROST_BENCH_DIR;
+    const char *json_file = NULL;
+    int max_threads = -1;
+    int max_workers = -1;
+
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"dir", required_argument, 0, 'd'},
+        {"filter", required_argument, 0, 'f'},
+        {"warmup", required_argument, 0, 'w'},
+        {"reps", required_argument, 0, 'n'},
+        {"json", required_argument, 0, 'j'},
+        {"threads", required_argument, 0, 't'},
+        {"fibers", required_argument, 0, 'F'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "hd:f:w:n:j:t:F:", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'f':
+                opt.filter = optarg;
+                break;
+            case 'w':
+                opt.warmup = atoi(optarg);
+                break;
+            case 'n':
+                opt.reps = atoi(optarg);
+                break;
+            case 'j':
+                json_file = optarg;
+                break;
+            case 't':
+                max_threads = atoi(optarg);
+                if (max_threads == 0) max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+                if (max_threads <= 0) {
+                    fprintf(stderr, "Error: Invalid thread count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'F':
+                max_workers = atoi(optarg);
+                if (max_workers == 0) max_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+                if (max_workers <= 0) {
+                    fprintf(stderr, "Error: Invalid worker count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (opt.reps <= 0 || opt.warmup < 0) {
+        fprintf(stderr, "Error: --reps must be positive and --warmup not negative\n");
+        return 1;
+    }
+    if (max_workers > 0) {
+        return run_fibers(&opt, max_workers, json_file) ? 1 : 0;
+    }
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Error: Could not open benchmark directory '%s'\n", dir);
+        return 1;
+    }
+    XVec files = xvec_create(8);
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len > 3 && strcmp(entry->d_name + len - 3, ".pa") == 0) {
+            xvec_push(&files, word_pointer(strdup(entry->d_name), true));
+        }
+    }
+    closedir(d);
+
+    size_t file_count = xvec_len(&files);
+    char **names = malloc((file_count + 1) * sizeof(char *));
+    for (size_t i = 0; i < file_count; i++) names[i] = xvec_get(&files, i)->as_pointer;
+    qsort(names, file_count, sizeof(char *), compare_names);
+
+    if (max_threads > 0) {
+        int failures = run_scaling(dir, names, file_count, &opt, max_threads, json_file);
+        free(names);
+        xvec_free(&files);
+        return failures ? 1 : 0;
+    }
+
+    BenchResult *results = calloc(file_count + 3, sizeof(BenchResult));
+    size_t result_count = 0;
+    int failures = 0;
+
+
+    printf("%-14s %12s %12s %12s %12s %12s\n", "benchmark", "ops", "median ns/op", "mean ns/op", "stddev", "min ns/op");
+    for (size_t i = 0; i < file_count + 3; i++) {
+        BenchResult r;
+        bool ok;
+        if (i < file_count) {
+            char name[256];
+            snprintf(name, sizeof(name), "%.*s", (int) (strlen(names[i]) - 3), names[i]);
+            if (!bench_selected(&opt, name)) continue;
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+            char *src = read_file(path);
+            ok = src && bench_program(name, src, &opt, &r);
+            free(src);
+        } else {
+            static const char *const builtins[] = {"assemble", "assemble-jobs", "load"};
+            const char *name = builtins[i - file_count];
+            if (!bench_selected(&opt, name)) continue;
+            char *src = bench_generate_source();
+            if (i - file_count < 2) ok = bench_assemble(name, i == file_count ? 1 : 0, src, &opt, &r);
+            else ok = bench_load(src, &opt, &r);
+            free(src);
+        }
+        if (!ok) {
+            failures++;
+            continue;
+        }
+        printf("%-14s %12llu %12.3f %12.3f %12.3f %12.3f\n", r.name, (unsigned long long) r.ops, r.median, r.mean,
+               sqrt(r.variance), r.min);
+        results[result_count++] = r;
+    }
+
+    if (json_file) {
+        FILE *f = fopen(json_file, "w");
+        if (f) {
+            bench_write_json(f, results, result_count, &opt);
+            fclose(f);
+        } else {
+            fprintf(stderr, "Error: Could not write to file '%s'\n", json_file);
+            failures++;
+        }
+    }
+
+    for (size_t i = 0; i < result_count; i++) free(results[i].name);
+    free(results);
+    free(names);
+    xvec_free(&files);
+    return failures ? 1 : 0;
+}
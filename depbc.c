@@ -2,7 +2,7 @@
 #define PROST_IMPLEMENTATION
 #include "prost/prost.h"
 
-static char *read_file(const char *path) {
+static char *read_file(const char *path, size_t *out_size) {
     FILE *f = fopen(path, "rb");
     if (!f) {
         fprintf(stderr, "Error: Could not open file '%s'\n", path);
@@ -13,96 +13,49 @@ static char *read_file(const char *path) {
     long size = ftell(f);
     fseek(f, 0, SEEK_SET);
 
-    char *content = malloc(size + 1);
+    char *content = size >= 0 ? malloc(size + 1) : NULL;
     if (!content) {
         fclose(f);
         return NULL;
     }
 
-    fread(content, 1, size, f);
-    content[size] = '\0';
+    *out_size = fread(content, 1, size, f);
+    content[*out_size] = '\0';
     fclose(f);
 
     return content;
 }
 
-const char *p_instr_to_str(InstructionType t) {
-    switch (t) {
-        case Push: {
-            return "push";
-        } break;
-        case Pop: {
-            return "pop";
-        } break;
-        case Drop: {
-            return "drop";
-        } break;
-        case Halt: {
-            return "halt";
-        } break;
-        case Call: {
-            return "call";
-        } break;
-        case CallExtern: {
-            return "call_extern";
-        } break;
-        case Return: {
-            return "return";
-        } break;
-        case Jmp: {
-            return "jmp";
-        } break;
-        case JmpIf: {
-            return "jmp_if";
-        } break;
-        case Dup: {
-            return "dup";
-        } break;
-        case Swap: {
-            return "swap";
-        } break;
-        case Over: {
-            return "over";
-        } break;
-        case Eq: {
-            return "eq";
-        } break;
-        case Neq: {
-            return "neq";
-        } break;
-        case Lt: {
-            return "lt";
-        } break;
-        case Lte: {
-            return "lte";
-        } break;
-        case Gt: {
-            return "gt";
-        } break;
-        case Gte: {
-            return "gte";
-        } break;
-    }
-}
-
 int main(int argc, char **argv) {
     ProstVM *vm = p_init();
     if (argc < 2) {
         fprintf(stderr, "Usage: depbc <file.pco>\n");
         return 1;
     }
-    FILE *f = fopen(argv[1], "rb");
-    char *bytecode = read_file(argv[1]);
-    p_from_bytecode(vm, bytecode);
+    size_t size;
+    char *bytecode = read_file(argv[1], &size);
+    if (!bytecode || p_decode_bytecode_n(vm, bytecode, size) != P_OK) {
+        fprintf(stderr, "Error: Could not decode '%s'\n", argv[1]);
+        free(bytecode);
+        p_free(vm);
+        return 1;
+    }
 
     printf("Prost Bytecode Decompiler v0.1\n");
 
-    for (size_t i = 0; i < vm->functions.size; i++) {
-        printf("%s {\n", vm->functions.entries[i].key);
-        Function *fn = (Function*)vm->functions.entries[i].value.as_pointer;
-        for (size_t j = 0; j < xvec_len(&fn->instructions); j++) {
-            Instruction *instr = ((Instruction *)xvec_get(&fn->instructions, j)->as_pointer);
-            printf("%s %s\n", p_instr_to_str(instr->type), word_to_str(&instr->arg));
+    for (size_t i = 0; i < xvec_len(&vm->function_list); i++) {
+        Function *fn = (Function *)xvec_get(&vm->function_list, i)->as_pointer;
+        printf("%s {\n", fn->name);
+        for (size_t j = 0; j < fn->instructions.count; j++) {
+            Instruction *instr = &fn->instructions.data[j];
+            Word arg = p_arg(instr);
+            if (instr->type == CallDirect) {
+                printf("%s %s\n", p_instr_to_str(instr->type), ((Function *)arg.as_pointer)->name);
+            } else if (p_instr_has_aux(instr->type)) {
+                printf("%s %s %d\n", p_instr_to_str(instr->type), word_to_str(&arg), instr->aux);
+            } else {
+                printf("%s %s\n", p_instr_to_str(instr->type), word_to_str(&arg));
+            }
         }
         printf("}\n");
     }
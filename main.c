@@ -1,559 +1,440 @@
 #define PROST_IMPLEMENTATION
 #include "prost/prost.h"
 #include "prost/std.h"
-#include <ctype.h>
+#include "prost/assembler.h"
+#include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-typedef enum {
-    TOK_NUM,
-    TOK_IDENT,
-    TOK_STR,
-    TOK_LBRACE,
-    TOK_LPAREN,
-    TOK_RBRACE,
-    TOK_RPAREN,
-    TOK_COLON,
-    TOK_DOT,
-    TOK_AT,
-    TOK_STAR,
-    TOK_EQ,
-    TOK_EOF,
-} TokenKind;
-
-typedef struct {
-    TokenKind kind;
-    char *lexeme;
-    int line;
-    int col;
-} Token;
-
+// How load_program assembles sources, as -j and --inline* do for a single file
 typedef struct {
-    const char *input;
-    size_t pos;
-    size_t len;
-    int line;
-    int col;
-} Tokenizer;
-
-typedef struct {
-    char *name;
-    size_t position;
-} Label;
+    int jobs;
+    bool inline_enabled;
+    size_t inline_size;
+    int inline_depth;
+} LoadOptions;
+
+// Loads path (.pa or .pco) into vm, ready to run. Sources are assembled
+// straight into the VM, then linked, optimized and verified like loaded
+// bytecode.
+static ProstStatus load_program(ProstVM *vm, const char *path, const LoadOptions *options) {
+    size_t len = strlen(path);
+    if (len > 4 && strcmp(path + len - 4, ".pco") == 0)
+        return p_load_file(vm, path);
+
+    char *source = read_file(path);
+    if (!source)
+        return P_ERR_INVALID_BYTECODE;
+    ProstStatus status = assemble_jobs(vm, source, options->jobs);
+    free(source);
+    if (status == P_OK && options->inline_enabled)
+        inline_functions(vm, options->inline_size, options->inline_depth);
+    if (status == P_OK)
+        status = p_prepare(vm);
+    return status;
+}
 
 typedef struct {
-    Label *labels;
-    size_t count;
-    size_t capacity;
-} LabelTable;
+    const char *path;
+    ProstStatus status;
+    int exit_code;
+} ParallelRun;
 
 typedef struct {
-    Token *tokens;
-    size_t pos;
+    ParallelRun *runs;
     size_t count;
-    ProstVM *vm;
-    LabelTable *current_labels;
-} ParserState;
-
-static void label_table_init(LabelTable *lt) {
-    lt->labels = NULL;
-    lt->count = 0;
-    lt->capacity = 0;
-}
-
-static void label_table_free(LabelTable *lt) {
-    for (size_t i = 0; i < lt->count; i++) {
-        free(lt->labels[i].name);
-    }
-    free(lt->labels);
-}
-
-static void label_table_add(LabelTable *lt, const char *name, size_t position) {
-    if (lt->count >= lt->capacity) {
-        lt->capacity = lt->capacity == 0 ? 8 : lt->capacity * 2;
-        lt->labels = realloc(lt->labels, lt->capacity * sizeof(Label));
-    }
-    lt->labels[lt->count].name = strdup(name);
-    lt->labels[lt->count].position = position;
-    lt->count++;
-}
-
-static bool label_table_find(LabelTable *lt, const char *name, size_t *out_position) {
-    for (size_t i = 0; i < lt->count; i++) {
-        if (strcmp(lt->labels[i].name, name) == 0) {
-            *out_position = lt->labels[i].position;
-            return true;
+    atomic_size_t next;
+    XVec *libraries;
+    size_t stack_size;
+    size_t max_call_depth;
+    size_t fiber_workers;
+    bool optimize;
+    bool verify;
+    LoadOptions load;
+#ifdef PROST_JIT
+    bool jit;
+    long jit_threshold;
+#endif
+} ParallelPool;
+
+static void *parallel_worker(void *arg) {
+    ParallelPool *pool = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&pool->next, 1)) < pool->count) {
+        ParallelRun *run = &pool->runs[i];
+        ProstVM *vm = p_init();
+        if (!vm) {
+            run->status = P_ERR_INVALID_VM_STATE;
+            continue;
         }
-    }
-    return false;
-}
-
-static void tok_init(Tokenizer *t, const char *src) {
-    t->input = src;
-    t->pos = 0;
-    t->len = strlen(src);
-    t->line = 1;
-    t->col = 1;
-}
-
-static char tok_peek(Tokenizer *t) {
-    if (t->pos >= t->len)
-        return '\0';
-    return t->input[t->pos];
-}
-
-static char tok_advance(Tokenizer *t) {
-    if (t->pos >= t->len)
-        return '\0';
-    char c = t->input[t->pos++];
-    if (c == '\n') {
-        t->line++;
-        t->col = 1;
-    } else {
-        t->col++;
-    }
-    return c;
+        register_std(vm);
+        vm->optimize = pool->optimize;
+#ifdef PROST_JIT
+        vm->jit = pool->jit;
+        if (pool->jit_threshold >= 0)
+            vm->jit_threshold = (uint32_t) pool->jit_threshold;
+#endif
+        if (pool->max_call_depth)
+            vm->max_call_depth = pool->max_call_depth;
+        vm->fiber_workers = pool->fiber_workers;
+        if (pool->verify)
+            vm->verify_report = stderr;
+        run->status = pool->stack_size ? p_set_stack_capacity(vm, pool->stack_size) : P_OK;
+        for (int l = 0; run->status == P_OK && l < xvec_len(pool->libraries); l++) {
+            p_load_library(vm, (const char *) xvec_get(pool->libraries, l)->as_pointer);
+        }
+        if (run->status == P_OK)
+            run->status = load_program(vm, run->path, &pool->load);
+        if (run->status == P_OK)
+            run->status = p_run(vm);
+        run->exit_code = vm->exit_code;
+        p_free(vm);
+    }
+    return NULL;
 }
 
-static void tok_skip_whitespace(Tokenizer *t) {
-    while (1) {
-        char c = tok_peek(t);
-        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
-            tok_advance(t);
-        } else if (c == ';') {
-            while (tok_peek(t) && tok_peek(t) != '\n') {
-                tok_advance(t);
-            }
+// Runs each file in its own VM, `threads` at a time, then reports how each
+// one ended. Returns the exit code.
+static int run_parallel(char **files, int count, int threads, ParallelPool *pool) {
+    pool->runs = calloc(count, sizeof(ParallelRun));
+    pool->count = count;
+    atomic_init(&pool->next, 0);
+    for (int i = 0; i < count; i++) pool->runs[i].path = files[i];
+
+    if (threads == 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > count)
+        threads = count;
+    if (threads < 1)
+        threads = 1;
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, parallel_worker, pool) == 0) started++;
+    if (started == 0)
+        parallel_worker(pool);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        ParallelRun *run = &pool->runs[i];
+        if (run->status == P_OK) {
+            fprintf(stderr, "%s: exit code %d\n", run->path, run->exit_code);
         } else {
-            break;
+            fprintf(stderr, "%s: failed (status %d)\n", run->path, run->status);
+            failures++;
         }
     }
+    free(pool->runs);
+    return failures ? 1 : 0;
 }
 
-static Token tok_make_token(TokenKind kind, char *lexeme, int line, int col) {
-    Token tok;
-    tok.kind = kind;
-    tok.lexeme = lexeme;
-    tok.line = line;
-    tok.col = col;
-    return tok;
-}
+#ifdef PROST_JIT
 
-static char *tok_extract_range(const char *src, size_t start, size_t end) {
-    size_t len = end - start;
-    char *s = malloc(len + 1);
-    memcpy(s, src + start, len);
-    s[len] = '\0';
-    return s;
-}
-
-static Token tok_next(Tokenizer *t) {
-    tok_skip_whitespace(t);
-
-    if (tok_peek(t) == '\0') {
-        return tok_make_token(TOK_EOF, NULL, t->line, t->col);
-    }
-
-    int start_line = t->line;
-    int start_col = t->col;
-    char c = tok_peek(t);
-
-    if (c == '{') {
-        tok_advance(t);
-        return tok_make_token(TOK_LBRACE, NULL, start_line, start_col);
-    }
-    if (c == '}') {
-        tok_advance(t);
-        return tok_make_token(TOK_RBRACE, NULL, start_line, start_col);
-    }
-    if (c == '(') {
-        tok_advance(t);
-        return tok_make_token(TOK_LPAREN, NULL, start_line, start_col);
-    }
-    if (c == ')') {
-        tok_advance(t);
-        return tok_make_token(TOK_RPAREN, NULL, start_line, start_col);
-    }
-    if (c == ':') {
-        tok_advance(t);
-        return tok_make_token(TOK_COLON, NULL, start_line, start_col);
-    }
-    if (c == '.') {
-        tok_advance(t);
-        return tok_make_token(TOK_DOT, NULL, start_line, start_col);
-    }
-    if (c == '@') {
-        tok_advance(t);
-        return tok_make_token(TOK_AT, NULL, start_line, start_col);
-    }
-    if (c == '*') {
-        tok_advance(t);
-        return tok_make_token(TOK_STAR, NULL, start_line, start_col);
-    }
-    if (c == '=') {
-        tok_advance(t);
-        return tok_make_token(TOK_EQ, NULL, start_line, start_col);
-    }
-
-    if (c == '"') {
-        tok_advance(t);
-        size_t start = t->pos;
-        while (tok_peek(t) && tok_peek(t) != '"') {
-            if (tok_peek(t) == '\\')
-                tok_advance(t);
-            tok_advance(t);
-        }
-        size_t end = t->pos;
-        if (tok_peek(t) == '"')
-            tok_advance(t);
-        char *lexeme = tok_extract_range(t->input, start, end);
-        return tok_make_token(TOK_STR, lexeme, start_line, start_col);
-    }
-
-    if (isdigit(c) || (c == '-' && t->pos + 1 < t->len && isdigit(t->input[t->pos + 1]))) {
-        size_t start = t->pos;
-        if (c == '-')
-            tok_advance(t);
-        while (isdigit(tok_peek(t)))
-            tok_advance(t);
-        char *lexeme = tok_extract_range(t->input, start, t->pos);
-        return tok_make_token(TOK_NUM, lexeme, start_line, start_col);
-    }
-
-    if (isalpha(c) || c == '_') {
-        size_t start = t->pos;
-        while (isalnum(tok_peek(t)) || tok_peek(t) == '_')
-            tok_advance(t);
-        char *lexeme = tok_extract_range(t->input, start, t->pos);
-        return tok_make_token(TOK_IDENT, lexeme, start_line, start_col);
-    }
+typedef struct {
+    ProstStatus status;
+    char *output;
+    ByteBuf stack;
+    size_t compiled;
+} TierResult;
+
+// Loads path (.pa or .pco) into a fresh VM and runs it, capturing what it
+// prints and leaves on the stack.
+static TierResult run_tier(const char *path, XVec *libraries, bool jit) {
+    TierResult r = {0};
+    bb_init(&r.stack, 64);
 
-    tok_advance(t);
-    return tok_make_token(TOK_EOF, NULL, start_line, start_col);
+    ProstVM *vm = p_init();
+    register_std(vm);
+    vm->jit = jit;
+    vm->jit_threshold = 0; // compile every function on first entry
+    for (int i = 0; i < xvec_len(libraries); i++) {
+        p_load_library(vm, (const char *) xvec_get(libraries, i)->as_pointer);
+    }
+
+    fflush(stdout);
+    FILE *capture = tmpfile();
+    int saved_stdout = dup(STDOUT_FILENO);
+    dup2(fileno(capture), STDOUT_FILENO);
+
+    r.status = load_program(vm, path, &(LoadOptions){.jobs = 1});
+    if (r.status == P_OK)
+        r.status = p_run(vm);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    long size = ftell(capture);
+    r.output = calloc(size + 1, 1);
+    rewind(capture);
+    fread(r.output, 1, size, capture);
+    fclose(capture);
+
+    for (size_t i = 0; i < p_stack_size(vm); i++) {
+        Word w = p_stack_get(vm, i);
+        // heap addresses differ between runs; only compare strings and scalars
+        const char *type = word_type_to_str(w.type);
+        const char *s = (w.type == WPOINTER && !word_is_string(&w)) ? "<pointer>" : word_to_str(&w);
+        bb_append(&r.stack, type, strlen(type));
+        bb_push(&r.stack, ':');
+        bb_append(&r.stack, s, strlen(s));
+        bb_push(&r.stack, '\n');
+    }
+
+    r.compiled = vm->jit_compiled;
+    p_free(vm);
+    return r;
 }
 
-static Token *tok_tokenize(const char *src, size_t *out_count) {
-    Tokenizer t;
-    tok_init(&t, src);
-
-    Token *tokens = NULL;
-    size_t count = 0;
-    size_t capacity = 0;
-
-    while (1) {
-        Token tok = tok_next(&t);
-
-        if (count >= capacity) {
-            capacity = capacity == 0 ? 16 : capacity * 2;
-            tokens = realloc(tokens, capacity * sizeof(Token));
+// Runs each file interpreted and with every function JIT-compiled and reports
+// any difference in status, output or final stack. Returns the exit code.
+static int jit_diff(char **files, int count, XVec *libraries) {
+    int failures = 0;
+
+    for (int f = 0; f < count; f++) {
+        TierResult interp = run_tier(files[f], libraries, false);
+        TierResult jit = run_tier(files[f], libraries, true);
+
+        const char *mismatch = NULL;
+        if (interp.status != jit.status) mismatch = "status";
+        else if (strcmp(interp.output, jit.output) != 0) mismatch = "output";
+        else if (interp.stack.len != jit.stack.len ||
+                 memcmp(interp.stack.data, jit.stack.data, interp.stack.len) != 0) mismatch = "stack";
+
+        if (mismatch) {
+            failures++;
+            printf("MISMATCH %s: %s differs (interpreter status %d, jit status %d)\n",
+                   files[f], mismatch, interp.status, jit.status);
+        } else {
+            printf("OK %s (%zu functions compiled)\n", files[f], jit.compiled);
         }
 
-        tokens[count++] = tok;
-        if (tok.kind == TOK_EOF)
-            break;
+        free(interp.output);
+        free(jit.output);
+        bb_free(&interp.stack);
+        bb_free(&jit.stack);
     }
 
-    *out_count = count;
-    return tokens;
+    return failures ? 1 : 0;
 }
+#endif
 
-static Token parser_peek(ParserState *p) {
-    if (p->pos >= p->count) {
-        return (Token){TOK_EOF, NULL, 0, 0};
-    }
-    return p->tokens[p->pos];
+static void print_usage(const char *prog) {
+    printf("Usage: %s [OPTIONS] <input_file>\n\n", prog);
+    printf("Options:\n");
+    printf("  -h, --help           Show this help message\n");
+    printf("  -o, --output FILE    Output bytecode file (default: out.pco)\n");
+    printf("  -d, --library FILE   Load a library\n");
+    printf("  -r, --dont-run       Don't run the bytecode after compilation\n");
+    printf("  -c, --dont-compile   Don't compile, only run (for .pa files)\n");
+    printf("  -v, --verbose        Enable verbose output\n");
+    printf("  -j, --jobs N         Assemble functions on N threads, 0 for one per CPU (default: 1)\n");
+    printf("  -p, --parallel N     Run every input file in its own VM, N at a time, 0 for one per CPU\n");
+    printf("      --no-fuse        Don't fuse instruction sequences or turn calls into tail calls\n");
+    printf("      --fusion-stats   Print which superinstruction fusions fired\n");
+    printf("      --inline         Inline small functions into their callers (.pa files)\n");
+    printf("      --inline-size N  Largest function to inline, in instructions (default: %d, implies --inline)\n", INLINE_DEFAULT_SIZE);
+    printf("      --inline-depth N Levels of nested inlining (default: %d, implies --inline)\n", INLINE_DEFAULT_DEPTH);
+    printf("      --profile[=FILE] Print per-opcode, function and external counts and times, and write\n");
+    printf("                       collapsed stacks for flamegraph tools to FILE (default: prost.folded)\n");
+    printf("      --sample[=HZ]    Sample the running program with SIGPROF (default: %d Hz), print the hot\n", P_SAMPLE_DEFAULT_HZ);
+    printf("                       functions and ranges, and write collapsed stacks to the sample file\n");
+    printf("      --sample-file FILE  Where --sample writes collapsed stacks (default: prost.samples.folded)\n");
+    printf("      --cache[=DIR]    Reuse the bytecode of unchanged programs, cached in DIR\n");
+    printf("                       (default: $PROST_CACHE_DIR, else ~/.cache/prost)\n");
+    printf("      --verify         Reject bytecode that fails verification before running it\n");
+    printf("      --stack-size N   Operand stack capacity in values (default: %d)\n", P_STACK_DEFAULT_CAPACITY);
+    printf("      --max-call-depth N  Maximum number of nested calls (default: %d)\n", P_MAX_CALL_DEPTH);
+    printf("      --fibers N       Run spawned fibers on N threads, 0 for one per CPU (default: 0)\n");
+#ifdef PROST_JIT
+    printf("      --no-jit         Interpret only, never compile functions\n");
+    printf("      --jit-threshold N  Calls plus backward jumps before a function is compiled (default: %d)\n", P_JIT_THRESHOLD);
+    printf("      --jit-diff       Run each input file interpreted and JIT-compiled and compare the results\n");
+#endif
+    printf("\nFile Extensions:\n");
+    printf("  .pa  - Prost Assembly (source code)\n");
+    printf("  .pco - Prost Compiled Object (bytecode)\n");
 }
 
-static Token parser_advance(ParserState *p) {
-    if (p->pos >= p->count) {
-        return (Token){TOK_EOF, NULL, 0, 0};
-    }
-    return p->tokens[p->pos++];
-}
+// Compile cache entries are .pco files named by a 128-bit hash of what they
+// were built from. The key covers the mnemonic and opcode tables on its own
+// (cache_key_add_assembler); bump CACHE_VERSION for other changes to the
+// assembler's output.
+#define CACHE_VERSION 3
 
-static bool parser_check(ParserState *p, TokenKind kind) {
-    return parser_peek(p).kind == kind;
+typedef struct {
+    uint64_t a, b;
+} CacheKey;
+
+// Two independent 64-bit multiply-xorshift lanes, eight bytes at a time
+static void cache_key_add(CacheKey *key, const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint64_t a = key->a, b = key->b, w;
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        a = (a ^ w) * 0x100000001b3ull;
+        a ^= a >> 32;
+        b = (b + w) * 0xff51afd7ed558ccdull;
+        b ^= b >> 29;
+    }
+    w = (uint64_t) len << 56;
+    memcpy(&w, p, len);
+    a = (a ^ w) * 0x100000001b3ull;
+    a ^= a >> 32;
+    b = (b + w) * 0xff51afd7ed558ccdull;
+    b ^= b >> 29;
+    key->a = a;
+    key->b = b;
 }
 
-static Token parser_expect(ParserState *p, TokenKind kind) {
-    Token tok = parser_advance(p);
-    if (tok.kind != kind) {
-        fprintf(stderr, "Parse error at %d:%d: unexpected token\n", tok.line, tok.col);
-        exit(1);
+// Adding or changing a mnemonic or an opcode changes the key without a bump
+static void cache_key_add_assembler(CacheKey *key) {
+    for (size_t i = 0; i < ASM_MNEMONIC_SLOTS; i++) {
+        const Mnemonic *m = &asm_mnemonics[i];
+        if (!m->name) continue;
+        uint32_t entry[2] = {(uint32_t) m->kind, (uint32_t) m->type};
+        cache_key_add(key, m->name, m->len + 1);
+        cache_key_add(key, entry, sizeof(entry));
     }
-    return tok;
-}
-
-static bool parser_match(ParserState *p, TokenKind kind) {
-    if (parser_check(p, kind)) {
-        parser_advance(p);
-        return true;
+    for (int t = 0; t < INSTRUCTION_COUNT; t++) {
+        const char *name = p_instr_to_str((InstructionType) t);
+        cache_key_add(key, name, strlen(name) + 1);
     }
-    return false;
 }
 
-static void inst_array_push(InstructionArray *arr, Instruction inst) {
-    if (arr->count >= arr->capacity) {
-        arr->capacity = arr->capacity == 0 ? 16 : arr->capacity * 2;
-        arr->data = realloc(arr->data, arr->capacity * sizeof(Instruction));
-    }
-    arr->data[arr->count++] = inst;
+static char *cache_path(const char *dir, CacheKey key) {
+    size_t len = strlen(dir) + 40;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/%016llx%016llx.pco", dir, (unsigned long long) key.a, (unsigned long long) key.b);
+    return path;
 }
 
-static InstructionArray parse_func_body(ParserState *p) {
-    InstructionArray instructions;
-    instructions.data = NULL;
-    instructions.count = 0;
-    instructions.capacity = 0;
-
-    while (!parser_check(p, TOK_RBRACE) && !parser_check(p, TOK_EOF)) {
-        Token tok = parser_peek(p);
-
-        if (tok.kind == TOK_DOT) {
-            parser_advance(p);
-            Token label_name = parser_expect(p, TOK_IDENT);
-            parser_expect(p, TOK_COLON);
-            label_table_add(p->current_labels, label_name.lexeme, instructions.count);
-            continue;
-        }
-
-        if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "push") == 0) {
-            parser_advance(p);
-            Token arg = parser_advance(p);
-            Instruction inst = {Push, WORD(0)};
-            if (parser_check(p, TOK_AT)) {
-                parser_advance(p);
-                Token name = parser_expect(p, TOK_NUM);
-                inst.type = PushRegister;
-                inst.arg = WORD(atoi(name.lexeme));
-            } else {
-                if (arg.kind == TOK_NUM) {
-                    inst.arg = WORD((uint64_t)atoll(arg.lexeme));
-                } else if (arg.kind == TOK_STR) {
-                    inst.arg = word_string(arg.lexeme);
-                } else if (arg.kind == TOK_IDENT) {
-                    inst.arg = word_string(arg.lexeme);
-                }
-            }
-
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "pop") == 0) {
-            parser_advance(p);
-            Token arg = parser_advance(p);
-            if (arg.kind == TOK_IDENT) {
-                Instruction inst = {Pop, word_string(arg.lexeme)};
-                inst_array_push(&instructions, inst);
-            }
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "drop") == 0) {
-            parser_advance(p);
-            Instruction inst = {Drop, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && (strcmp(tok.lexeme, "halt") == 0 || strcmp(tok.lexeme, "ret") == 0)) {
-            parser_advance(p);
-            Instruction inst = {Halt, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "return") == 0) {
-            parser_advance(p);
-            Instruction inst = {Return, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "call") == 0) {
-            parser_advance(p);
-            Instruction inst;
-            if (parser_check(p, TOK_AT)) {
-                parser_advance(p);
-                Token name = parser_expect(p, TOK_IDENT);
-                inst.type = CallExtern;
-                inst.arg = WORD(strdup(name.lexeme));
-            } else {
-                Token name = parser_expect(p, TOK_IDENT);
-                inst.type = Call;
-                inst.arg = WORD(strdup(name.lexeme));
-            }
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "jmp") == 0) {
-            parser_advance(p);
-            Token target = parser_advance(p);
-            Instruction inst = {Jmp, WORD(0)};
-            if (target.kind == TOK_DOT) {
-                Token label_name = parser_expect(p, TOK_IDENT);
-                inst.arg = word_string(label_name.lexeme);
-            } else if (target.kind == TOK_NUM) {
-                inst.arg = WORD(atoi(target.lexeme));
-            }
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "jmpif") == 0) {
-            parser_advance(p);
-            Token target = parser_advance(p);
-            Instruction inst = {JmpIf, WORD(0)};
-            if (target.kind == TOK_DOT) {
-                Token label_name = parser_expect(p, TOK_IDENT);
-                inst.arg = word_string(label_name.lexeme);
-            } else if (target.kind == TOK_NUM) {
-                inst.arg = WORD(atoi(target.lexeme));
-            }
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "dup") == 0) {
-            parser_advance(p);
-            Instruction inst = {Dup, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "swap") == 0) {
-            parser_advance(p);
-            Instruction inst = {Swap, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "over") == 0) {
-            parser_advance(p);
-            Instruction inst = {Over, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "eq") == 0) {
-            parser_advance(p);
-            Instruction inst = {Eq, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "neq") == 0) {
-            parser_advance(p);
-            Instruction inst = {Neq, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "lt") == 0) {
-            parser_advance(p);
-            Instruction inst = {Lt, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "lte") == 0) {
-            parser_advance(p);
-            Instruction inst = {Lte, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "gt") == 0) {
-            parser_advance(p);
-            Instruction inst = {Gt, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else if (tok.kind == TOK_IDENT && strcmp(tok.lexeme, "gte") == 0) {
-            parser_advance(p);
-            Instruction inst = {Gte, WORD(NULL)};
-            inst_array_push(&instructions, inst);
-        } else {
-            parser_advance(p);
-        }
-    }
+// Returns the entry's bytes, or NULL if there is none
+static char *cache_fetch(const char *dir, CacheKey key, size_t *out_size) {
+    char *path = cache_path(dir, key);
+    FILE *f = fopen(path, "rb");
+    free(path);
+    if (!f) return NULL;
 
-    for (size_t i = 0; i < instructions.count; i++) {
-        Instruction *inst = &instructions.data[i];
-        if ((inst->type == Jmp || inst->type == JmpIf) && inst->arg.as_pointer != NULL) {
-            char *label_name = (char *) inst->arg.as_pointer;
-            if (isalpha(label_name[0]) || label_name[0] == '_') {
-                size_t position;
-                if (label_table_find(p->current_labels, label_name, &position)) {
-                    free(label_name);
-                    inst->arg = WORD(position);
-                } else {
-                    fprintf(stderr, "Error: Undefined label '%s'\n", label_name);
-                    exit(1);
-                }
-            }
-        }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *bytes = size > 0 ? malloc(size) : NULL;
+    if (bytes && fread(bytes, 1, size, f) != (size_t) size) {
+        free(bytes);
+        bytes = NULL;
     }
-
-    return instructions;
+    fclose(f);
+    *out_size = bytes ? (size_t) size : 0;
+    return bytes;
 }
 
-static void parse_func_decl(ParserState *p) {
-    Token name = parser_expect(p, TOK_IDENT);
-    parser_expect(p, TOK_LBRACE);
-
-    LabelTable labels;
-    label_table_init(&labels);
-    p->current_labels = &labels;
-
-    InstructionArray instructions = parse_func_body(p);
-
-    parser_expect(p, TOK_RBRACE);
-
-    Function *fn = malloc(sizeof(Function));
-    fn->instructions = instructions;
-
-    char *name_copy = strdup(name.lexeme);
-    xmap_set(&p->vm->functions, name_copy, WORD(fn));
-
-    label_table_free(&labels);
-    p->current_labels = NULL;
+// Creates dir and its parents
+static bool cache_mkdir(const char *dir) {
+    char *path = strdup(dir);
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        mkdir(path, 0777);
+        *p = '/';
+    }
+    bool ok = mkdir(path, 0777) == 0 || errno == EEXIST;
+    free(path);
+    return ok;
 }
 
-static void parse_toplevel(ParserState *p) {
-    while (!parser_check(p, TOK_EOF)) {
-        Token tok = parser_peek(p);
-        if (tok.kind == TOK_IDENT) {
-            parse_func_decl(p);
-        } else {
-            parser_advance(p);
-        }
-    }
+// Writes an entry to a temporary file and renames it into place, so that
+// concurrent runs never see a partial entry. Failures are ignored; the cache
+// is only an optimization.
+static void cache_store(const char *dir, CacheKey key, const void *data, size_t size) {
+    if (!cache_mkdir(dir)) return;
+    size_t len = strlen(dir) + 16;
+    char *tmp = malloc(len);
+    snprintf(tmp, len, "%s/tmp.XXXXXX", dir);
+    int fd = mkstemp(tmp);
+    if (fd >= 0) {
+        bool ok = write(fd, data, size) == (ssize_t) size;
+        close(fd);
+        char *path = cache_path(dir, key);
+        if (!ok || rename(tmp, path) != 0) unlink(tmp);
+        free(path);
+    }
+    free(tmp);
 }
 
-static ProstStatus assemble(ProstVM *vm, const char *src) {
-    size_t token_count;
-    Token *tokens = tok_tokenize(src, &token_count);
-
-    ParserState parser;
-    parser.tokens = tokens;
-    parser.pos = 0;
-    parser.count = token_count;
-    parser.vm = vm;
-    parser.current_labels = NULL;
-
-    parse_toplevel(&parser);
-
-    for (size_t i = 0; i < token_count; i++) {
-        if (tokens[i].lexeme)
-            free(tokens[i].lexeme);
-    }
-    free(tokens);
-
-    return P_OK;
+// The default --cache directory
+static char *default_cache_dir(void) {
+    const char *dir = getenv("PROST_CACHE_DIR");
+    if (dir && *dir) return strdup(dir);
+    const char *home = getenv("HOME");
+    if (!home || !*home) return strdup(".prost-cache");
+    size_t len = strlen(home) + 16;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/.cache/prost", home);
+    return path;
 }
 
-static char *read_file(const char *path) {
-    FILE *f = fopen(path, "rb");
+static bool write_file(const char *path, const void *data, size_t len) {
+    FILE *f = fopen(path, "wb");
     if (!f) {
-        fprintf(stderr, "Error: Could not open file '%s'\n", path);
-        return NULL;
+        fprintf(stderr, "Error: Could not write to file '%s'\n", path);
+        return false;
     }
-
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    char *content = malloc(size + 1);
-    if (!content) {
-        fclose(f);
-        return NULL;
-    }
-
-    fread(content, 1, size, f);
-    content[size] = '\0';
+    bool ok = fwrite(data, 1, len, f) == len;
     fclose(f);
-
-    return content;
+    return ok;
 }
 
-static void print_usage(const char *prog) {
-    printf("Usage: %s [OPTIONS] <input_file>\n\n", prog);
-    printf("Options:\n");
-    printf("  -h, --help           Show this help message\n");
-    printf("  -o, --output FILE    Output bytecode file (default: out.pco)\n");
-    printf("  -d, --library FILE   Load a library\n");
-    printf("  -r, --dont-run       Don't run the bytecode after compilation\n");
-    printf("  -c, --dont-compile   Don't compile, only run (for .pa files)\n");
-    printf("  -v, --verbose        Enable verbose output\n");
-    printf("\nFile Extensions:\n");
-    printf("  .pa  - Prost Assembly (source code)\n");
-    printf("  .pco - Prost Compiled Object (bytecode)\n");
-}
+enum {
+    OPT_NO_FUSE = 256,
+    OPT_FUSION_STATS,
+    OPT_INLINE,
+    OPT_INLINE_SIZE,
+    OPT_INLINE_DEPTH,
+    OPT_CACHE,
+    OPT_VERIFY,
+    OPT_PROFILE,
+    OPT_SAMPLE,
+    OPT_SAMPLE_FILE,
+    OPT_STACK_SIZE,
+    OPT_MAX_CALL_DEPTH,
+    OPT_FIBERS,
+    OPT_NO_JIT,
+    OPT_JIT_THRESHOLD,
+    OPT_JIT_DIFF,
+};
 
 int main(int argc, char **argv) {
     bool dont_run = false;
+    bool no_fuse = false;
+    bool fusion_stats = false;
+    bool inline_enabled = false;
+    size_t inline_size = INLINE_DEFAULT_SIZE;
+    long inline_depth = INLINE_DEFAULT_DEPTH;
+    bool verify = false;
+    char *cache_dir = NULL;
+    const char *profile_file = NULL;
+    bool sample = false;
+    long sample_hz = 0;
+    const char *sample_file = "prost.samples.folded";
+    size_t stack_size = 0;
+    size_t max_call_depth = 0;
+    long fibers = 0;
+    bool no_jit = false;
+    long jit_threshold = -1;
+    bool jit_diff_mode = false;
     bool dont_compile = false;
     bool verbose = false;
+    long jobs = 1;
+    long parallel = -1;
     char *output_file = "out.pco";
+    bool output_set = false;
     char *input_file = NULL;
     XVec load_library = xvec_create(2);
 
@@ -564,19 +445,38 @@ int main(int argc, char **argv) {
         {"dont-compile", no_argument, 0, 'c'},
         {"verbose", no_argument, 0, 'v'},
         {"library", required_argument, 0, 'd'},
+        {"jobs", required_argument, 0, 'j'},
+        {"parallel", required_argument, 0, 'p'},
+        {"no-fuse", no_argument, 0, OPT_NO_FUSE},
+        {"fusion-stats", no_argument, 0, OPT_FUSION_STATS},
+        {"inline", no_argument, 0, OPT_INLINE},
+        {"inline-size", required_argument, 0, OPT_INLINE_SIZE},
+        {"inline-depth", required_argument, 0, OPT_INLINE_DEPTH},
+        {"cache", optional_argument, 0, OPT_CACHE},
+        {"verify", no_argument, 0, OPT_VERIFY},
+        {"profile", optional_argument, 0, OPT_PROFILE},
+        {"sample", optional_argument, 0, OPT_SAMPLE},
+        {"sample-file", required_argument, 0, OPT_SAMPLE_FILE},
+        {"stack-size", required_argument, 0, OPT_STACK_SIZE},
+        {"max-call-depth", required_argument, 0, OPT_MAX_CALL_DEPTH},
+        {"no-jit", no_argument, 0, OPT_NO_JIT},
+        {"jit-threshold", required_argument, 0, OPT_JIT_THRESHOLD},
+        {"jit-diff", no_argument, 0, OPT_JIT_DIFF},
+        {"fibers", required_argument, 0, OPT_FIBERS},
         {0, 0, 0, 0}
     };
 
     int opt;
     int option_index = 0;
 
-    while ((opt = getopt_long(argc, argv, "ho:rcvd:", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "ho:rcvd:j:p:", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'h':
                 print_usage(argv[0]);
                 return 0;
             case 'o':
                 output_file = optarg;
+                output_set = true;
                 break;
             case 'r':
                 dont_run = true;
@@ -590,6 +490,109 @@ int main(int argc, char **argv) {
             case 'd':
                 xvec_push(&load_library, WORD(strdup(optarg)));
                 break;
+            case 'j': {
+                char *end;
+                jobs = strtol(optarg, &end, 10);
+                if (*end != '\0' || jobs < 0) {
+                    fprintf(stderr, "Error: Invalid job count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'p': {
+                char *end;
+                parallel = strtol(optarg, &end, 10);
+                if (*end != '\0' || parallel < 0) {
+                    fprintf(stderr, "Error: Invalid thread count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case OPT_NO_FUSE:
+                no_fuse = true;
+                break;
+            case OPT_FUSION_STATS:
+                fusion_stats = true;
+                break;
+            case OPT_INLINE:
+                inline_enabled = true;
+                break;
+            case OPT_INLINE_SIZE:
+                inline_size = strtoull(optarg, NULL, 10);
+                if (inline_size == 0) {
+                    fprintf(stderr, "Error: Invalid inline size '%s'\n", optarg);
+                    return 1;
+                }
+                inline_enabled = true;
+                break;
+            case OPT_INLINE_DEPTH:
+                inline_depth = strtol(optarg, NULL, 10);
+                if (inline_depth <= 0) {
+                    fprintf(stderr, "Error: Invalid inline depth '%s'\n", optarg);
+                    return 1;
+                }
+                inline_enabled = true;
+                break;
+            case OPT_CACHE:
+                free(cache_dir);
+                cache_dir = optarg ? strdup(optarg) : default_cache_dir();
+                break;
+            case OPT_VERIFY:
+                verify = true;
+                break;
+            case OPT_PROFILE:
+                profile_file = optarg ? optarg : "prost.folded";
+                break;
+            case OPT_SAMPLE:
+                sample = true;
+                if (optarg) {
+                    sample_hz = strtol(optarg, NULL, 10);
+                    if (sample_hz <= 0) {
+                        fprintf(stderr, "Error: Invalid sample rate '%s'\n", optarg);
+                        return 1;
+                    }
+                }
+                break;
+            case OPT_SAMPLE_FILE:
+                sample = true;
+                sample_file = optarg;
+                break;
+            case OPT_STACK_SIZE:
+                stack_size = strtoull(optarg, NULL, 10);
+                if (stack_size == 0) {
+                    fprintf(stderr, "Error: Invalid stack size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_MAX_CALL_DEPTH:
+                max_call_depth = strtoull(optarg, NULL, 10);
+                if (max_call_depth == 0) {
+                    fprintf(stderr, "Error: Invalid call depth '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_FIBERS: {
+                char *end;
+                fibers = strtol(optarg, &end, 10);
+                if (*end != '\0' || fibers < 0) {
+                    fprintf(stderr, "Error: Invalid fiber thread count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case OPT_NO_JIT:
+                no_jit = true;
+                break;
+            case OPT_JIT_THRESHOLD:
+                jit_threshold = strtol(optarg, NULL, 10);
+                if (jit_threshold < 0) {
+                    fprintf(stderr, "Error: Invalid JIT threshold '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_JIT_DIFF:
+                jit_diff_mode = true;
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
@@ -602,6 +605,45 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+#ifdef PROST_JIT
+    if (jit_diff_mode) {
+        int code = jit_diff(argv + optind, argc - optind, &load_library);
+        xvec_free(&load_library);
+        return code;
+    }
+#else
+    if (no_jit || jit_threshold >= 0 || jit_diff_mode) {
+        fprintf(stderr, "Error: JIT options need a build with PROST_JIT\n");
+        return 1;
+    }
+#endif
+
+    if (parallel >= 0) {
+        // Profiling and sampling are process-wide, and nothing is written out
+        const char *unsupported = profile_file ? "--profile" : sample ? "--sample"
+                                : output_set ? "--output" : cache_dir ? "--cache"
+                                : dont_run ? "--dont-run" : dont_compile ? "--dont-compile"
+                                : fusion_stats ? "--fusion-stats" : NULL;
+        if (unsupported) {
+            fprintf(stderr, "Error: Cannot use %s with --parallel\n", unsupported);
+            free(cache_dir);
+            xvec_free(&load_library);
+            return 1;
+        }
+        ParallelPool pool = {.libraries = &load_library, .stack_size = stack_size,
+                             .max_call_depth = max_call_depth, .fiber_workers = (size_t) fibers,
+                             .optimize = !no_fuse, .verify = verify,
+                             .load = {.jobs = (int) jobs, .inline_enabled = inline_enabled,
+                                      .inline_size = inline_size, .inline_depth = (int) inline_depth}};
+#ifdef PROST_JIT
+        pool.jit = !no_jit;
+        pool.jit_threshold = jit_threshold;
+#endif
+        int code = run_parallel(argv + optind, argc - optind, (int) parallel, &pool);
+        xvec_free(&load_library);
+        return code;
+    }
+
     input_file = argv[optind];
 
     if (dont_run && dont_compile) {
@@ -624,9 +666,34 @@ int main(int argc, char **argv) {
         return 1;
     }
     register_std(vm);
+    vm->optimize = !no_fuse;
+    if (max_call_depth)
+        vm->max_call_depth = max_call_depth;
+    vm->fiber_workers = (size_t) fibers;
+#ifdef PROST_JIT
+    vm->jit = !no_jit;
+    if (jit_threshold >= 0)
+        vm->jit_threshold = (uint32_t) jit_threshold;
+#endif
+    if (stack_size && p_set_stack_capacity(vm, stack_size) != P_OK) {
+        fprintf(stderr, "Error: Could not allocate a stack of %zu values\n", stack_size);
+        p_free(vm);
+        return 1;
+    }
+
+    // A cached program must have been built with the same options, and
+    // linked against the same libraries.
+    CacheKey program_key = {0xcbf29ce484222325ull, 0x9e3779b97f4a7c15ull};
+    char options[128];
+    snprintf(options, sizeof(options), "version=%d.%d fuse=%d inline=%d size=%zu depth=%ld", CACHE_VERSION,
+             P_BC_VERSION, !no_fuse, inline_enabled, inline_size, inline_depth);
+    cache_key_add(&program_key, options, strlen(options) + 1);
+    cache_key_add_assembler(&program_key);
 
     for (int i = 0; i < xvec_len(&load_library); i++) {
-        p_load_library(vm, (const char *) xvec_get(&load_library, i)->as_pointer);
+        const char *library = (const char *) xvec_get(&load_library, i)->as_pointer;
+        cache_key_add(&program_key, library, strlen(library) + 1);
+        p_load_library(vm, library);
     }
     xvec_free(&load_library);
 
@@ -640,65 +707,107 @@ int main(int argc, char **argv) {
             return 1;
         }
 
-        if (verbose)
-            printf("Assembling...\n");
+        size_t cached_size = 0;
+        char *cached = NULL;
+        if (cache_dir) {
+            cache_key_add(&program_key, source, strlen(source));
+            cached = cache_fetch(cache_dir, program_key, &cached_size);
+        }
+        if (cached) {
+            if (verbose)
+                printf("Using cached bytecode, writing it to: %s\n", output_file);
+            bool ok = write_file(output_file, cached, cached_size);
+            free(cached);
+            free(source);
+            if (!ok) {
+                p_free(vm);
+                return 1;
+            }
+        } else {
+            if (verbose)
+                printf("Assembling...\n");
 
-        ProstStatus status = assemble(vm, source);
-        free(source);
+            ProstStatus status = assemble_jobs(vm, source, (int) jobs);
+            free(source);
 
-        if (verbose)
-            printf("Generating bytecode...\n");
+            if (status == P_OK && inline_enabled) {
+                size_t inlined = inline_functions(vm, inline_size, (int) inline_depth);
+                if (verbose)
+                    printf("Inlined %zu call sites\n", inlined);
+            }
 
-        ByteBuf bytecode = p_to_bytecode(vm);
+            if (status == P_OK) {
+                if (verbose)
+                    printf("Linking...\n");
+                status = p_link(vm);
+            }
+            if (status == P_OK && !no_fuse)
+                p_mark_tail_calls(vm);
+            if (status != P_OK) {
+                fprintf(stderr, "Error: Failed to assemble '%s' (status %d)\n", input_file, status);
+                p_free(vm);
+                return 1;
+            }
 
-        if (verbose)
-            printf("Writing bytecode to: %s\n", output_file);
+            if (verbose)
+                printf("Generating bytecode...\n");
 
-        FILE *f = fopen(output_file, "wb");
-        if (!f) {
-            fprintf(stderr, "Error: Could not write to file '%s'\n", output_file);
-            p_free(vm);
-            return 1;
-        }
+            ByteBuf bytecode = p_to_bytecode(vm);
 
-        fwrite(bytecode.data, 1, bytecode.len, f);
-        fclose(f);
+            if (verbose)
+                printf("Writing bytecode to: %s\n", output_file);
 
-        if (verbose)
-            printf("Compilation successful (%zu bytes)\n", bytecode.len);
+            if (!write_file(output_file, bytecode.data, bytecode.len)) {
+                bb_free(&bytecode);
+                p_free(vm);
+                return 1;
+            }
+            if (cache_dir)
+                cache_store(cache_dir, program_key, bytecode.data, bytecode.len);
+
+            if (verbose)
+                printf("Compilation successful (%zu bytes)\n", bytecode.len);
+            bb_free(&bytecode);
+        }
     }
+    free(cache_dir);
 
     if (!dont_run) {
         const char *bytecode_file = dont_compile ? input_file : output_file;
 
         if (verbose)
-            printf("Loading bytecode from: %s\n", bytecode_file);
+            printf(verify ? "Loading and verifying bytecode from: %s\n" : "Loading bytecode from: %s\n", bytecode_file);
+
+        // Loading verifies anyway; with --verify it also rejects what fails
+        if (verify)
+            vm->verify_report = stderr;
+        ProstStatus status = p_load_file(vm, bytecode_file);
 
-        char *bytecode = read_file(bytecode_file);
-        if (!bytecode) {
+        if (status != P_OK) {
+            fprintf(stderr, verify ? "Error: '%s' failed to load or verify (status %d)\n"
+                                   : "Error: Failed to load bytecode from '%s' (status %d)\n",
+                    bytecode_file, status);
             p_free(vm);
             return 1;
         }
 
-        if (dont_compile) {
-            p_free(vm);
-            vm = p_init();
-            register_std(vm);
-            if (!vm) {
-                fprintf(stderr, "Error: Failed to initialize VM\n");
-                free(bytecode);
-                return 1;
+        if (fusion_stats)
+            p_print_fusion_stats(vm, stderr);
+
+        if (verify) {
+            if (verbose) {
+                for (size_t i = 0; i < xvec_len(&vm->function_list); i++) {
+                    Function *fn = (Function *)xvec_get(&vm->function_list, i)->as_pointer;
+                    printf("  %-20s %s in=%d out=%d max=%d\n", fn->name,
+                           fn->info.verified ? "verified" : "unverified",
+                           fn->info.stack_in, fn->info.stack_out, fn->info.max_stack);
+                }
             }
         }
 
-        if (verbose)
-            printf("Loading bytecode into VM...\n");
-
-        ProstStatus status = p_from_bytecode(vm, bytecode);
-        free(bytecode);
-
-        if (status != P_OK) {
-            fprintf(stderr, "Error: Failed to load bytecode (status %d)\n", status);
+        if (profile_file)
+            p_profile_enable(vm);
+        if (sample && p_sampler_start(vm, (unsigned) sample_hz) != P_OK) {
             p_free(vm);
             return 1;
         }
@@ -708,6 +817,29 @@ int main(int argc, char **argv) {
 
         status = p_run(vm);
 
+        if (sample) {
+            p_sampler_stop(vm);
+            p_sampler_report(vm, stderr);
+            FILE *folded = fopen(sample_file, "w");
+            if (folded) {
+                p_sampler_write_folded(vm, folded);
+                fclose(folded);
+            } else {
+                fprintf(stderr, "Error: Could not write to file '%s'\n", sample_file);
+            }
+        }
+
+        if (profile_file) {
+            p_profile_report(vm, stderr);
+            FILE *folded = fopen(profile_file, "w");
+            if (folded) {
+                p_profile_write_folded(vm, folded);
+                fclose(folded);
+            } else {
+                fprintf(stderr, "Error: Could not write to file '%s'\n", profile_file);
+            }
+        }
+
         if (status != P_OK) {
             const char *error_msg = "Unknown error";
             switch (status) {
@@ -732,6 +864,18 @@ int main(int argc, char **argv) {
                 case P_ERR_INVALID_VM_STATE:
                     error_msg = "Invalid VM state";
                     break;
+                case P_ERR_GENERAL_VM_ERROR:
+                    error_msg = "VM error";
+                    break;
+                case P_ERR_STACK_OVERFLOW:
+                    error_msg = "Stack overflow";
+                    break;
+                case P_ERR_CALL_STACK_OVERFLOW:
+                    error_msg = "Call stack overflow";
+                    break;
+                case P_ERR_INT_OVERFLOW:
+                    error_msg = "Integer overflow";
+                    break;
                 default:
                     break;
             }
@@ -745,16 +889,18 @@ int main(int argc, char **argv) {
 
         if (verbose) {
             printf("\n=== Execution Complete ===\n");
-            printf("Stack size: %zu\n", vm->stack.size);
-            if (vm->stack.size > 0) {
+            printf("Stack size: %zu\n", p_stack_size(vm));
+            if (p_stack_size(vm) > 0) {
                 Word top = p_peek(vm);
                 printf("Top of stack: %ld\n", (long) top.as_pointer);
             }
             printf("Exit code: %d\n", vm->exit_code);
+#ifdef PROST_JIT
+            printf("JIT-compiled functions: %zu\n", vm->jit_compiled);
+#endif
         }
     }
 
-    unload_std();
     p_free(vm);
     return 0;
 }
@@ -0,0 +1,928 @@
+// Prost assembler: turns .pa source into functions in a ProstVM.
+// Include after prost.h (with PROST_IMPLEMENTATION in the same file).
+//
+// assemble() tokenizes the whole source, copying lexemes into one arena and
+// recognizing mnemonics through a perfect hash, then parses one function at a
+// time and adds it with p_add_function. assemble_jobs() parses the functions
+// on a pool of threads instead. Labels are resolved per function. The
+// optional inliner (inline_functions) runs on the assembled program before
+// p_link.
+#ifndef PROST_ASSEMBLER_H
+#define PROST_ASSEMBLER_H
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define INLINE_DEFAULT_SIZE 16
+#define INLINE_DEFAULT_DEPTH 2
+
+typedef enum {
+    TOK_NUM,
+    TOK_IDENT,
+    TOK_STR,
+    TOK_LBRACE,
+    TOK_LPAREN,
+    TOK_RBRACE,
+    TOK_RPAREN,
+    TOK_COLON,
+    TOK_DOT,
+    TOK_AT,
+    TOK_STAR,
+    TOK_EQ,
+    TOK_EOF,
+} TokenKind;
+
+typedef enum {
+    MN_SIMPLE, // no operand, `type` says which instruction
+    MN_PUSH,
+    MN_POP,
+    MN_CALL,
+    MN_TAILCALL,
+    MN_JMP,
+    MN_JMPIF,
+    MN_SPAWN,
+} MnemonicKind;
+
+typedef struct {
+    const char *name;
+    uint8_t len;
+    MnemonicKind kind;
+    InstructionType type;
+} Mnemonic;
+
+typedef struct {
+    TokenKind kind;
+    char *lexeme; // NUL-terminated copy in the tokenizer's arena, NULL for punctuation
+    const Mnemonic *mnemonic; // for identifiers that are mnemonics, else NULL
+    int line;
+    int col;
+} Token;
+
+typedef struct {
+    const char *input;
+    size_t pos;
+    size_t len;
+    int line;
+    int col;
+    char *arena; // lexemes, back to back; sized so it never grows
+    size_t arena_used;
+} Tokenizer;
+
+#define LABEL_NONE UINT32_MAX
+#define LABEL_UNDEFINED SIZE_MAX
+
+// Labels of the function being parsed, hashed by name. A jump to a label that
+// isn't defined yet is queued on the label and patched when it is.
+typedef struct {
+    const char *name; // in the token arena
+    uint32_t hash;
+    uint32_t generation; // the entry is in use when this matches the table's
+    size_t position; // LABEL_UNDEFINED until the label is defined
+    uint32_t pending; // first jump waiting for it in LabelTable.refs, LABEL_NONE if none
+    int line, col; // first reference, for errors
+} Label;
+
+typedef struct {
+    size_t instruction;
+    uint32_t next;
+} LabelRef;
+
+typedef struct {
+    Label *labels;
+    size_t count;
+    size_t capacity; // a power of two
+    uint32_t generation; // bumped per function, so clearing is O(1)
+    LabelRef *refs;
+    size_t ref_count;
+    size_t ref_capacity;
+} LabelTable;
+
+typedef struct {
+    Token *tokens;
+    size_t pos;
+    size_t count;
+    ProstVM *vm;
+    LabelTable labels;
+    ProstStatus status; // first error, the parser stops at it
+    FILE *errors; // where the error is reported, NULL to stay quiet
+} ParserState;
+
+static void label_table_init(LabelTable *lt) {
+    lt->capacity = 64;
+    lt->labels = calloc(lt->capacity, sizeof(Label));
+    lt->count = 0;
+    lt->generation = 1;
+    lt->refs = NULL;
+    lt->ref_count = 0;
+    lt->ref_capacity = 0;
+}
+
+static void label_table_free(LabelTable *lt) {
+    free(lt->labels);
+    free(lt->refs);
+}
+
+static void label_table_reset(LabelTable *lt) {
+    lt->count = 0;
+    lt->ref_count = 0;
+    if (++lt->generation == 0) {
+        memset(lt->labels, 0, lt->capacity * sizeof(Label));
+        lt->generation = 1;
+    }
+}
+
+static Label *label_table_probe(Label *labels, size_t capacity, uint32_t generation, const char *name, uint32_t hash) {
+    size_t i = hash & (capacity - 1);
+    while (labels[i].generation == generation) {
+        if (labels[i].hash == hash && strcmp(labels[i].name, name) == 0) break;
+        i = (i + 1) & (capacity - 1);
+    }
+    return &labels[i];
+}
+
+// Returns the label called name, adding an undefined one if needed.
+static Label *label_table_get(LabelTable *lt, const char *name) {
+    if (lt->count * 2 >= lt->capacity) {
+        size_t capacity = lt->capacity * 2;
+        Label *labels = calloc(capacity, sizeof(Label));
+        for (size_t i = 0; i < lt->capacity; i++) {
+            if (lt->labels[i].generation != lt->generation) continue;
+            *label_table_probe(labels, capacity, lt->generation, lt->labels[i].name, lt->labels[i].hash) = lt->labels[i];
+        }
+        free(lt->labels);
+        lt->labels = labels;
+        lt->capacity = capacity;
+    }
+
+    uint32_t hash = xmap_hash(name);
+    Label *label = label_table_probe(lt->labels, lt->capacity, lt->generation, name, hash);
+    if (label->generation != lt->generation) {
+        *label = (Label){.name = name, .hash = hash, .generation = lt->generation,
+                         .position = LABEL_UNDEFINED, .pending = LABEL_NONE};
+        lt->count++;
+    }
+    return label;
+}
+
+// Defines a label at position and patches the jumps waiting for it. The
+// first definition of a name wins.
+static void label_table_define(LabelTable *lt, const char *name, size_t position, InstructionArray *code) {
+    Label *label = label_table_get(lt, name);
+    if (label->position != LABEL_UNDEFINED) return;
+    label->position = position;
+    for (uint32_t r = label->pending; r != LABEL_NONE; r = lt->refs[r].next) {
+        p_set_arg(&code->data[lt->refs[r].instruction], WORD(position));
+    }
+    label->pending = LABEL_NONE;
+}
+
+// Points the jump at code->data[instruction] to the label, now or once the
+// label is defined.
+static void label_table_reference(LabelTable *lt, const char *name, size_t instruction, InstructionArray *code, int line, int col) {
+    Label *label = label_table_get(lt, name);
+    if (label->position != LABEL_UNDEFINED) {
+        p_set_arg(&code->data[instruction], WORD(label->position));
+        return;
+    }
+    if (label->pending == LABEL_NONE) {
+        label->line = line;
+        label->col = col;
+    }
+    if (lt->ref_count == lt->ref_capacity) {
+        lt->ref_capacity = lt->ref_capacity ? lt->ref_capacity * 2 : 16;
+        lt->refs = realloc(lt->refs, lt->ref_capacity * sizeof(LabelRef));
+    }
+    lt->refs[lt->ref_count] = (LabelRef){.instruction = instruction, .next = label->pending};
+    label->pending = (uint32_t)lt->ref_count++;
+}
+
+// Perfect hash over the mnemonics below: every one maps to its own slot.
+// Adding a mnemonic that collides makes two initializers share an index,
+// which -Woverride-init (-Wextra) reports; change the multipliers then.
+#define ASM_MNEMONIC_SLOTS 64
+#define ASM_MNEMONIC_HASH(c0, c1, last, len) \
+    ((((unsigned)(c0) * 37u) + ((unsigned)(c1) * 3u) + ((unsigned)(last) * 14u) + (unsigned)(len)) & (ASM_MNEMONIC_SLOTS - 1))
+#define ASM_MNEMONIC(c0, c1, last, str, kind, type) \
+    [ASM_MNEMONIC_HASH(c0, c1, last, sizeof(str) - 1)] = {str, sizeof(str) - 1, kind, type}
+
+static const Mnemonic asm_mnemonics[ASM_MNEMONIC_SLOTS] = {
+    ASM_MNEMONIC('p', 'u', 'h', "push", MN_PUSH, Push),
+    ASM_MNEMONIC('p', 'o', 'p', "pop", MN_POP, Pop),
+    ASM_MNEMONIC('c', 'a', 'l', "call", MN_CALL, Call),
+    ASM_MNEMONIC('t', 'a', 'l', "tailcall", MN_TAILCALL, TailCall),
+    ASM_MNEMONIC('j', 'm', 'p', "jmp", MN_JMP, Jmp),
+    ASM_MNEMONIC('j', 'm', 'f', "jmpif", MN_JMPIF, JmpIf),
+    ASM_MNEMONIC('d', 'r', 'p', "drop", MN_SIMPLE, Drop),
+    ASM_MNEMONIC('h', 'a', 't', "halt", MN_SIMPLE, Halt),
+    ASM_MNEMONIC('r', 'e', 't', "ret", MN_SIMPLE, Halt),
+    ASM_MNEMONIC('r', 'e', 'n', "return", MN_SIMPLE, Return),
+    ASM_MNEMONIC('d', 'u', 'p', "dup", MN_SIMPLE, Dup),
+    ASM_MNEMONIC('s', 'w', 'p', "swap", MN_SIMPLE, Swap),
+    ASM_MNEMONIC('o', 'v', 'r', "over", MN_SIMPLE, Over),
+    ASM_MNEMONIC('e', 'q', 'q', "eq", MN_SIMPLE, Eq),
+    ASM_MNEMONIC('n', 'e', 'q', "neq", MN_SIMPLE, Neq),
+    ASM_MNEMONIC('l', 't', 't', "lt", MN_SIMPLE, Lt),
+    ASM_MNEMONIC('l', 't', 'e', "lte", MN_SIMPLE, Lte),
+    ASM_MNEMONIC('g', 't', 't', "gt", MN_SIMPLE, Gt),
+    ASM_MNEMONIC('g', 't', 'e', "gte", MN_SIMPLE, Gte),
+    ASM_MNEMONIC('a', 'd', 'd', "add", MN_SIMPLE, Add),
+    ASM_MNEMONIC('s', 'u', 'b', "sub", MN_SIMPLE, Sub),
+    ASM_MNEMONIC('m', 'u', 'l', "mul", MN_SIMPLE, Mul),
+    ASM_MNEMONIC('d', 'i', 'v', "div", MN_SIMPLE, Div),
+    ASM_MNEMONIC('m', 'o', 'd', "mod", MN_SIMPLE, Mod),
+    ASM_MNEMONIC('a', 'n', 'd', "and", MN_SIMPLE, And),
+    ASM_MNEMONIC('o', 'r', 'r', "or", MN_SIMPLE, Or),
+    ASM_MNEMONIC('x', 'o', 'r', "xor", MN_SIMPLE, Xor),
+    ASM_MNEMONIC('s', 'h', 'l', "shl", MN_SIMPLE, Shl),
+    ASM_MNEMONIC('s', 'h', 'r', "shr", MN_SIMPLE, Shr),
+    ASM_MNEMONIC('n', 'o', 't', "not", MN_SIMPLE, Not),
+    ASM_MNEMONIC('s', 'p', 'n', "spawn", MN_SPAWN, Spawn),
+    ASM_MNEMONIC('y', 'i', 'd', "yield", MN_SIMPLE, Yield),
+    ASM_MNEMONIC('j', 'o', 'n', "join", MN_SIMPLE, Join),
+};
+
+static const Mnemonic *find_mnemonic(const char *s, size_t len) {
+    if (len < 2) return NULL;
+    const Mnemonic *m = &asm_mnemonics[ASM_MNEMONIC_HASH(s[0], s[1], s[len - 1], len)];
+    return m->len == len && memcmp(m->name, s, len) == 0 ? m : NULL;
+}
+
+static void tok_init(Tokenizer *t, const char *src) {
+    t->input = src;
+    t->pos = 0;
+    t->len = strlen(src);
+    t->line = 1;
+    t->col = 1;
+    // a lexeme is never longer than the source, and each one adds a NUL
+    t->arena = malloc(2 * t->len + 2);
+    t->arena_used = 0;
+}
+
+static char tok_peek(Tokenizer *t) {
+    if (t->pos >= t->len)
+        return '\0';
+    return t->input[t->pos];
+}
+
+static char tok_advance(Tokenizer *t) {
+    if (t->pos >= t->len)
+        return '\0';
+    char c = t->input[t->pos++];
+    if (c == '\n') {
+        t->line++;
+        t->col = 1;
+    } else {
+        t->col++;
+    }
+    return c;
+}
+
+static void tok_skip_whitespace(Tokenizer *t) {
+    while (1) {
+        char c = tok_peek(t);
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            tok_advance(t);
+        } else if (c == ';') {
+            while (tok_peek(t) && tok_peek(t) != '\n') {
+                tok_advance(t);
+            }
+        } else {
+            break;
+        }
+    }
+}
+
+static Token tok_make_token(TokenKind kind, char *lexeme, int line, int col) {
+    Token tok;
+    tok.kind = kind;
+    tok.lexeme = lexeme;
+    tok.mnemonic = NULL;
+    tok.line = line;
+    tok.col = col;
+    return tok;
+}
+
+static char *tok_extract_range(Tokenizer *t, size_t start, size_t end) {
+    size_t len = end - start;
+    char *s = t->arena + t->arena_used;
+    memcpy(s, t->input + start, len);
+    s[len] = '\0';
+    t->arena_used += len + 1;
+    return s;
+}
+
+static Token tok_next(Tokenizer *t) {
+    tok_skip_whitespace(t);
+
+    if (tok_peek(t) == '\0') {
+        return tok_make_token(TOK_EOF, NULL, t->line, t->col);
+    }
+
+    int start_line = t->line;
+    int start_col = t->col;
+    char c = tok_peek(t);
+
+    if (c == '{') {
+        tok_advance(t);
+        return tok_make_token(TOK_LBRACE, NULL, start_line, start_col);
+    }
+    if (c == '}') {
+        tok_advance(t);
+        return tok_make_token(TOK_RBRACE, NULL, start_line, start_col);
+    }
+    if (c == '(') {
+        tok_advance(t);
+        return tok_make_token(TOK_LPAREN, NULL, start_line, start_col);
+    }
+    if (c == ')') {
+        tok_advance(t);
+        return tok_make_token(TOK_RPAREN, NULL, start_line, start_col);
+    }
+    if (c == ':') {
+        tok_advance(t);
+        return tok_make_token(TOK_COLON, NULL, start_line, start_col);
+    }
+    if (c == '.') {
+        tok_advance(t);
+        return tok_make_token(TOK_DOT, NULL, start_line, start_col);
+    }
+    if (c == '@') {
+        tok_advance(t);
+        return tok_make_token(TOK_AT, NULL, start_line, start_col);
+    }
+    if (c == '*') {
+        tok_advance(t);
+        return tok_make_token(TOK_STAR, NULL, start_line, start_col);
+    }
+    if (c == '=') {
+        tok_advance(t);
+        return tok_make_token(TOK_EQ, NULL, start_line, start_col);
+    }
+
+    if (c == '"') {
+        tok_advance(t);
+        size_t start = t->pos;
+        while (tok_peek(t) && tok_peek(t) != '"') {
+            if (tok_peek(t) == '\\')
+                tok_advance(t);
+            tok_advance(t);
+        }
+        size_t end = t->pos;
+        if (tok_peek(t) == '"')
+            tok_advance(t);
+        char *lexeme = tok_extract_range(t, start, end);
+        return tok_make_token(TOK_STR, lexeme, start_line, start_col);
+    }
+
+    if (isdigit(c) || (c == '-' && t->pos + 1 < t->len && isdigit(t->input[t->pos + 1]))) {
+        size_t start = t->pos;
+        if (c == '-')
+            tok_advance(t);
+        while (isdigit(tok_peek(t)))
+            tok_advance(t);
+        char *lexeme = tok_extract_range(t, start, t->pos);
+        return tok_make_token(TOK_NUM, lexeme, start_line, start_col);
+    }
+
+    if (isalpha(c) || c == '_') {
+        size_t start = t->pos;
+        while (isalnum(tok_peek(t)) || tok_peek(t) == '_')
+            tok_advance(t);
+        Token tok = tok_make_token(TOK_IDENT, tok_extract_range(t, start, t->pos), start_line, start_col);
+        tok.mnemonic = find_mnemonic(t->input + start, t->pos - start);
+        return tok;
+    }
+
+    tok_advance(t);
+    return tok_make_token(TOK_EOF, NULL, start_line, start_col);
+}
+
+// Returns the tokens; their lexemes live in *out_arena, freed by the caller.
+static Token *tok_tokenize(const char *src, size_t *out_count, char **out_arena) {
+    Tokenizer t;
+    tok_init(&t, src);
+
+    Token *tokens = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    while (1) {
+        Token tok = tok_next(&t);
+
+        if (count >= capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            tokens = realloc(tokens, capacity * sizeof(Token));
+        }
+
+        tokens[count++] = tok;
+        if (tok.kind == TOK_EOF)
+            break;
+    }
+
+    *out_count = count;
+    *out_arena = t.arena;
+    return tokens;
+}
+
+static Token parser_peek(ParserState *p) {
+    if (p->pos >= p->count) {
+        return (Token){TOK_EOF, NULL, NULL, 0, 0};
+    }
+    return p->tokens[p->pos];
+}
+
+static Token parser_advance(ParserState *p) {
+    if (p->pos >= p->count) {
+        return (Token){TOK_EOF, NULL, NULL, 0, 0};
+    }
+    return p->tokens[p->pos++];
+}
+
+static bool parser_check(ParserState *p, TokenKind kind) {
+    return parser_peek(p).kind == kind;
+}
+
+// Reports a parse error and skips to the end of the input. Only the first
+// error is reported.
+static void parser_error(ParserState *p, int line, int col, const char *message, const char *detail) {
+    if (p->status != P_OK) return;
+    if (p->errors && detail) {
+        fprintf(p->errors, "Parse error at %d:%d: %s '%s'\n", line, col, message, detail);
+    } else if (p->errors) {
+        fprintf(p->errors, "Parse error at %d:%d: %s\n", line, col, message);
+    }
+    p->status = P_ERR_INVALID_BYTECODE;
+    p->pos = p->count;
+}
+
+static Token parser_expect(ParserState *p, TokenKind kind) {
+    Token tok = parser_advance(p);
+    if (tok.kind != kind) {
+        parser_error(p, tok.line, tok.col, "unexpected token", NULL);
+        return (Token){kind, "", NULL, tok.line, tok.col};
+    }
+    return tok;
+}
+
+static void inst_array_push(InstructionArray *arr, Instruction inst) {
+    if (arr->count >= arr->capacity) {
+        arr->capacity = arr->capacity == 0 ? 16 : arr->capacity * 2;
+        arr->data = realloc(arr->data, arr->capacity * sizeof(Instruction));
+    }
+    arr->data[arr->count++] = inst;
+}
+
+// Registers are written r0 .. r31
+static bool parse_register(const char *lexeme, int64_t *out_index) {
+    if (lexeme[0] != 'r' || !isdigit(lexeme[1])) {
+        return false;
+    }
+    char *end;
+    long index = strtol(lexeme + 1, &end, 10);
+    if (*end != '\0' || index >= P_REGISTERS_COUNT) {
+        return false;
+    }
+    *out_index = index;
+    return true;
+}
+
+static InstructionArray parse_func_body(ParserState *p) {
+    InstructionArray instructions;
+    instructions.data = NULL;
+    instructions.count = 0;
+    instructions.capacity = 0;
+
+    while (!parser_check(p, TOK_RBRACE) && !parser_check(p, TOK_EOF)) {
+        Token tok = parser_peek(p);
+
+        if (tok.kind == TOK_DOT) {
+            parser_advance(p);
+            Token label_name = parser_expect(p, TOK_IDENT);
+            parser_expect(p, TOK_COLON);
+            label_table_define(&p->labels, label_name.lexeme, instructions.count, &instructions);
+            continue;
+        }
+
+        if (tok.kind != TOK_IDENT) {
+            parser_error(p, tok.line, tok.col, "unexpected token", NULL);
+            break;
+        }
+        const Mnemonic *m = tok.mnemonic;
+        if (!m) {
+            parser_error(p, tok.line, tok.col, "unknown instruction", tok.lexeme);
+            break;
+        }
+        parser_advance(p);
+
+        switch (m->kind) {
+            case MN_PUSH: {
+                Token arg = parser_advance(p);
+                Instruction inst = p_instruction(Push, WORD(0));
+                int64_t reg;
+                if (arg.kind == TOK_AT) {
+                    Token index = parser_expect(p, TOK_NUM);
+                    char *end;
+                    long n = strtol(index.lexeme, &end, 10);
+                    if (*end != '\0' || n < 0 || n >= P_REGISTERS_COUNT) {
+                        parser_error(p, index.line, index.col, "expected a register", NULL);
+                        break;
+                    }
+                    inst.type = PushRegister;
+                    p_set_arg(&inst, WORD((int64_t)n));
+                } else if (arg.kind == TOK_IDENT && parse_register(arg.lexeme, &reg)) {
+                    inst.type = PushRegister;
+                    p_set_arg(&inst, WORD(reg));
+                } else {
+                    if (arg.kind == TOK_NUM) {
+                        if (!p_set_arg(&inst, WORD((uint64_t)atoll(arg.lexeme)))) {
+                            parser_error(p, arg.line, arg.col, "integer out of range for a NaN-boxed word", arg.lexeme);
+                        }
+                    } else if (arg.kind == TOK_STR) {
+                        p_set_arg(&inst, word_string(arg.lexeme));
+                    } else if (arg.kind == TOK_IDENT) {
+                        p_set_arg(&inst, word_string(arg.lexeme));
+                    } else {
+                        parser_error(p, arg.line, arg.col, "expected a value", NULL);
+                    }
+                }
+                inst_array_push(&instructions, inst);
+                break;
+            }
+            case MN_POP: {
+                Token arg = parser_advance(p);
+                int64_t reg;
+                if (arg.kind != TOK_IDENT || !parse_register(arg.lexeme, &reg)) {
+                    parser_error(p, arg.line, arg.col, "expected a register", NULL);
+                    break;
+                }
+                inst_array_push(&instructions, p_instruction(Pop, WORD(reg)));
+                break;
+            }
+            case MN_CALL:
+            case MN_TAILCALL: {
+                bool tail = m->kind == MN_TAILCALL;
+                Instruction inst = {0};
+                if (parser_check(p, TOK_AT)) {
+                    parser_advance(p);
+                    Token name = parser_expect(p, TOK_IDENT);
+                    inst.type = tail ? TailCallExtern : CallExtern;
+                    p_set_arg(&inst, word_string(name.lexeme));
+                } else {
+                    Token name = parser_expect(p, TOK_IDENT);
+                    inst.type = tail ? TailCall : Call;
+                    p_set_arg(&inst, word_string(name.lexeme));
+                }
+                inst_array_push(&instructions, inst);
+                break;
+            }
+            case MN_SPAWN: {
+                Token name = parser_expect(p, TOK_IDENT);
+                Instruction inst = {.type = Spawn};
+                p_set_arg(&inst, word_string(name.lexeme));
+                inst_array_push(&instructions, inst);
+                break;
+            }
+            case MN_JMP:
+            case MN_JMPIF: {
+                Token target = parser_advance(p);
+                Instruction inst = p_instruction(m->type, WORD(0));
+                if (target.kind == TOK_NUM) {
+                    p_set_arg(&inst, WORD(atoi(target.lexeme)));
+                } else if (target.kind != TOK_DOT) {
+                    parser_error(p, target.line, target.col, "expected a label or address", target.lexeme);
+                    break;
+                }
+                inst_array_push(&instructions, inst);
+                if (target.kind == TOK_DOT) {
+                    Token label_name = parser_expect(p, TOK_IDENT);
+                    label_table_reference(&p->labels, label_name.lexeme, instructions.count - 1, &instructions,
+                                          label_name.line, label_name.col);
+                }
+                break;
+            }
+            case MN_SIMPLE:
+                inst_array_push(&instructions, p_instruction(m->type, WORD(NULL)));
+                break;
+        }
+    }
+
+    // Report the first undefined label in the source.
+    Label *undefined = NULL;
+    for (size_t i = 0; i < p->labels.capacity; i++) {
+        Label *label = &p->labels.labels[i];
+        if (label->generation != p->labels.generation || label->pending == LABEL_NONE) continue;
+        if (!undefined || label->line < undefined->line ||
+            (label->line == undefined->line && label->col < undefined->col)) {
+            undefined = label;
+        }
+    }
+    if (undefined) {
+        parser_error(p, undefined->line, undefined->col, "undefined label", undefined->name);
+    }
+
+    return instructions;
+}
+
+// Parses `name { body }` into a function that isn't added to the VM yet.
+static Function *parse_func(ParserState *p, Token *name) {
+    *name = parser_expect(p, TOK_IDENT);
+    parser_expect(p, TOK_LBRACE);
+
+    label_table_reset(&p->labels);
+    InstructionArray instructions = parse_func_body(p);
+
+    parser_expect(p, TOK_RBRACE);
+
+    Function *fn = calloc(1, sizeof(Function));
+    fn->instructions = instructions;
+    return fn;
+}
+
+static void parse_func_decl(ParserState *p) {
+    Token name;
+    Function *fn = parse_func(p, &name);
+    p_add_function(p->vm, name.lexeme, fn);
+}
+
+static void parse_toplevel(ParserState *p) {
+    while (!parser_check(p, TOK_EOF)) {
+        Token tok = parser_peek(p);
+        if (tok.kind == TOK_IDENT) {
+            parse_func_decl(p);
+        } else {
+            parser_advance(p);
+        }
+    }
+}
+
+// A callee can be inlined if it is small, doesn't call itself and has no
+// tail calls (those would replace the caller's frame).
+static bool inline_candidate(Function *fn, size_t max_size) {
+    if (fn->instructions.count > max_size) return false;
+    for (size_t i = 0; i < fn->instructions.count; i++) {
+        Instruction *inst = &fn->instructions.data[i];
+        if (inst->type == TailCall || inst->type == TailCallExtern) return false;
+        if (inst->type == Call && strcmp((const char *) p_arg(inst).as_pointer, fn->name) == 0) return false;
+    }
+    return true;
+}
+
+static bool is_jump(const Instruction *inst) {
+    return inst->type == Jmp || inst->type == JmpIf;
+}
+
+// Replaces each `call` to a candidate with a copy of the callee's body. Jumps
+// inside the copy are shifted, and its `return`s become jumps to the
+// instruction after the call (a trailing `return` is dropped).
+static size_t inline_calls(ProstVM *vm, Function *fn, size_t max_size) {
+    size_t count = fn->instructions.count;
+    Instruction *code = fn->instructions.data;
+    Function **callees = calloc(count, sizeof(Function *));
+    size_t *new_index = malloc((count + 1) * sizeof(size_t));
+    size_t pos = 0;
+    size_t inlined = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        new_index[i] = pos;
+        if (code[i].type == Call) {
+            Function *callee = p_find_function(vm, (const char *) p_arg(&code[i]).as_pointer);
+            if (callee && callee != fn && inline_candidate(callee, max_size)) {
+                size_t n = callee->instructions.count;
+                if (n > 0 && callee->instructions.data[n - 1].type == Return) n--;
+                callees[i] = callee;
+                pos += n;
+                inlined++;
+                continue;
+            }
+        }
+        pos++;
+    }
+    new_index[count] = pos;
+
+    if (inlined == 0) {
+        free(callees);
+        free(new_index);
+        return 0;
+    }
+
+    InstructionArray out = {.data = malloc((pos ? pos : 1) * sizeof(Instruction)), .count = 0, .capacity = pos ? pos : 1};
+    for (size_t i = 0; i < count; i++) {
+        Function *callee = callees[i];
+        if (!callee) {
+            Instruction inst = code[i];
+            if (is_jump(&inst) && p_arg(&inst).as_int >= 0 && (size_t) p_arg(&inst).as_int <= count)
+                p_set_arg(&inst, WORD((int64_t) new_index[p_arg(&inst).as_int]));
+            out.data[out.count++] = inst;
+            continue;
+        }
+
+        size_t base = new_index[i];
+        size_t cont = new_index[i + 1];
+        size_t body = cont - base;
+        for (size_t j = 0; j < body; j++) {
+            Instruction inst = callee->instructions.data[j];
+            if (inst.type == Return) {
+                inst = p_instruction(Jmp, WORD((int64_t) cont));
+            } else if (is_jump(&inst) && p_arg(&inst).as_int >= 0 && (size_t) p_arg(&inst).as_int <= callee->instructions.count) {
+                size_t target = base + (size_t) p_arg(&inst).as_int;
+                p_set_arg(&inst, WORD((int64_t) (target < cont ? target : cont)));
+            } else if (p_is_named_call(inst.type)) {
+                p_set_arg(&inst, word_string((char *) p_arg(&inst).as_pointer));
+            }
+            out.data[out.count++] = inst;
+        }
+        free(p_arg(&code[i]).as_pointer);
+    }
+
+    free(fn->instructions.data);
+    fn->instructions = out;
+    free(callees);
+    free(new_index);
+    return inlined;
+}
+
+// Inlines small functions into their callers, up to max_depth levels of
+// nesting. Runs on the assembled program before linking. Returns the number
+// of call sites inlined. Inline so tools that never inline build without
+// unused-function warnings.
+static inline size_t inline_functions(ProstVM *vm, size_t max_size, int max_depth) {
+    size_t total = 0;
+    for (int depth = 0; depth < max_depth; depth++) {
+        size_t round = 0;
+        for (size_t i = 0; i < xvec_len(&vm->function_list); i++) {
+            Function *fn = (Function *) xvec_get(&vm->function_list, i)->as_pointer;
+            round += inline_calls(vm, fn, max_size);
+        }
+        if (round == 0) break;
+        total += round;
+    }
+    return total;
+}
+
+static ProstStatus assemble_jobs(ProstVM *vm, const char *src, int threads);
+
+static inline ProstStatus assemble(ProstVM *vm, const char *src) {
+    return assemble_jobs(vm, src, 1);
+}
+
+#ifndef _WIN32
+// One top-level declaration: the tokens parse_toplevel would consume for it
+// and, once a worker has parsed them, its function.
+typedef struct {
+    size_t start, end;
+    Function *fn;
+    bool ok;
+} AsmJob;
+
+typedef struct {
+    Token *tokens;
+    AsmJob *jobs;
+    size_t count;
+    atomic_size_t next;
+} AsmPool;
+
+// Splits the tokens at top-level declarations, walking them the way
+// parse_toplevel does. A well-formed declaration ends after its closing brace.
+static AsmJob *asm_split(Token *tokens, size_t *out_count) {
+    size_t count = 0, capacity = 64;
+    AsmJob *jobs = malloc(capacity * sizeof(AsmJob));
+    size_t i = 0;
+    while (tokens[i].kind != TOK_EOF) {
+        if (tokens[i].kind != TOK_IDENT) {
+            i++;
+            continue;
+        }
+        size_t start = i++;
+        if (tokens[i].kind == TOK_LBRACE) {
+            i++;
+            while (tokens[i].kind != TOK_RBRACE && tokens[i].kind != TOK_EOF) i++;
+            if (tokens[i].kind == TOK_RBRACE) i++;
+        } else if (tokens[i].kind != TOK_EOF) {
+            i++; // malformed, the worker fails on it
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            jobs = realloc(jobs, capacity * sizeof(AsmJob));
+        }
+        jobs[count++] = (AsmJob){.start = start, .end = i};
+    }
+    *out_count = count;
+    return jobs;
+}
+
+// Parses jobs until none are left. A job only sees its own tokens, so one
+// that would read past them (a malformed declaration) fails quietly.
+static void *asm_worker(void *arg) {
+    AsmPool *pool = arg;
+    ParserState p = {.tokens = pool->tokens, .errors = NULL};
+    label_table_init(&p.labels);
+    size_t i;
+    while ((i = atomic_fetch_add(&pool->next, 1)) < pool->count) {
+        AsmJob *job = &pool->jobs[i];
+        p.pos = job->start;
+        p.count = job->end;
+        p.status = P_OK;
+        Token name;
+        job->fn = parse_func(&p, &name);
+        job->ok = p.status == P_OK && p.pos == job->end;
+    }
+    label_table_free(&p.labels);
+    return NULL;
+}
+
+// Parses the declarations on up to threads threads and adds them in source
+// order, stopping at the first one that failed. Returns the token where
+// serial parsing resumes.
+static size_t asm_parallel(ProstVM *vm, Token *tokens, int threads) {
+    size_t job_count;
+    AsmJob *jobs = asm_split(tokens, &job_count);
+    if ((size_t) threads > job_count) threads = (int) job_count;
+    if (threads < 2) {
+        free(jobs);
+        return 0;
+    }
+
+    AsmPool pool = {.tokens = tokens, .jobs = jobs, .count = job_count};
+    atomic_init(&pool.next, 0);
+    pthread_t *workers = malloc((threads - 1) * sizeof(pthread_t));
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, asm_worker, &pool) == 0) started++;
+    asm_worker(&pool);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+
+    size_t resume = 0, i = 0;
+    for (; i < job_count && jobs[i].ok; i++) {
+        p_add_function(vm, tokens[jobs[i].start].lexeme, jobs[i].fn);
+        resume = jobs[i].end;
+    }
+    for (; i < job_count; i++) p_function_free(jobs[i].fn);
+    free(jobs);
+    return resume;
+}
+#endif
+
+// Like assemble, but parses the functions on up to threads threads (0 for
+// one per CPU). They are added in source order, so the VM and its bytecode
+// are the same as assemble's. Parse errors are found and reported by the
+// serial parser, which takes over at the first declaration a worker failed.
+static ProstStatus assemble_jobs(ProstVM *vm, const char *src, int threads) {
+    size_t token_count;
+    char *lexemes;
+    Token *tokens = tok_tokenize(src, &token_count, &lexemes);
+
+    ParserState parser;
+    parser.tokens = tokens;
+    parser.pos = 0;
+    parser.count = token_count;
+    parser.vm = vm;
+    parser.status = P_OK;
+    parser.errors = stderr;
+    label_table_init(&parser.labels);
+
+#ifndef _WIN32
+    if (threads == 0) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > 1) parser.pos = asm_parallel(vm, tokens, threads);
+#endif
+
+    parse_toplevel(&parser);
+    label_table_free(&parser.labels);
+
+    free(lexemes);
+    free(tokens);
+
+    return parser.status;
+}
+
+static char *read_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", path);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *content = malloc(size + 1);
+    if (!content) {
+        fclose(f);
+        return NULL;
+    }
+
+    fread(content, 1, size, f);
+    content[size] = '\0';
+    fclose(f);
+
+    return content;
+}
+
+#endif // PROST_ASSEMBLER_H
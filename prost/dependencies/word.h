@@ -16,6 +16,7 @@ typedef enum {
     WF_IS_STRING   = 1 << 0,
     WF_IS_UNSIGNED = 1 << 1,
     WF_OWNS_MEMORY = 1 << 2,
+    WF_IS_HANDLE   = 1 << 3, // an int the VM handed out as an opaque handle; arithmetic drops it
 } WordFlags;
 
 typedef struct {
@@ -80,6 +81,113 @@ default: word_pointer_ \
 )(val)
 
 
+// WordSlot is how the VM stores a Word on its stack, in its registers and in
+// instruction operands. By default it is the Word itself. Building with
+// PROST_NANBOX packs it into 8 bytes:
+//   - a double is stored as its own bits (every NaN becomes the positive quiet NaN)
+//   - anything else is a negative quiet NaN: bits 63..51 set, a 3-bit tag in
+//     bits 50..48 (type plus flags) and a 48-bit payload
+// An int carries at most one of WF_IS_UNSIGNED and WF_IS_HANDLE.
+// Integers are stored in 48 bits and sign-extended back, WF_IS_UNSIGNED or not
+// (the assembler marks negative literals unsigned too). word_fits tells
+// whether one survives the round trip; the VM checks it and fails rather than
+// storing a wrapped value.
+// Pointers fit because user-space addresses are 48-bit.
+// pack/unpack run on every stack access; keep them inline even in big callers
+#if defined(__GNUC__) || defined(__clang__)
+    #define WORD_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+    #define WORD_ALWAYS_INLINE inline
+#endif
+
+#ifdef PROST_NANBOX
+typedef uint64_t WordSlot;
+
+#define WORD_NANBOX_QNAN    0xFFF8000000000000ull
+#define WORD_NANBOX_NAN     0x7FF8000000000000ull
+#define WORD_NANBOX_PAYLOAD 0x0000FFFFFFFFFFFFull
+
+enum {
+    WORD_TAG_INT = 0,
+    WORD_TAG_UINT = 1,
+    WORD_TAG_CHAR = 2,
+    WORD_TAG_HANDLE = 3,
+    WORD_TAG_POINTER = 4, // | 1 for WF_IS_STRING, | 2 for WF_OWNS_MEMORY
+};
+
+static WORD_ALWAYS_INLINE WordSlot word_pack(Word w) {
+    uint64_t tag;
+    uint64_t payload;
+
+    switch (w.type) {
+        case WFLOAT: {
+            if (w.as_float != w.as_float) return WORD_NANBOX_NAN;
+            uint64_t bits;
+            memcpy(&bits, &w.as_float, sizeof(bits));
+            return bits;
+        }
+        case WCHAR_:
+            tag = WORD_TAG_CHAR;
+            payload = (uint8_t)w.as_char;
+            break;
+        case WPOINTER:
+            tag = WORD_TAG_POINTER | ((w.flags & WF_IS_STRING) ? 1 : 0) | ((w.flags & WF_OWNS_MEMORY) ? 2 : 0);
+            payload = (uint64_t)(uintptr_t)w.as_pointer;
+            break;
+        default:
+            tag = (w.flags & WF_IS_HANDLE) ? WORD_TAG_HANDLE : (w.flags & WF_IS_UNSIGNED) ? WORD_TAG_UINT : WORD_TAG_INT;
+            payload = (uint64_t)w.as_int;
+            break;
+    }
+    return WORD_NANBOX_QNAN | (tag << 48) | (payload & WORD_NANBOX_PAYLOAD);
+}
+
+static WORD_ALWAYS_INLINE bool word_fits(Word w) {
+    if (w.type != WINT) return true;
+    return ((int64_t)((uint64_t)w.as_int << 16) >> 16) == w.as_int;
+}
+
+static WORD_ALWAYS_INLINE Word word_unpack(WordSlot v) {
+    Word w = {0};
+    if ((v & WORD_NANBOX_QNAN) != WORD_NANBOX_QNAN) {
+        w.type = WFLOAT;
+        memcpy(&w.as_float, &v, sizeof(v));
+        return w;
+    }
+
+    uint64_t tag = (v >> 48) & 7;
+    uint64_t payload = v & WORD_NANBOX_PAYLOAD;
+    if (tag & WORD_TAG_POINTER) {
+        w.type = WPOINTER;
+        w.as_pointer = (void *)(uintptr_t)payload;
+        w.flags = ((tag & 1) ? WF_IS_STRING : 0) | ((tag & 2) ? WF_OWNS_MEMORY : 0);
+    } else if (tag == WORD_TAG_CHAR) {
+        w.type = WCHAR_;
+        w.as_char = (char)payload;
+    } else {
+        w.type = WINT;
+        w.as_int = (int64_t)(payload << 16) >> 16;
+        w.flags = tag == WORD_TAG_UINT ? WF_IS_UNSIGNED : tag == WORD_TAG_HANDLE ? WF_IS_HANDLE : 0;
+    }
+    return w;
+}
+#else
+typedef Word WordSlot;
+
+static inline WordSlot word_pack(Word w) {
+    return w;
+}
+
+static inline Word word_unpack(WordSlot v) {
+    return v;
+}
+
+static inline bool word_fits(Word w) {
+    (void)w;
+    return true;
+}
+#endif
+
 const char *word_type_to_str(WordType t) {
     switch (t) {
         case WINT: return "WINT";
@@ -106,15 +214,17 @@ static inline bool word_has_flag(const Word *w, WordFlags flag) {
     return (w->flags & flag) != 0;
 }
 
+// The result may be a per-thread buffer, valid until the next call on the
+// same thread.
 const char *word_to_str(const Word *w) {
-    static char buffer[64];
+    static _Thread_local char buffer[64];
 
     switch (w->type) {
         case WINT: {
             if (word_is_unsigned(w)) {
                 snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)w->as_int);
             } else {
-                snprintf(buffer, sizeof(buffer), "%lld", w->as_int);
+                snprintf(buffer, sizeof(buffer), "%lld", (long long)w->as_int);
             }
             return buffer;
         } break;
@@ -0,0 +1,725 @@
+// Fibers: the spawn, yield and join instructions.
+// Included by prost.h inside PROST_IMPLEMENTATION; not a standalone header.
+//
+// `spawn f` pops an argument, starts f in a new fiber with that argument as
+// the only value on its stack and pushes a handle to the fiber. `join` pops a
+// handle, waits for the fiber to finish and pushes its result: the top of its
+// stack when it halted or returned from f, or 0 if its stack was empty. A
+// fiber that fails makes its joiner fail with the same status. `yield` lets
+// another fiber waiting on the same worker run first; outside a fiber it does
+// nothing.
+//
+// A fiber has its own operand stack (P_FIBER_STACK_CAPACITY values), call
+// stack and registers. Functions, externals and vm->context are shared with
+// the VM that runs __entry, so externals used from fibers must be safe to
+// call from several threads at once (see "Threads" in the README).
+//
+// Fibers run on a pool of vm->fiber_workers workers, started by the first
+// spawn. Each worker owns a Chase-Lev deque of ready fibers: it pushes and
+// pops at the bottom, and a worker with nothing to do steals from the top of
+// another's. A worker runs fibers in its shell, a copy of the main VM whose
+// stack, call stack and registers are swapped for the fiber's on every
+// switch. The thread in p_run is worker 0: it runs fibers while __entry waits
+// in `join`, and once __entry is done, until every fiber has finished. A fiber
+// waiting in `join` is parked on its target and made ready when the target
+// finishes, then runs the join again.
+//
+// A handle is an int flagged WF_IS_HANDLE: the fiber's slot in its pool's
+// table and the slot's generation, which join bumps before recycling the
+// fiber. So join fails, instead of reading a recycled fiber, on anything but
+// the handle of a fiber that hasn't been joined yet. A finishing fiber hands
+// its stacks and registers (its context) to the next fiber that starts and
+// keeps only what join reads; a fiber takes a context when it first runs, so
+// fibers still queued cost no more. A fiber that is never joined holds a
+// hundred-odd bytes until the VM is freed. Functions are not JIT-compiled once the pool has
+// started (code compiled before keeps running).
+#ifndef PROST_FIBER_H
+#define PROST_FIBER_H
+
+#ifndef P_FIBER_STACK_CAPACITY
+    #define P_FIBER_STACK_CAPACITY 1024 // values
+#endif
+#define P_FIBER_CALL_STACK_INITIAL 16 // frames
+#define P_FIBER_DEQUE_INITIAL 256 // fibers, a power of two
+#define P_FIBER_INDEX_BITS 24 // fibers a pool can allocate; the rest of a handle is the generation
+#define P_FIBER_GENERATION_MASK 0x7FFFFFu // keeps handles within a NaN-boxed int
+#define P_FIBER_SEGMENT 4096 // table slots allocated at once
+#define P_FIBER_SPARE_LOCAL 64 // contexts a worker frees before handing them to the pool
+
+static ProstStatus p_run_threaded(ProstVM *vm);
+static ProstStatus p_run_table(ProstVM *vm);
+static inline bool p_can_run_fast(ProstVM *vm, Function *fn);
+static const InstructionHandler p_default_jump_table[INSTRUCTION_COUNT];
+
+#ifndef _WIN32
+
+#include <pthread.h>
+#include <sched.h>
+
+typedef struct PFiberWorker PFiberWorker;
+
+// What a fiber needs only until it finishes
+typedef struct PFiberContext {
+    PStack stack;
+    PCallStack call_stack;
+    WordSlot registers[P_REGISTERS_COUNT];
+    struct PFiberContext *next; // in a spare list
+} PFiberContext;
+
+struct PFiber {
+    PFiberContext *context; // while it runs, NULL before it starts and once finished
+    WordSlot arg; // for its stack when it starts
+    Function *fn; // where to resume
+    size_t ip;
+    bool fast_path;
+    bool started;
+    PFiberWorker *worker; // running it, valid during a slice
+    pthread_mutex_t lock; // guards done and waiters against a parking joiner
+    atomic_bool done;
+    PFiber *waiters; // fibers parked in `join` on this one
+    PFiber *next; // in a waiter list or a free list
+    PFiber *next_all; // every fiber a worker allocated, for p_fiber_pool_free
+    uint32_t index; // slot in the pool's table, for good
+    atomic_uint generation; // of the handle that may join it
+    ProstStatus status;
+    WordSlot result;
+};
+
+typedef struct PFiberRing {
+    int64_t mask;
+    struct PFiberRing *retired; // replaced rings, still readable by thieves
+    _Atomic(PFiber *) slots[];
+} PFiberRing;
+
+typedef struct {
+    atomic_llong top; // thieves take here
+    atomic_llong bottom; // the owner pushes and pops here
+    _Atomic(PFiberRing *) ring;
+} PFiberDeque;
+
+typedef enum {
+    P_FIBER_RUNS,  // finished or failed
+    P_FIBER_YIELD,
+    P_FIBER_JOIN,  // waits for worker->wait
+} PFiberSwitch;
+
+struct PFiberWorker {
+    PFiberDeque deque;
+    ProstVM shell;
+    PFiberPool *pool;
+    pthread_t thread;
+    bool threaded; // shell uses p_run_threaded
+    PFiberSwitch reason; // why the last slice stopped
+    PFiber *wait;
+    PFiber *free_fibers; // joined
+    PFiberContext *spare; // of finished fibers, for the next spawns
+    size_t spare_count; // contexts freed since spare was last handed to the pool
+    PFiber *all;
+    uint64_t rng; // victim choice
+};
+
+struct PFiberPool {
+    PFiberWorker *workers;
+    size_t count;
+    size_t started; // threads running, workers[1..started]
+    atomic_size_t queued; // fibers in the deques
+    atomic_size_t live; // spawned and not finished
+    atomic_int status; // first failure of a fiber since the last p_run
+    atomic_int sleepers; // workers waiting on idle
+    atomic_bool main_sleeping; // worker 0 waiting on main_idle
+    atomic_bool stop;
+    _Atomic(PFiberContext *) spare; // handed over by workers that finish more fibers than they spawn
+    atomic_size_t allocated; // table slots handed out
+    _Atomic(PFiber *) *_Atomic segments[((size_t)1 << P_FIBER_INDEX_BITS) / P_FIBER_SEGMENT]; // index -> fiber
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    pthread_cond_t main_idle;
+};
+
+static PFiberRing *p_fiber_ring_new(int64_t size) {
+    PFiberRing *ring = malloc(sizeof(PFiberRing) + size * sizeof(PFiber *));
+    if (!ring) return NULL;
+    ring->mask = size - 1;
+    ring->retired = NULL;
+    return ring;
+}
+
+// Owner only. Grows the ring when full; the old one stays allocated until
+// the pool is freed, since a thief may still be reading it.
+static bool p_deque_push(PFiberDeque *d, PFiber *f) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    PFiberRing *ring = atomic_load_explicit(&d->ring, memory_order_relaxed);
+    if (b - t > ring->mask) {
+        PFiberRing *grown = p_fiber_ring_new(2 * (ring->mask + 1));
+        if (!grown) return false;
+        for (int64_t i = t; i < b; i++) {
+            atomic_store_explicit(&grown->slots[i & grown->mask],
+                                  atomic_load_explicit(&ring->slots[i & ring->mask], memory_order_relaxed),
+                                  memory_order_relaxed);
+        }
+        grown->retired = ring;
+        atomic_store_explicit(&d->ring, grown, memory_order_release);
+        ring = grown;
+    }
+    atomic_store_explicit(&ring->slots[b & ring->mask], f, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+// Owner only: the most recently pushed fiber, or NULL
+static PFiber *p_deque_pop(PFiberDeque *d) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    PFiberRing *ring = atomic_load_explicit(&d->ring, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    PFiber *f = atomic_load_explicit(&ring->slots[b & ring->mask], memory_order_relaxed);
+    if (t == b) {
+        // The last one: race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            f = NULL;
+        }
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return f;
+}
+
+// Any thread: the oldest fiber, or NULL. *retry is set when another thread
+// won the race for it and the deque may not be empty.
+static PFiber *p_deque_steal(PFiberDeque *d, bool *retry) {
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) return NULL;
+    PFiberRing *ring = atomic_load_explicit(&d->ring, memory_order_acquire);
+    PFiber *f = atomic_load_explicit(&ring->slots[t & ring->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        *retry = true;
+        return NULL;
+    }
+    return f;
+}
+
+// Wakes a sleeping worker, and worker 0 if it is waiting, after fibers were
+// queued or one finished.
+static void p_fiber_wake(PFiberPool *pool) {
+    bool workers = atomic_load(&pool->sleepers) > 0;
+    bool main = atomic_load(&pool->main_sleeping);
+    if (!workers && !main) return;
+    pthread_mutex_lock(&pool->lock);
+    if (workers) pthread_cond_signal(&pool->idle);
+    if (main) pthread_cond_signal(&pool->main_idle);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void p_fiber_ready(PFiberWorker *w, PFiber *f) {
+    if (!p_deque_push(&w->deque, f)) {
+        fprintf(stderr, "ERROR: Out of memory scheduling a fiber\n");
+        abort();
+    }
+    atomic_fetch_add(&w->pool->queued, 1);
+    p_fiber_wake(w->pool);
+}
+
+// A ready fiber from w's own deque, else one stolen from another worker
+static PFiber *p_fiber_take(PFiberWorker *w) {
+    PFiberPool *pool = w->pool;
+    PFiber *f = p_deque_pop(&w->deque);
+    bool retry = true;
+    while (!f && retry && atomic_load(&pool->queued) > 0) {
+        retry = false;
+        w->rng ^= w->rng << 13;
+        w->rng ^= w->rng >> 7;
+        w->rng ^= w->rng << 17;
+        size_t start = (size_t)(w->rng % pool->count);
+        for (size_t i = 0; i < pool->count && !f; i++) {
+            PFiberWorker *victim = &pool->workers[(start + i) % pool->count];
+            if (victim != w) f = p_deque_steal(&victim->deque, &retry);
+        }
+    }
+    if (f) atomic_fetch_sub(&pool->queued, 1);
+    return f;
+}
+
+// Gives f a slot in the table, which join looks handles up in
+static bool p_fiber_register(PFiberPool *pool, PFiber *f) {
+    size_t index = atomic_fetch_add(&pool->allocated, 1);
+    if (index >= (size_t)1 << P_FIBER_INDEX_BITS) return false;
+    _Atomic(PFiber *) *_Atomic *slot = &pool->segments[index / P_FIBER_SEGMENT];
+    _Atomic(PFiber *) *segment = atomic_load(slot);
+    if (!segment) {
+        _Atomic(PFiber *) *fresh = calloc(P_FIBER_SEGMENT, sizeof(*fresh));
+        if (!fresh) return false;
+        if (atomic_compare_exchange_strong(slot, &segment, fresh)) {
+            segment = fresh;
+        } else {
+            free(fresh);
+        }
+    }
+    f->index = (uint32_t)index;
+    atomic_store_explicit(&segment[index % P_FIBER_SEGMENT], f, memory_order_release);
+    return true;
+}
+
+static void p_fiber_context_free(PFiberContext *c) {
+    p_stack_release(&c->stack);
+    free(c->call_stack.data);
+    free(c);
+}
+
+// A spare context, else the pool's spares, else a new one
+static PFiberContext *p_fiber_context_take(PFiberWorker *w) {
+    if (!w->spare && atomic_load_explicit(&w->pool->spare, memory_order_relaxed)) {
+        w->spare = atomic_exchange(&w->pool->spare, NULL);
+    }
+    PFiberContext *c = w->spare;
+    if (c) {
+        w->spare = c->next;
+        return c;
+    }
+    c = calloc(1, sizeof(PFiberContext));
+    if (!c) return NULL;
+    c->call_stack.data = malloc(P_FIBER_CALL_STACK_INITIAL * sizeof(CallFrame));
+    if (!c->call_stack.data || !p_stack_alloc(&c->stack, P_FIBER_STACK_CAPACITY)) {
+        p_fiber_context_free(c);
+        return NULL;
+    }
+    c->call_stack.capacity = P_FIBER_CALL_STACK_INITIAL;
+    return c;
+}
+
+// Keeps c for w's next spawns. Every P_FIBER_SPARE_LOCAL contexts, w's spares
+// go to the pool, so a worker that only runs fibers spawned elsewhere doesn't
+// hoard them.
+static void p_fiber_context_give(PFiberWorker *w, PFiberContext *c) {
+    c->next = w->spare;
+    w->spare = c;
+    if (++w->spare_count < P_FIBER_SPARE_LOCAL) return;
+    PFiberContext *tail = c;
+    while (tail->next) tail = tail->next;
+    PFiberContext *head = atomic_load(&w->pool->spare);
+    do {
+        tail->next = head;
+    } while (!atomic_compare_exchange_weak(&w->pool->spare, &head, c));
+    w->spare = NULL;
+    w->spare_count = 0;
+}
+
+static PFiber *p_fiber_new(PFiberWorker *w, Function *fn, Word arg) {
+    PFiber *f = w->free_fibers;
+    if (f) {
+        w->free_fibers = f->next;
+    } else {
+        f = calloc(1, sizeof(PFiber));
+        if (!f || !p_fiber_register(w->pool, f)) {
+            free(f);
+            return NULL;
+        }
+        pthread_mutex_init(&f->lock, NULL);
+        f->next_all = w->all;
+        w->all = f;
+    }
+    f->context = NULL;
+    f->arg = word_pack(arg);
+    f->fn = fn;
+    f->ip = 0;
+    f->started = false;
+    f->next = NULL;
+    f->status = P_OK;
+    // Under the lock: a joiner holding a stale handle may be checking done
+    pthread_mutex_lock(&f->lock);
+    f->waiters = NULL;
+    atomic_store_explicit(&f->done, false, memory_order_relaxed);
+    pthread_mutex_unlock(&f->lock);
+    return f;
+}
+
+static inline Word p_fiber_handle(PFiber *f) {
+    uint64_t generation = atomic_load_explicit(&f->generation, memory_order_relaxed);
+    Word handle = WORD((int64_t)(generation << P_FIBER_INDEX_BITS | f->index));
+    handle.flags = WF_IS_HANDLE;
+    return handle;
+}
+
+// The fiber a handle names, or NULL if it isn't the handle of an unjoined
+// fiber. Never dereferences anything the handle points at.
+static PFiber *p_fiber_lookup(PFiberPool *pool, Word handle, unsigned *generation) {
+    if (!pool || handle.type != WINT || !(handle.flags & WF_IS_HANDLE) || handle.as_int < 0) return NULL;
+    uint64_t index = (uint64_t)handle.as_int & (((uint64_t)1 << P_FIBER_INDEX_BITS) - 1);
+    *generation = (unsigned)((uint64_t)handle.as_int >> P_FIBER_INDEX_BITS);
+    if (index >= atomic_load(&pool->allocated)) return NULL;
+    _Atomic(PFiber *) *segment = atomic_load(&pool->segments[index / P_FIBER_SEGMENT]);
+    PFiber *f = segment ? atomic_load_explicit(&segment[index % P_FIBER_SEGMENT], memory_order_acquire) : NULL;
+    if (!f || atomic_load(&f->generation) != *generation) return NULL;
+    return f;
+}
+
+// Gives f a context holding only its argument
+static bool p_fiber_start(PFiberWorker *w, PFiber *f) {
+    PFiberContext *c = p_fiber_context_take(w);
+    if (!c) return false;
+    c->stack.size = 0;
+    c->stack.data[c->stack.size++] = f->arg;
+    c->call_stack.size = 0;
+    for (int i = 0; i < P_REGISTERS_COUNT; i++) {
+        c->registers[i] = word_pack(WORD(0));
+    }
+    f->context = c;
+    return true;
+}
+
+// Runs f on w's shell until it finishes, fails, yields or waits in `join`
+static ProstStatus p_fiber_slice(PFiberWorker *w, PFiber *f) {
+    if (!f->started && !p_fiber_start(w, f)) {
+        fprintf(stderr, "ERROR: Could not start a fiber\n");
+        return P_ERR_INVALID_VM_STATE;
+    }
+    ProstVM *vm = &w->shell;
+    PFiberContext *c = f->context;
+    vm->stack = c->stack;
+    vm->call_stack = c->call_stack;
+    memcpy(vm->registers, c->registers, sizeof(vm->registers));
+    vm->current_function_ptr = f->fn;
+    vm->current_function = f->fn->name;
+    vm->current_ip = f->ip;
+    vm->fast_path = f->started ? f->fast_path : p_can_run_fast(vm, f->fn);
+    vm->running = true;
+    vm->status = P_OK;
+    vm->fiber = f;
+    f->started = true;
+    f->worker = w;
+    w->reason = P_FIBER_RUNS;
+
+    ProstStatus status = w->threaded ? p_run_threaded(vm) : p_run_table(vm);
+
+    c->stack = vm->stack;
+    c->call_stack = vm->call_stack;
+    memcpy(c->registers, vm->registers, sizeof(vm->registers));
+    f->fn = vm->current_function_ptr;
+    f->ip = vm->current_ip;
+    f->fast_path = vm->fast_path;
+    vm->fiber = NULL;
+    return status;
+}
+
+static void p_fiber_finish(PFiberWorker *w, PFiber *f, ProstStatus status) {
+    PFiberPool *pool = w->pool;
+    PFiberContext *c = f->context;
+    f->result = c && c->stack.size > 0 ? c->stack.data[c->stack.size - 1] : word_pack(WORD(0));
+    if (c) p_fiber_context_give(w, c);
+    f->context = NULL;
+    f->status = status;
+    if (status != P_OK) {
+        int ok = P_OK;
+        atomic_compare_exchange_strong(&pool->status, &ok, (int)status);
+    }
+
+    pthread_mutex_lock(&f->lock);
+    PFiber *waiters = f->waiters;
+    f->waiters = NULL;
+    atomic_store(&f->done, true); // seq_cst, against p_fiber_help's check
+    pthread_mutex_unlock(&f->lock);
+    // f may be joined and recycled from here on
+
+    while (waiters) {
+        PFiber *next = waiters->next;
+        p_fiber_ready(w, waiters);
+        waiters = next;
+    }
+    atomic_fetch_sub(&pool->live, 1);
+    if (atomic_load(&pool->main_sleeping)) p_fiber_wake(pool);
+}
+
+// Runs f, and whatever it yields to, until they finish or are parked
+static void p_fiber_run(PFiberWorker *w, PFiber *f) {
+    for (;;) {
+        ProstStatus status = p_fiber_slice(w, f);
+        if (status != P_OK || w->reason == P_FIBER_RUNS) {
+            p_fiber_finish(w, f, status);
+            return;
+        }
+        if (w->reason == P_FIBER_YIELD) {
+            PFiber *next = p_deque_pop(&w->deque);
+            if (next) {
+                atomic_fetch_sub(&w->pool->queued, 1);
+                p_fiber_ready(w, f);
+                f = next;
+            }
+            continue;
+        }
+
+        PFiber *target = w->wait;
+        pthread_mutex_lock(&target->lock);
+        if (atomic_load_explicit(&target->done, memory_order_relaxed)) {
+            pthread_mutex_unlock(&target->lock);
+            continue;
+        }
+        f->next = target->waiters;
+        target->waiters = f;
+        pthread_mutex_unlock(&target->lock);
+        return;
+    }
+}
+
+static void *p_fiber_worker(void *arg) {
+    PFiberWorker *w = arg;
+    PFiberPool *pool = w->pool;
+    for (;;) {
+        PFiber *f = p_fiber_take(w);
+        if (f) {
+            p_fiber_run(w, f);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->stop)) {
+            pthread_cond_wait(&pool->idle, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->lock);
+        if (atomic_load(&pool->stop)) return NULL;
+    }
+}
+
+static inline bool p_fiber_waited(PFiberPool *pool, PFiber *target) {
+    return target ? atomic_load(&target->done) : atomic_load(&pool->live) == 0;
+}
+
+// Worker 0: runs fibers until target is done (with target NULL, until no
+// fiber is left), sleeping while there is nothing to run.
+static void p_fiber_help(PFiberPool *pool, PFiber *target) {
+    PFiberWorker *w = &pool->workers[0];
+    while (!p_fiber_waited(pool, target)) {
+        PFiber *f = p_fiber_take(w);
+        if (f) {
+            p_fiber_run(w, f);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        atomic_store(&pool->main_sleeping, true);
+        while (atomic_load(&pool->queued) == 0 && !p_fiber_waited(pool, target)) {
+            pthread_cond_wait(&pool->main_idle, &pool->lock);
+        }
+        atomic_store(&pool->main_sleeping, false);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void p_fiber_pool_free(PFiberPool *pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stop, true);
+    pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 1; i <= pool->started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (size_t i = 0; i < pool->count; i++) {
+        PFiberWorker *w = &pool->workers[i];
+        for (PFiber *f = w->all, *next; f; f = next) {
+            next = f->next_all;
+            if (f->context) p_fiber_context_free(f->context);
+            pthread_mutex_destroy(&f->lock);
+            free(f);
+        }
+        for (PFiberRing *r = atomic_load(&w->deque.ring), *next; r; r = next) {
+            next = r->retired;
+            free(r);
+        }
+        for (PFiberContext *c = w->spare, *next; c; c = next) {
+            next = c->next;
+            p_fiber_context_free(c);
+        }
+        xvec_free(&w->shell.owned);
+    }
+    for (PFiberContext *c = atomic_load(&pool->spare), *next; c; c = next) {
+        next = c->next;
+        p_fiber_context_free(c);
+    }
+    for (size_t i = 0; i < sizeof(pool->segments) / sizeof(pool->segments[0]); i++) {
+        free(atomic_load(&pool->segments[i]));
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->main_idle);
+    free(pool->workers);
+    free(pool);
+}
+
+// Started by the first spawn, always from the VM running __entry (nothing
+// else can spawn before it does).
+static PFiberPool *p_fiber_pool_start(ProstVM *vm) {
+    size_t count = vm->fiber_workers;
+    if (count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus > 0 ? (size_t)cpus : 1;
+    }
+    PFiberPool *pool = calloc(1, sizeof(PFiberPool));
+    if (!pool) return NULL;
+    pool->workers = calloc(count, sizeof(PFiberWorker));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pool->count = count;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pthread_cond_init(&pool->main_idle, NULL);
+#ifdef PROST_JIT
+    // Compiling would write to Functions the workers are reading
+    vm->jit = false;
+#endif
+    bool threaded = memcmp(vm->jump_table, p_default_jump_table, sizeof(vm->jump_table)) == 0;
+
+    for (size_t i = 0; i < count; i++) {
+        PFiberWorker *w = &pool->workers[i];
+        w->pool = pool;
+        w->threaded = threaded;
+        w->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        atomic_init(&w->deque.ring, p_fiber_ring_new(P_FIBER_DEQUE_INITIAL));
+        memcpy(&w->shell, vm, sizeof(ProstVM));
+        w->shell.stack = (PStack){0};
+        w->shell.call_stack = (PCallStack){0};
+        w->shell.profile = NULL;
+        w->shell.sampler = NULL;
+        w->shell.fibers = pool;
+        w->shell.fiber = NULL;
+        xvec_init(&w->shell.owned, 0);
+        if (!atomic_load(&w->deque.ring)) {
+            pool->count = i + 1;
+            p_fiber_pool_free(pool);
+            return NULL;
+        }
+    }
+    for (size_t i = 1; i < count; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, p_fiber_worker, &pool->workers[i]) != 0) break;
+        pool->started = i;
+    }
+    vm->fibers = pool;
+    return pool;
+}
+
+static PFiberWorker *p_fiber_worker_of(ProstVM *vm) {
+    if (vm->fiber) return vm->fiber->worker;
+    if (!vm->fibers && !p_fiber_pool_start(vm)) return NULL;
+    return &vm->fibers->workers[0];
+}
+
+static ProstStatus p_spawn(ProstVM *vm, Function *fn) {
+    Word arg = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+
+    PFiberWorker *w = p_fiber_worker_of(vm);
+    PFiber *f = w ? p_fiber_new(w, fn, arg) : NULL;
+    if (!f) {
+        fprintf(stderr, "ERROR: Could not start a fiber\n");
+        vm->status = P_ERR_INVALID_VM_STATE;
+        return vm->status;
+    }
+    atomic_fetch_add(&w->pool->live, 1);
+    p_fiber_ready(w, f);
+    return p_push(vm, p_fiber_handle(f));
+}
+
+static inline ProstStatus handle_spawn(ProstVM *vm, Instruction *inst) {
+    Function *fn = p_find_function(vm, (const char *)p_arg(inst).as_pointer);
+    if (!fn) {
+        vm->status = P_ERR_FUNCTION_NOT_FOUND;
+        return vm->status;
+    }
+    return p_spawn(vm, fn);
+}
+
+static inline ProstStatus handle_spawn_direct(ProstVM *vm, Instruction *inst) {
+    return p_spawn(vm, (Function *)p_arg(inst).as_pointer);
+}
+
+static inline ProstStatus handle_yield(ProstVM *vm, Instruction *inst) {
+    if (vm->fiber) {
+        vm->fiber->worker->reason = P_FIBER_YIELD;
+        vm->running = false;
+    }
+    return P_OK;
+}
+
+static inline ProstStatus handle_join(ProstVM *vm, Instruction *inst) {
+    Word handle = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    unsigned generation;
+    PFiber *target = p_fiber_lookup(vm->fibers, handle, &generation);
+    if (!target) {
+        fprintf(stderr, "ERROR: join expects the handle of a fiber that hasn't been joined\n");
+        vm->status = P_ERR_GENERAL_VM_ERROR;
+        return vm->status;
+    }
+    if (target == vm->fiber) {
+        fprintf(stderr, "ERROR: A fiber can't join itself\n");
+        vm->status = P_ERR_GENERAL_VM_ERROR;
+        return vm->status;
+    }
+    if (!atomic_load_explicit(&target->done, memory_order_acquire)) {
+        if (vm->fiber) {
+            // Park; the join runs again once target is done
+            PFiberWorker *w = vm->fiber->worker;
+            w->reason = P_FIBER_JOIN;
+            w->wait = target;
+            vm->current_ip--;
+            vm->running = false;
+            return p_push(vm, handle);
+        }
+        p_fiber_help(vm->fibers, target);
+    }
+
+    ProstStatus status = target->status;
+    WordSlot result = target->result;
+    // Claims the fiber; of two joins racing with the same handle, one fails
+    if (!atomic_compare_exchange_strong(&target->generation, &generation,
+                                        (generation + 1) & P_FIBER_GENERATION_MASK)) {
+        fprintf(stderr, "ERROR: join expects the handle of a fiber that hasn't been joined\n");
+        vm->status = P_ERR_GENERAL_VM_ERROR;
+        return vm->status;
+    }
+    PFiberWorker *w = vm->fiber ? vm->fiber->worker : &vm->fibers->workers[0];
+    target->next = w->free_fibers;
+    w->free_fibers = target;
+    if (status != P_OK) {
+        vm->status = status;
+        return vm->status;
+    }
+    return p_push_slot(vm, result);
+}
+
+// End of p_run on the VM that ran __entry: waits for the fibers left, and
+// reports the first failure of a fiber nobody joined.
+static ProstStatus p_fiber_wait_all(ProstVM *vm, ProstStatus status) {
+    if (!vm->fibers || vm->fiber) return status;
+    p_fiber_help(vm->fibers, NULL);
+    int failed = atomic_exchange(&vm->fibers->status, P_OK);
+    return status == P_OK ? (ProstStatus)failed : status;
+}
+
+#else
+
+static void p_fiber_pool_free(PFiberPool *pool) {}
+
+static inline ProstStatus p_fibers_unsupported(ProstVM *vm) {
+    fprintf(stderr, "ERROR: Fibers need POSIX threads\n");
+    vm->status = P_ERR_INVALID_VM_STATE;
+    return vm->status;
+}
+
+static inline ProstStatus handle_spawn(ProstVM *vm, Instruction *inst) { return p_fibers_unsupported(vm); }
+static inline ProstStatus handle_spawn_direct(ProstVM *vm, Instruction *inst) { return p_fibers_unsupported(vm); }
+static inline ProstStatus handle_yield(ProstVM *vm, Instruction *inst) { return P_OK; }
+static inline ProstStatus handle_join(ProstVM *vm, Instruction *inst) { return p_fibers_unsupported(vm); }
+static inline ProstStatus p_fiber_wait_all(ProstVM *vm, ProstStatus status) { return status; }
+
+#endif
+
+#endif
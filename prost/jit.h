@@ -0,0 +1,426 @@
+// Baseline x86-64 JIT (PROST_JIT, Linux x86-64 only).
+// Included by prost.h inside PROST_IMPLEMENTATION; not a standalone header.
+//
+// A hot function is translated instruction by instruction into machine code
+// that works directly on vm->stack and vm->registers. Only verified functions
+// are compiled, and compiled code only runs while vm->fast_path is set, so it
+// needs no stack bounds checks (see p_verify and p_can_run_fast).
+//
+// Stack ops, integer arithmetic, comparisons and jumps are inlined. Everything
+// else -- calls, returns, externals, the remaining opcodes and any operand
+// that isn't an int -- exits back to the interpreter with vm->current_ip at
+// that instruction. The interpreter executes it and enters the compiled code
+// again on the next function entry or backward jump.
+//
+// Register use while compiled code runs:
+//   rbx = vm, r12 = vm->stack.data, r14 = one past the top stack slot
+#ifndef PROST_JIT_H
+#define PROST_JIT_H
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#ifndef P_JIT_THRESHOLD
+    #define P_JIT_THRESHOLD 1000 // calls plus backward jumps before a function is compiled
+#endif
+
+_Static_assert(sizeof(WordSlot) == 16 && offsetof(Word, type) == 0 && offsetof(Word, as_int) == 8,
+               "the JIT assumes the 16-byte Word layout");
+
+typedef ProstStatus (*PJitEntry)(ProstVM *vm, size_t ip);
+
+enum { P_RAX = 0, P_RCX = 1, P_RDX = 2, P_RBX = 3, P_RSI = 6, P_RDI = 7, P_R12 = 12, P_R14 = 14 };
+enum { P_CC_E = 0x4, P_CC_NE = 0x5, P_CC_L = 0xC, P_CC_GE = 0xD, P_CC_LE = 0xE, P_CC_G = 0xF };
+
+#define P_SLOT 16
+#define P_TOP(n) (-(n) * P_SLOT)         // type field of the nth slot from the top (1 = top)
+#define P_TOP_VALUE(n) (P_TOP(n) + 8)    // its value
+
+typedef struct {
+    size_t pos;    // offset of the rel32 to patch
+    size_t ip;     // target instruction
+    bool to_exit;  // jump to the exit stub for ip instead of its code
+} PJitFixup;
+
+typedef struct {
+    ByteBuf code;
+    PJitFixup *fixups;
+    size_t fixup_count;
+    size_t fixup_capacity;
+} PJitAsm;
+
+static void p_jit_byte(PJitAsm *a, uint8_t b) {
+    bb_push(&a->code, b);
+}
+
+static void p_jit_bytes(PJitAsm *a, const void *src, size_t n) {
+    bb_append(&a->code, src, n);
+}
+
+static void p_jit_i32(PJitAsm *a, int32_t v) {
+    p_jit_bytes(a, &v, sizeof(v));
+}
+
+static void p_jit_u64(PJitAsm *a, uint64_t v) {
+    p_jit_bytes(a, &v, sizeof(v));
+}
+
+// <op> reg, [base + disp] (or the reverse, depending on the opcode)
+static void p_jit_mem(PJitAsm *a, bool wide, const uint8_t *op, size_t op_len, int reg, int base, int32_t disp) {
+    p_jit_byte(a, (wide ? 0x48 : 0x40) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0));
+    p_jit_bytes(a, op, op_len);
+    if (disp >= -128 && disp <= 127) {
+        p_jit_byte(a, 0x40 | ((reg & 7) << 3) | (base & 7));
+        p_jit_byte(a, (uint8_t)(int8_t)disp);
+    } else {
+        p_jit_byte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+        p_jit_i32(a, disp);
+    }
+}
+
+#define P_JIT_OP(a, reg, base, disp, ...) \
+    do { \
+        static const uint8_t op_[] = {__VA_ARGS__}; \
+        p_jit_mem(a, true, op_, sizeof(op_), reg, base, disp); \
+    } while (0)
+
+static void p_jit_load(PJitAsm *a, int reg, int base, int32_t disp) { P_JIT_OP(a, reg, base, disp, 0x8B); }
+static void p_jit_store(PJitAsm *a, int reg, int base, int32_t disp) { P_JIT_OP(a, reg, base, disp, 0x89); }
+
+// mov qword [base + disp], imm32
+static void p_jit_store_imm(PJitAsm *a, int base, int32_t disp, int32_t imm) {
+    P_JIT_OP(a, 0, base, disp, 0xC7);
+    p_jit_i32(a, imm);
+}
+
+// mov reg, imm64
+static void p_jit_mov_imm(PJitAsm *a, int reg, uint64_t imm) {
+    p_jit_byte(a, 0x48 | ((reg & 8) ? 1 : 0));
+    p_jit_byte(a, 0xB8 | (reg & 7));
+    p_jit_u64(a, imm);
+}
+
+// add r14, n / sub r14, n
+static void p_jit_adjust_top(PJitAsm *a, int slots) {
+    if (slots == 0) return;
+    uint8_t code[] = {0x49, 0x83, slots > 0 ? 0xC6 : 0xEE, (uint8_t)((slots > 0 ? slots : -slots) * P_SLOT)};
+    p_jit_bytes(a, code, sizeof(code));
+}
+
+static void p_jit_fixup(PJitAsm *a, size_t ip, bool to_exit) {
+    if (a->fixup_count == a->fixup_capacity) {
+        a->fixup_capacity = a->fixup_capacity ? a->fixup_capacity * 2 : 32;
+        a->fixups = realloc(a->fixups, a->fixup_capacity * sizeof(PJitFixup));
+    }
+    a->fixups[a->fixup_count++] = (PJitFixup){.pos = a->code.len, .ip = ip, .to_exit = to_exit};
+    p_jit_i32(a, 0);
+}
+
+static void p_jit_jmp(PJitAsm *a, size_t ip, bool to_exit) {
+    p_jit_byte(a, 0xE9);
+    p_jit_fixup(a, ip, to_exit);
+}
+
+static void p_jit_jcc(PJitAsm *a, int cc, size_t ip, bool to_exit) {
+    p_jit_byte(a, 0x0F);
+    p_jit_byte(a, 0x80 | cc);
+    p_jit_fixup(a, ip, to_exit);
+}
+
+// Exits to the interpreter at ip unless the slot n from the top holds an int
+static void p_jit_guard_int(PJitAsm *a, int n, size_t ip) {
+    static const uint8_t cmp_dword[] = {0x83};
+    p_jit_mem(a, false, cmp_dword, 1, 7, P_R14, P_TOP(n));
+    p_jit_byte(a, 0); // WINT
+    p_jit_jcc(a, P_CC_NE, ip, true);
+}
+
+// Replaces the top slot with the int in rax
+static void p_jit_store_int_top(PJitAsm *a) {
+    p_jit_store_imm(a, P_R14, P_TOP(1), 0);
+    p_jit_store(a, P_RAX, P_R14, P_TOP_VALUE(1));
+}
+
+// setcc al; movzx eax, al
+static void p_jit_setcc(PJitAsm *a, int cc) {
+    uint8_t code[] = {0x0F, 0x90 | cc, 0xC0, 0x0F, 0xB6, 0xC0};
+    p_jit_bytes(a, code, sizeof(code));
+}
+
+static int p_jit_compare_cc(InstructionType t) {
+    switch (t) {
+        case Lt: case LtImm: case BrLtImm: return P_CC_L;
+        case Lte: case LteImm: case BrLteImm: return P_CC_LE;
+        case Gt: case GtImm: case BrGtImm: return P_CC_G;
+        default: return P_CC_GE;
+    }
+}
+
+static inline int32_t p_jit_register(int64_t index) {
+    return (int32_t)(offsetof(ProstVM, registers) + index * sizeof(WordSlot));
+}
+
+// Emits one instruction; returns false if it always exits to the interpreter
+static bool p_jit_instruction(PJitAsm *a, Function *fn, size_t ip) {
+    Instruction *inst = &fn->instructions.data[ip];
+    Word arg = p_arg(inst);
+    uint64_t arg_bits[2];
+    memcpy(arg_bits, &inst->arg, sizeof(arg_bits));
+
+    switch (inst->type) {
+        case Push:
+            p_jit_mov_imm(a, P_RAX, arg_bits[0]);
+            p_jit_store(a, P_RAX, P_R14, 0);
+            p_jit_mov_imm(a, P_RAX, arg_bits[1]);
+            p_jit_store(a, P_RAX, P_R14, 8);
+            p_jit_adjust_top(a, 1);
+            return true;
+        case PushRegister:
+            p_jit_load(a, P_RAX, P_RBX, p_jit_register(arg.as_int));
+            p_jit_load(a, P_RCX, P_RBX, p_jit_register(arg.as_int) + 8);
+            p_jit_store(a, P_RAX, P_R14, 0);
+            p_jit_store(a, P_RCX, P_R14, 8);
+            p_jit_adjust_top(a, 1);
+            return true;
+        case Pop:
+            p_jit_load(a, P_RAX, P_R14, P_TOP(1));
+            p_jit_load(a, P_RCX, P_R14, P_TOP_VALUE(1));
+            p_jit_store(a, P_RAX, P_RBX, p_jit_register(arg.as_int));
+            p_jit_store(a, P_RCX, P_RBX, p_jit_register(arg.as_int) + 8);
+            p_jit_adjust_top(a, -1);
+            return true;
+        case Drop:
+            p_jit_adjust_top(a, -1);
+            return true;
+        case Dup:
+        case Over: {
+            int n = inst->type == Dup ? 1 : 2;
+            p_jit_load(a, P_RAX, P_R14, P_TOP(n));
+            p_jit_load(a, P_RCX, P_R14, P_TOP_VALUE(n));
+            p_jit_store(a, P_RAX, P_R14, 0);
+            p_jit_store(a, P_RCX, P_R14, 8);
+            p_jit_adjust_top(a, 1);
+            return true;
+        }
+        case Swap:
+            p_jit_load(a, P_RAX, P_R14, P_TOP(1));
+            p_jit_load(a, P_RCX, P_R14, P_TOP_VALUE(1));
+            p_jit_load(a, P_RDX, P_R14, P_TOP(2));
+            p_jit_load(a, P_RSI, P_R14, P_TOP_VALUE(2));
+            p_jit_store(a, P_RAX, P_R14, P_TOP(2));
+            p_jit_store(a, P_RCX, P_R14, P_TOP_VALUE(2));
+            p_jit_store(a, P_RDX, P_R14, P_TOP(1));
+            p_jit_store(a, P_RSI, P_R14, P_TOP_VALUE(1));
+            return true;
+        case Jmp:
+            p_jit_jmp(a, (size_t)arg.as_int, false);
+            return true;
+        case JmpIf: {
+            static const uint8_t cmp_qword[] = {0x83};
+            p_jit_guard_int(a, 1, ip);
+            p_jit_adjust_top(a, -1);
+            p_jit_mem(a, true, cmp_qword, 1, 7, P_R14, 8); // the popped value
+            p_jit_byte(a, 1);
+            p_jit_jcc(a, P_CC_E, (size_t)arg.as_int, false);
+            return true;
+        }
+        case Add: case Sub: case Mul: case Lt: case Lte: case Gt: case Gte:
+            p_jit_guard_int(a, 1, ip);
+            p_jit_guard_int(a, 2, ip);
+            // The bitwise ops ignore the operand types
+            [[fallthrough]];
+        case And: case Or: case Xor:
+            p_jit_load(a, P_RAX, P_R14, P_TOP_VALUE(1));
+            switch (inst->type) {
+                case Add: P_JIT_OP(a, P_RAX, P_R14, P_TOP_VALUE(2), 0x03); break;
+                case Sub: P_JIT_OP(a, P_RAX, P_R14, P_TOP_VALUE(2), 0x2B); break;
+                case Mul: P_JIT_OP(a, P_RAX, P_R14, P_TOP_VALUE(2), 0x0F, 0xAF); break;
+                case And: P_JIT_OP(a, P_RAX, P_R14, P_TOP_VALUE(2), 0x23); break;
+                case Or: P_JIT_OP(a, P_RAX, P_R14, P_TOP_VALUE(2), 0x0B); break;
+                case Xor: P_JIT_OP(a, P_RAX, P_R14, P_TOP_VALUE(2), 0x33); break;
+                default:
+                    P_JIT_OP(a, P_RAX, P_R14, P_TOP_VALUE(2), 0x3B);
+                    p_jit_setcc(a, p_jit_compare_cc(inst->type));
+                    break;
+            }
+            p_jit_adjust_top(a, -1);
+            p_jit_store_int_top(a);
+            return true;
+        case AddImm: case LtImm: case LteImm: case GtImm: case GteImm:
+        case BrLtImm: case BrLteImm: case BrGtImm: case BrGteImm:
+            if (arg.type != WINT) break;
+            p_jit_guard_int(a, 1, ip);
+            p_jit_mov_imm(a, P_RAX, (uint64_t)arg.as_int);
+            if (inst->type == AddImm) {
+                P_JIT_OP(a, P_RAX, P_R14, P_TOP_VALUE(1), 0x03);
+                p_jit_store_int_top(a);
+            } else {
+                P_JIT_OP(a, P_RAX, P_R14, P_TOP_VALUE(1), 0x3B);
+                if (inst->type >= BrLtImm && inst->type <= BrGteImm) {
+                    p_jit_jcc(a, p_jit_compare_cc(inst->type), (size_t)inst->aux, false);
+                } else {
+                    p_jit_setcc(a, p_jit_compare_cc(inst->type));
+                    p_jit_store_int_top(a);
+                }
+            }
+            return true;
+        case RegAddImm: {
+            static const uint8_t cmp_dword[] = {0x83};
+            if (arg.type != WINT) break;
+            int32_t reg = p_jit_register(inst->aux);
+            p_jit_mem(a, false, cmp_dword, 1, 7, P_RBX, reg);
+            p_jit_byte(a, 0);
+            p_jit_jcc(a, P_CC_NE, ip, true);
+            p_jit_mov_imm(a, P_RAX, (uint64_t)arg.as_int);
+            P_JIT_OP(a, P_RAX, P_RBX, reg + 8, 0x03);
+            p_jit_store_imm(a, P_RBX, reg, 0);
+            p_jit_store(a, P_RAX, P_RBX, reg + 8);
+            return true;
+        }
+        default:
+            break;
+    }
+
+    p_jit_jmp(a, ip, true);
+    return false;
+}
+
+static void p_jit_free(Function *fn) {
+    if (fn->jit_code) munmap(fn->jit_code, fn->jit_size);
+    free(fn->jit_entries);
+    fn->jit_code = NULL;
+    fn->jit_entries = NULL;
+}
+
+// Compiles fn. On failure fn->jit_failed is set and it stays interpreted.
+static bool p_jit_compile(ProstVM *vm, Function *fn) {
+    if (!fn->info.verified || fn->info.frame_stack < 0) {
+        fn->jit_failed = true;
+        return false;
+    }
+
+    size_t count = fn->instructions.count;
+    size_t *code_at = malloc((count + 1) * sizeof(size_t));
+    size_t *exit_at = malloc((count + 1) * sizeof(size_t));
+    size_t *exit_jump = malloc((count + 1) * sizeof(size_t));
+    void **entries = malloc((count + 1) * sizeof(void *));
+    PJitAsm a = {0};
+    bb_init(&a.code, 256 + count * 32);
+
+    // Prologue: save callee-saved registers (keeps rsp 16-byte aligned), load
+    // the stack into r12/r14, then jump to the code for the entry ip in rsi.
+    static const uint8_t prologue[] = {
+        0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, // push rbx, r12, r13, r14, r15
+        0x48, 0x89, 0xFB,                                     // mov rbx, rdi
+    };
+    p_jit_bytes(&a, prologue, sizeof(prologue));
+    p_jit_load(&a, P_R12, P_RBX, offsetof(ProstVM, stack) + offsetof(PStack, data));
+    p_jit_load(&a, P_RAX, P_RBX, offsetof(ProstVM, stack) + offsetof(PStack, size));
+    static const uint8_t enter[] = {
+        0x48, 0xC1, 0xE0, 0x04, // shl rax, 4
+        0x4D, 0x8D, 0x34, 0x04, // lea r14, [r12 + rax]
+    };
+    p_jit_bytes(&a, enter, sizeof(enter));
+    p_jit_mov_imm(&a, P_RAX, (uint64_t)(uintptr_t)entries);
+    static const uint8_t dispatch[] = {0xFF, 0x24, 0xF0}; // jmp [rax + rsi * 8]
+    p_jit_bytes(&a, dispatch, sizeof(dispatch));
+
+    bool *needs_exit = calloc(count + 1, sizeof(bool));
+    for (size_t ip = 0; ip < count; ip++) {
+        code_at[ip] = a.code.len;
+        p_jit_instruction(&a, fn, ip);
+    }
+    code_at[count] = a.code.len;
+    p_jit_jmp(&a, count, true);
+
+    for (size_t i = 0; i < a.fixup_count; i++) {
+        if (a.fixups[i].to_exit) needs_exit[a.fixups[i].ip] = true;
+    }
+
+    // Exit stubs: record where to resume, then leave through the epilogue
+    for (size_t ip = 0; ip <= count; ip++) {
+        if (!needs_exit[ip]) continue;
+        exit_at[ip] = a.code.len;
+        p_jit_store_imm(&a, P_RBX, offsetof(ProstVM, current_ip), (int32_t)ip);
+        p_jit_byte(&a, 0xE9);
+        exit_jump[ip] = a.code.len;
+        p_jit_i32(&a, 0); // patched to the epilogue below
+    }
+
+    size_t epilogue = a.code.len;
+    static const uint8_t write_back[] = {
+        0x4C, 0x89, 0xF0,       // mov rax, r14
+        0x4C, 0x29, 0xE0,       // sub rax, r12
+        0x48, 0xC1, 0xE8, 0x04, // shr rax, 4
+    };
+    p_jit_bytes(&a, write_back, sizeof(write_back));
+    p_jit_store(&a, P_RAX, P_RBX, offsetof(ProstVM, stack) + offsetof(PStack, size));
+    static const uint8_t leave[] = {
+        0x31, 0xC0,                                           // xor eax, eax (P_OK)
+        0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, // pop r15, r14, r13, r12, rbx
+        0xC3,                                                 // ret
+    };
+    p_jit_bytes(&a, leave, sizeof(leave));
+
+    for (size_t i = 0; i < a.fixup_count; i++) {
+        size_t target = a.fixups[i].to_exit ? exit_at[a.fixups[i].ip] : code_at[a.fixups[i].ip];
+        int32_t rel = (int32_t)(target - (a.fixups[i].pos + 4));
+        memcpy(a.code.data + a.fixups[i].pos, &rel, sizeof(rel));
+    }
+    for (size_t ip = 0; ip <= count; ip++) {
+        if (!needs_exit[ip]) continue;
+        int32_t rel = (int32_t)(epilogue - (exit_jump[ip] + 4));
+        memcpy(a.code.data + exit_jump[ip], &rel, sizeof(rel));
+    }
+
+    size_t size = a.code.len;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool ok = mem != MAP_FAILED;
+    if (ok) {
+        memcpy(mem, a.code.data, size);
+        ok = mprotect(mem, size, PROT_READ | PROT_EXEC) == 0;
+        if (!ok) munmap(mem, size);
+    }
+
+    if (ok) {
+        for (size_t ip = 0; ip <= count; ip++) {
+            entries[ip] = (uint8_t *)mem + code_at[ip];
+        }
+        fn->jit_code = mem;
+        fn->jit_size = size;
+        fn->jit_entries = entries;
+        vm->jit_compiled++;
+    } else {
+        free(entries);
+        fn->jit_failed = true;
+    }
+
+    bb_free(&a.code);
+    free(a.fixups);
+    free(code_at);
+    free(exit_at);
+    free(exit_jump);
+    free(needs_exit);
+    return ok;
+}
+
+// Runs fn's compiled code from vm->current_ip until it exits to the
+// interpreter; vm->current_ip is then the instruction to interpret next.
+static inline ProstStatus p_jit_run(ProstVM *vm, Function *fn) {
+    return ((PJitEntry)fn->jit_code)(vm, vm->current_ip);
+}
+
+// Counts a call or backward jump and compiles fn once it is hot. Returns true
+// if fn has compiled code that may run now.
+static inline bool p_jit_ready(ProstVM *vm, Function *fn) {
+    if (fn->jit_code) return vm->fast_path;
+    if (!vm->jit || fn->jit_failed || ++fn->jit_counter < vm->jit_threshold) return false;
+    return p_jit_compile(vm, fn) && vm->fast_path;
+}
+
+#undef P_JIT_OP
+#undef P_SLOT
+#undef P_TOP
+#undef P_TOP_VALUE
+
+#endif
@@ -0,0 +1,630 @@
+// Instrumenting profiler (p_profile_enable, --profile).
+// Included by prost.h inside PROST_IMPLEMENTATION; not a standalone header.
+//
+// While vm->profile is set, p_run uses p_run_profiled instead of the threaded
+// loop, so a VM without a profile pays nothing. The profiled loop runs every
+// instruction through vm->jump_table and times it, and builds a calling
+// context tree: one node per distinct chain of calls from __entry, plus one
+// leaf per external called from that chain. Direct recursion is folded into
+// the caller's node so the tree stays small. Compiled code (PROST_JIT) never
+// runs while profiling.
+//
+// Times are in ticks: rdtsc cycles on x86-64, nanoseconds elsewhere.
+#ifndef PROST_PROFILE_H
+#define PROST_PROFILE_H
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
+
+#define P_PROFILE_NONE UINT32_MAX
+
+typedef struct {
+    Function *fn; // NULL for an external
+    int64_t external; // slot of an external, else -1
+    uint32_t parent, child, sibling; // P_PROFILE_NONE when absent
+    uint64_t calls;
+    uint64_t instructions, ticks; // own, without callees
+    uint64_t total_instructions, total_ticks; // with callees, filled in by p_profile_totals
+} PProfileNode;
+
+struct PProfile {
+    PProfileNode *nodes; // parents always come before their children
+    size_t node_count;
+    size_t node_capacity;
+    uint32_t *frames; // node of each entry of vm->call_stack
+    size_t depth;
+    size_t frame_capacity;
+    uint32_t current;
+    uint64_t op_counts[INSTRUCTION_COUNT];
+    uint64_t op_ticks[INSTRUCTION_COUNT];
+};
+
+static inline uint64_t p_profile_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+ProstStatus p_profile_enable(ProstVM *vm) {
+    if (vm->profile) return P_OK;
+    vm->profile = calloc(1, sizeof(PProfile));
+    if (!vm->profile) {
+        vm->status = P_ERR_GENERAL_VM_ERROR;
+        return vm->status;
+    }
+    vm->profile->current = P_PROFILE_NONE;
+    return P_OK;
+}
+
+static void p_profile_free(PProfile *prof) {
+    if (!prof) return;
+    free(prof->nodes);
+    free(prof->frames);
+    free(prof);
+}
+
+// Returns the child of `parent` for fn (or the external), creating it. The
+// root, __entry, is node 0 and has no parent.
+static uint32_t p_profile_child(PProfile *prof, uint32_t parent, Function *fn, int64_t external) {
+    if (parent == P_PROFILE_NONE && prof->node_count > 0) return 0;
+    for (uint32_t i = parent == P_PROFILE_NONE ? P_PROFILE_NONE : prof->nodes[parent].child; i != P_PROFILE_NONE; i = prof->nodes[i].sibling) {
+        if (prof->nodes[i].fn == fn && prof->nodes[i].external == external) return i;
+    }
+
+    if (prof->node_count == prof->node_capacity) {
+        prof->node_capacity = prof->node_capacity ? prof->node_capacity * 2 : 64;
+        prof->nodes = realloc(prof->nodes, prof->node_capacity * sizeof(PProfileNode));
+    }
+    uint32_t index = (uint32_t)prof->node_count++;
+    prof->nodes[index] = (PProfileNode){.fn = fn, .external = external, .parent = parent,
+                                        .child = P_PROFILE_NONE, .sibling = P_PROFILE_NONE};
+    if (parent != P_PROFILE_NONE) {
+        prof->nodes[index].sibling = prof->nodes[parent].child;
+        prof->nodes[parent].child = index;
+    }
+    return index;
+}
+
+static uint32_t p_profile_enter(PProfile *prof, uint32_t parent, Function *fn) {
+    uint32_t node = parent != P_PROFILE_NONE && prof->nodes[parent].fn == fn ? parent : p_profile_child(prof, parent, fn, -1);
+    prof->nodes[node].calls++;
+    return node;
+}
+
+// Follows calls, returns and tail calls made by the last instruction.
+static inline void p_profile_sync(PProfile *prof, ProstVM *vm) {
+    if (vm->call_stack.size == prof->depth && vm->current_function_ptr == prof->nodes[prof->current].fn) return;
+
+    while (prof->depth > vm->call_stack.size) {
+        prof->current = prof->frames[--prof->depth];
+    }
+    if (vm->call_stack.size > prof->depth) {
+        if (prof->depth == prof->frame_capacity) {
+            prof->frame_capacity = prof->frame_capacity ? prof->frame_capacity * 2 : 64;
+            prof->frames = realloc(prof->frames, prof->frame_capacity * sizeof(uint32_t));
+        }
+        prof->frames[prof->depth++] = prof->current;
+        prof->current = p_profile_enter(prof, prof->current, vm->current_function_ptr);
+    } else if (vm->current_function_ptr != prof->nodes[prof->current].fn) {
+        // tail call: the callee replaces the current node under the same parent
+        uint32_t parent = prof->nodes[prof->current].parent;
+        prof->current = p_profile_enter(prof, parent, vm->current_function_ptr);
+    }
+}
+
+static inline int64_t p_profile_external_slot(ProstVM *vm, const Instruction *inst) {
+    switch (inst->type) {
+        case CallExternSlot:
+        case TailCallExternSlot:
+            return p_arg(inst).as_int;
+        case CallExtern:
+        case TailCallExtern:
+            return inst->aux - 1; // slot cached by handle_call_extern, -1 if the name wasn't found
+        default:
+            return -1;
+    }
+}
+
+static ProstStatus p_run_profiled(ProstVM *vm) {
+    PProfile *prof = vm->profile;
+    prof->depth = 0;
+    prof->current = p_profile_enter(prof, P_PROFILE_NONE, vm->current_function_ptr);
+
+    while (vm->running) {
+        Function *fn = vm->current_function_ptr;
+
+        if (vm->current_ip >= fn->instructions.count) {
+            if (vm->call_stack.size == 0) {
+                vm->running = false;
+                break;
+            }
+            p_return_from_frame(vm);
+            p_profile_sync(prof, vm);
+            continue;
+        }
+
+        Instruction *inst = &fn->instructions.data[vm->current_ip];
+        vm->current_ip++;
+
+        uint32_t node = prof->current;
+        uint64_t start = p_profile_now();
+        ProstStatus status = vm->jump_table[inst->type](vm, inst);
+        uint64_t ticks = p_profile_now() - start;
+
+        prof->op_counts[inst->type]++;
+        prof->op_ticks[inst->type] += ticks;
+        prof->nodes[node].instructions++;
+        int64_t slot = p_profile_external_slot(vm, inst);
+        if (slot >= 0) {
+            uint32_t ext = p_profile_child(prof, node, NULL, slot);
+            prof->nodes[ext].calls++;
+            prof->nodes[ext].ticks += ticks;
+        } else {
+            prof->nodes[node].ticks += ticks;
+        }
+
+        if (status != P_OK) {
+            return status;
+        }
+        p_profile_sync(prof, vm);
+    }
+
+    return P_OK;
+}
+
+static void p_profile_totals(PProfile *prof) {
+    for (size_t i = 0; i < prof->node_count; i++) {
+        prof->nodes[i].total_instructions = prof->nodes[i].instructions;
+        prof->nodes[i].total_ticks = prof->nodes[i].ticks;
+    }
+    for (size_t i = prof->node_count; i-- > 1;) {
+        PProfileNode *parent = &prof->nodes[prof->nodes[i].parent];
+        parent->total_instructions += prof->nodes[i].total_instructions;
+        parent->total_ticks += prof->nodes[i].total_ticks;
+    }
+}
+
+static const char *p_profile_node_name(ProstVM *vm, const PProfileNode *node) {
+    return node->fn ? node->fn->name : vm->external_names[node->external];
+}
+
+typedef void (*PProfileVisit)(ProstVM *vm, const PProfileNode *node, bool outermost, const char *path, void *ctx);
+
+// Depth-first walk without recursion. `outermost` is false when the node's
+// function is already on the path (recursion), so callers can avoid counting
+// inclusive totals twice. `path` is the semicolon-separated chain of names.
+static void p_profile_walk(ProstVM *vm, PProfileVisit visit, void *ctx) {
+    PProfile *prof = vm->profile;
+    if (!prof || prof->node_count == 0) return;
+    p_profile_totals(prof);
+
+    size_t fn_count = xvec_len(&vm->function_list);
+    uint32_t *active = calloc(fn_count + vm->external_count, sizeof(uint32_t));
+    uint32_t *stack = malloc(prof->node_count * 2 * sizeof(uint32_t));
+    size_t *prefix = malloc(prof->node_count * sizeof(size_t));
+    size_t path_capacity = 256, path_len = 0;
+    char *path = malloc(path_capacity);
+    size_t top = 0;
+    stack[top++] = 0;
+
+    while (top > 0) {
+        uint32_t entry = stack[--top];
+        uint32_t i = entry >> 1;
+        const PProfileNode *node = &prof->nodes[i];
+        size_t key = node->fn ? node->fn->index : fn_count + (size_t)node->external;
+
+        if (entry & 1) { // leaving the node
+            active[key]--;
+            path_len = prefix[i];
+            continue;
+        }
+
+        const char *name = p_profile_node_name(vm, node);
+        size_t need = path_len + strlen(name) + 3;
+        if (need > path_capacity) {
+            while (need > path_capacity) path_capacity *= 2;
+            path = realloc(path, path_capacity);
+        }
+        prefix[i] = path_len;
+        path_len += sprintf(path + path_len, "%s%s%s", path_len ? ";" : "", node->fn ? "" : "@", name);
+
+        visit(vm, node, active[key]++ == 0, path, ctx);
+
+        stack[top++] = (i << 1) | 1;
+        for (uint32_t c = node->child; c != P_PROFILE_NONE; c = prof->nodes[c].sibling) {
+            stack[top++] = c << 1;
+        }
+    }
+
+    free(path);
+    free(prefix);
+    free(stack);
+    free(active);
+}
+
+typedef struct {
+    const char *name;
+    bool external;
+    uint64_t calls, instructions, ticks, total_instructions, total_ticks;
+} PProfileRow;
+
+static void p_profile_collect(ProstVM *vm, const PProfileNode *node, bool outermost, const char *path, void *ctx) {
+    PProfileRow *rows = ctx;
+    size_t fn_count = xvec_len(&vm->function_list);
+    PProfileRow *row = node->fn ? &rows[node->fn->index] : &rows[fn_count + node->external];
+    row->name = p_profile_node_name(vm, node);
+    row->external = node->fn == NULL;
+    row->calls += node->calls;
+    row->instructions += node->instructions;
+    row->ticks += node->ticks;
+    if (outermost) {
+        row->total_instructions += node->total_instructions;
+        row->total_ticks += node->total_ticks;
+    }
+}
+
+static int p_profile_row_cmp(const void *a, const void *b) {
+    const PProfileRow *x = a, *y = b;
+    if (x->total_ticks != y->total_ticks) return x->total_ticks < y->total_ticks ? 1 : -1;
+    return 0;
+}
+
+static void p_profile_print_folded(ProstVM *vm, const PProfileNode *node, bool outermost, const char *path, void *ctx) {
+    if (node->ticks > 0) fprintf((FILE *)ctx, "%s %llu\n", path, (unsigned long long)node->ticks);
+}
+
+// Writes one line per calling context in the collapsed-stack format read by
+// flamegraph.pl and similar tools, weighted by own ticks.
+void p_profile_write_folded(ProstVM *vm, FILE *out) {
+    p_profile_walk(vm, p_profile_print_folded, out);
+}
+
+void p_profile_report(ProstVM *vm, FILE *out) {
+    PProfile *prof = vm->profile;
+    if (!prof) return;
+
+    fprintf(out, "Opcodes:\n");
+    fprintf(out, "  %-18s %14s %16s\n", "opcode", "count", "ticks");
+    for (int t = 0; t < INSTRUCTION_COUNT; t++) {
+        if (prof->op_counts[t] == 0) continue;
+        fprintf(out, "  %-18s %14llu %16llu\n", p_instr_to_str((InstructionType)t),
+                (unsigned long long)prof->op_counts[t], (unsigned long long)prof->op_ticks[t]);
+    }
+
+    size_t fn_count = xvec_len(&vm->function_list);
+    size_t row_count = fn_count + vm->external_count;
+    PProfileRow *rows = calloc(row_count, sizeof(PProfileRow));
+    p_profile_walk(vm, p_profile_collect, rows);
+    qsort(rows, row_count, sizeof(PProfileRow), p_profile_row_cmp);
+
+    fprintf(out, "Functions:\n");
+    fprintf(out, "  %-20s %10s %14s %14s %16s %16s\n", "function", "calls", "instr (incl)", "instr (excl)", "ticks (incl)", "ticks (excl)");
+    for (size_t i = 0; i < row_count; i++) {
+        PProfileRow *row = &rows[i];
+        if (!row->name || row->external) continue;
+        fprintf(out, "  %-20s %10llu %14llu %14llu %16llu %16llu\n", row->name, (unsigned long long)row->calls,
+                (unsigned long long)row->total_instructions, (unsigned long long)row->instructions,
+                (unsigned long long)row->total_ticks, (unsigned long long)row->ticks);
+    }
+
+    fprintf(out, "Externals:\n");
+    fprintf(out, "  %-20s %10s %16s\n", "external", "calls", "ticks");
+    for (size_t i = 0; i < row_count; i++) {
+        PProfileRow *row = &rows[i];
+        if (!row->name || !row->external) continue;
+        fprintf(out, "  %-20s %10llu %16llu\n", row->name, (unsigned long long)row->calls, (unsigned long long)row->ticks);
+    }
+    free(rows);
+}
+
+// Sampling profiler (p_sampler_start, --sample).
+//
+// An ITIMER_PROF interval timer sends SIGPROF at the requested rate. The
+// handler copies the current function, ip and up to P_SAMPLE_DEPTH callers
+// into a single-producer ring buffer and returns; it never allocates or
+// locks. A background thread drains the ring every few milliseconds and
+// aggregates the samples per function, per ip and per call stack. A full ring
+// drops the sample and counts it. The interpreter itself is untouched.
+//
+// SIGPROF is process-wide, so only one VM can be sampled at a time, and
+// signals that land on a thread other than the one that started sampling are
+// ignored. Under PROST_JIT, ips inside compiled code are only as current as
+// the last exit to the interpreter. POSIX only.
+#ifndef _WIN32
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#ifndef P_SAMPLE_DEPTH
+    #define P_SAMPLE_DEPTH 32 // callers recorded per sample, innermost first
+#endif
+#define P_SAMPLE_RING 4096 // samples, a power of two
+#define P_SAMPLE_DEFAULT_HZ 997
+
+typedef struct {
+    Function *fn;
+    size_t ip;
+    uint32_t depth; // entries used in frames
+    bool truncated; // the call stack was deeper than P_SAMPLE_DEPTH
+    Function *frames[P_SAMPLE_DEPTH];
+} PSample;
+
+struct PSampler {
+    ProstVM *vm;
+    pthread_t vm_thread;
+    pthread_t drain_thread;
+    PSample ring[P_SAMPLE_RING];
+    _Atomic size_t head; // written by the signal handler
+    _Atomic size_t tail; // written by the drain thread
+    _Atomic uint64_t dropped;
+    _Atomic bool stopping;
+    struct sigaction old_action;
+    // filled in by the drain thread
+    uint64_t samples;
+    uint64_t **ip_samples; // by Function.index, then ip
+    size_t *ip_counts; // instructions covered by each ip_samples entry
+    size_t fn_capacity;
+    XMap stacks; // collapsed stack -> samples
+    char *path;
+    size_t path_capacity;
+};
+
+static PSampler *_Atomic p_sampling = NULL;
+
+static void p_sampler_signal(int sig, siginfo_t *info, void *context) {
+    (void)sig; (void)info; (void)context;
+    PSampler *s = atomic_load_explicit(&p_sampling, memory_order_acquire);
+    if (!s || !pthread_equal(pthread_self(), s->vm_thread)) return;
+    ProstVM *vm = s->vm;
+    if (!vm->running || !vm->current_function_ptr) return;
+
+    size_t head = atomic_load_explicit(&s->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&s->tail, memory_order_acquire) == P_SAMPLE_RING) {
+        atomic_fetch_add_explicit(&s->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    PSample *sample = &s->ring[head & (P_SAMPLE_RING - 1)];
+    sample->fn = vm->current_function_ptr;
+    sample->ip = vm->current_ip;
+    size_t size = vm->call_stack.size;
+    CallFrame *frames = vm->call_stack.data;
+    sample->truncated = size > P_SAMPLE_DEPTH;
+    sample->depth = sample->truncated ? P_SAMPLE_DEPTH : (uint32_t)size;
+    for (uint32_t i = 0; i < sample->depth; i++) {
+        sample->frames[i] = (Function *)frames[size - 1 - i].function_ptr;
+    }
+    atomic_store_explicit(&s->head, head + 1, memory_order_release);
+}
+
+static size_t p_sampler_append(PSampler *s, size_t len, const char *name) {
+    size_t need = len + strlen(name) + 2;
+    if (need > s->path_capacity) {
+        while (need > s->path_capacity) s->path_capacity = s->path_capacity ? s->path_capacity * 2 : 256;
+        s->path = realloc(s->path, s->path_capacity);
+    }
+    return len + sprintf(s->path + len, "%s%s", len ? ";" : "", name);
+}
+
+static void p_sampler_record(PSampler *s, const PSample *sample) {
+    Function *fn = sample->fn;
+    s->samples++;
+
+    if (fn->index >= s->fn_capacity) {
+        size_t capacity = s->fn_capacity ? s->fn_capacity : 16;
+        while (capacity <= fn->index) capacity *= 2;
+        s->ip_samples = realloc(s->ip_samples, capacity * sizeof(uint64_t *));
+        s->ip_counts = realloc(s->ip_counts, capacity * sizeof(size_t));
+        memset(s->ip_samples + s->fn_capacity, 0, (capacity - s->fn_capacity) * sizeof(uint64_t *));
+        memset(s->ip_counts + s->fn_capacity, 0, (capacity - s->fn_capacity) * sizeof(size_t));
+        s->fn_capacity = capacity;
+    }
+    if (!s->ip_samples[fn->index]) {
+        s->ip_counts[fn->index] = fn->instructions.count + 1;
+        s->ip_samples[fn->index] = calloc(s->ip_counts[fn->index], sizeof(uint64_t));
+    }
+    // current_ip is already past the running instruction
+    size_t ip = sample->ip > 0 ? sample->ip - 1 : 0;
+    if (ip < s->ip_counts[fn->index]) s->ip_samples[fn->index][ip]++;
+
+    // outermost caller first
+    size_t len = 0;
+    if (sample->truncated) len = p_sampler_append(s, len, "[truncated]");
+    for (uint32_t i = sample->depth; i-- > 0;) {
+        if (sample->frames[i]) len = p_sampler_append(s, len, sample->frames[i]->name);
+    }
+    len = p_sampler_append(s, len, fn->name);
+    Word *count = xmap_get(&s->stacks, s->path);
+    if (count) {
+        count->as_int++;
+    } else {
+        xmap_set(&s->stacks, s->path, WORD((int64_t)1));
+    }
+}
+
+static void p_sampler_drain(PSampler *s) {
+    size_t head = atomic_load_explicit(&s->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+    for (; tail != head; tail++) {
+        p_sampler_record(s, &s->ring[tail & (P_SAMPLE_RING - 1)]);
+    }
+    atomic_store_explicit(&s->tail, tail, memory_order_release);
+}
+
+static void *p_sampler_thread(void *arg) {
+    PSampler *s = arg;
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = 10 * 1000000};
+    while (!atomic_load_explicit(&s->stopping, memory_order_acquire)) {
+        nanosleep(&interval, NULL);
+        p_sampler_drain(s);
+    }
+    return NULL;
+}
+
+// Starts sampling vm at about `hz` samples per second of CPU time (0 for the
+// default). Call from the thread that will run the VM.
+ProstStatus p_sampler_start(ProstVM *vm, unsigned hz) {
+    if (vm->sampler || atomic_load(&p_sampling)) {
+        fprintf(stderr, "ERROR: Another VM is already being sampled\n");
+        vm->status = P_ERR_INVALID_VM_STATE;
+        return vm->status;
+    }
+    if (hz == 0) hz = P_SAMPLE_DEFAULT_HZ;
+
+    PSampler *s = calloc(1, sizeof(PSampler));
+    if (!s) {
+        vm->status = P_ERR_GENERAL_VM_ERROR;
+        return vm->status;
+    }
+    s->vm = vm;
+    s->vm_thread = pthread_self();
+    xmap_init(&s->stacks, 0);
+
+    // The drain thread must never take SIGPROF itself.
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &block, &old_mask);
+    int error = pthread_create(&s->drain_thread, NULL, p_sampler_thread, s);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (error != 0) {
+        fprintf(stderr, "ERROR: Could not start the sampler thread: %s\n", strerror(error));
+        xmap_free(&s->stacks);
+        free(s);
+        vm->status = P_ERR_GENERAL_VM_ERROR;
+        return vm->status;
+    }
+
+    vm->sampler = s;
+    atomic_store(&p_sampling, s);
+
+    struct sigaction action = {0};
+    action.sa_sigaction = p_sampler_signal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &s->old_action);
+
+    struct itimerval timer = {0};
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+    return P_OK;
+}
+
+// Disarms the timer and aggregates the remaining samples. The results stay
+// available for p_sampler_report until the VM is freed.
+void p_sampler_stop(ProstVM *vm) {
+    PSampler *s = vm->sampler;
+    if (!s || atomic_load(&p_sampling) != s) return;
+
+    struct itimerval off = {0};
+    setitimer(ITIMER_PROF, &off, NULL);
+    atomic_store(&p_sampling, NULL);
+    sigaction(SIGPROF, &s->old_action, NULL);
+
+    atomic_store_explicit(&s->stopping, true, memory_order_release);
+    pthread_join(s->drain_thread, NULL);
+    p_sampler_drain(s);
+}
+
+static void p_sampler_free(PSampler *s) {
+    if (!s) return;
+    p_sampler_stop(s->vm);
+    for (size_t i = 0; i < s->fn_capacity; i++) {
+        free(s->ip_samples[i]);
+    }
+    free(s->ip_samples);
+    free(s->ip_counts);
+    xmap_free(&s->stacks);
+    free(s->path);
+    free(s);
+}
+
+typedef struct {
+    Function *fn;
+    size_t first, last; // ip range
+    uint64_t samples;
+} PSampleRange;
+
+static int p_sample_range_cmp(const void *a, const void *b) {
+    const PSampleRange *x = a, *y = b;
+    return x->samples < y->samples ? 1 : x->samples > y->samples ? -1 : 0;
+}
+
+// Prints the functions and ip ranges that samples landed in. Adjacent ips
+// with samples are merged into one range.
+void p_sampler_report(ProstVM *vm, FILE *out) {
+    PSampler *s = vm->sampler;
+    if (!s) return;
+    double total = s->samples ? (double)s->samples : 1.0;
+
+    fprintf(out, "Samples: %llu (%llu dropped)\n", (unsigned long long)s->samples,
+            (unsigned long long)atomic_load(&s->dropped));
+
+    size_t range_count = 0, range_capacity = 16;
+    PSampleRange *ranges = malloc(range_capacity * sizeof(PSampleRange));
+    PSampleRange *functions = calloc(s->fn_capacity + 1, sizeof(PSampleRange));
+    for (size_t i = 0; i < xvec_len(&vm->function_list) && i < s->fn_capacity; i++) {
+        Function *fn = (Function *)xvec_get(&vm->function_list, i)->as_pointer;
+        uint64_t *ips = s->ip_samples[i];
+        if (!ips) continue;
+        functions[i].fn = fn;
+        for (size_t ip = 0; ip < s->ip_counts[i]; ip++) {
+            if (ips[ip] == 0) continue;
+            functions[i].samples += ips[ip];
+            if (range_count > 0 && ranges[range_count - 1].fn == fn && ranges[range_count - 1].last + 1 == ip) {
+                ranges[range_count - 1].last = ip;
+                ranges[range_count - 1].samples += ips[ip];
+                continue;
+            }
+            if (range_count == range_capacity) {
+                range_capacity *= 2;
+                ranges = realloc(ranges, range_capacity * sizeof(PSampleRange));
+            }
+            ranges[range_count++] = (PSampleRange){.fn = fn, .first = ip, .last = ip, .samples = ips[ip]};
+        }
+    }
+    qsort(functions, s->fn_capacity, sizeof(PSampleRange), p_sample_range_cmp);
+    qsort(ranges, range_count, sizeof(PSampleRange), p_sample_range_cmp);
+
+    fprintf(out, "Functions:\n");
+    fprintf(out, "  %-20s %10s %7s\n", "function", "samples", "%");
+    for (size_t i = 0; i < s->fn_capacity && functions[i].samples > 0; i++) {
+        fprintf(out, "  %-20s %10llu %6.1f%%\n", functions[i].fn->name,
+                (unsigned long long)functions[i].samples, 100.0 * functions[i].samples / total);
+    }
+    fprintf(out, "Hot ranges:\n");
+    fprintf(out, "  %-20s %13s %10s %7s\n", "function", "ips", "samples", "%");
+    for (size_t i = 0; i < range_count && i < 20; i++) {
+        char ips[32];
+        snprintf(ips, sizeof(ips), "%zu-%zu", ranges[i].first, ranges[i].last);
+        fprintf(out, "  %-20s %13s %10llu %6.1f%%\n", ranges[i].fn->name, ips,
+                (unsigned long long)ranges[i].samples, 100.0 * ranges[i].samples / total);
+    }
+    free(functions);
+    free(ranges);
+}
+
+// Writes the sampled call stacks in collapsed-stack format, one line per
+// distinct stack with its sample count.
+void p_sampler_write_folded(ProstVM *vm, FILE *out) {
+    PSampler *s = vm->sampler;
+    if (!s) return;
+    for (size_t i = 0; i < s->stacks.capacity; i++) {
+        XEntry *e = &s->stacks.entries[i];
+        if (e->occupied) fprintf(out, "%s %lld\n", e->key, (long long)e->value.as_int);
+    }
+}
+
+#endif // !_WIN32
+
+#endif // PROST_PROFILE_H
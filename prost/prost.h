@@ -4,6 +4,8 @@
 #ifndef PROST_H
 #define PROST_H
 
+#include <math.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,25 +14,87 @@
     #include <windows.h>
 #else
     #include <dlfcn.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
 #endif
 
 #include "dependencies/xvec.h"
 #include "dependencies/xmap.h"
 #include "dependencies/bb.h"
 
+#ifdef PROST_JIT
+    #if !defined(__linux__) || !defined(__x86_64__)
+        #error "PROST_JIT is only supported on Linux x86-64"
+    #endif
+    #ifdef PROST_NANBOX
+        #error "PROST_JIT does not support PROST_NANBOX"
+    #endif
+#endif
+
 #define P_REGISTERS_COUNT 32
-#define CALL_FRAME_POOL_SIZE 256
+#define P_CALL_STACK_INITIAL 256 // frames
+#ifndef P_MAX_CALL_DEPTH
+    #define P_MAX_CALL_DEPTH (1024 * 1024) // frames
+#endif
+#ifndef P_STACK_DEFAULT_CAPACITY
+    #define P_STACK_DEFAULT_CAPACITY (256 * 1024) // values
+#endif
 
 typedef enum {
     Push, PushRegister, Pop, Drop, Halt, Call, CallExtern, Return, Jmp, JmpIf,
-    Dup, Swap, Over, Eq, Neq, Lt, Lte, Gt, Gte, Read8, Write8, INSTRUCTION_COUNT
+    Dup, Swap, Over, Eq, Neq, Lt, Lte, Gt, Gte, Read8, Write8,
+    Add, Sub, Mul, Div, Mod, And, Or, Xor, Shl, Shr, Not,
+    // Superinstructions, produced by p_optimize and never by the assembler.
+    // The immediate is in arg; `aux` holds the jump target or register.
+    AddImm,                               // push N; add
+    LtImm, LteImm, GtImm, GteImm,         // push N; <cmp>
+    BrLtImm, BrLteImm, BrGtImm, BrGteImm, // dup; push N; <cmp>; jmpif L
+    RegAddImm,                            // push rX; push N; add; pop rX
+    // Call, then return to the caller without a frame of its own (see
+    // p_mark_tail_calls). At the bottom of the call stack they are plain calls.
+    TailCall, TailCallExtern,
+    // Fibers (see fiber.h). spawn's arg is the function's name.
+    Spawn, Yield, Join,
+    // Resolved by p_link and never serialized; everything from CallDirect on is
+    // a linked form.
+    CallDirect, // Call, arg is the callee Function*
+    CallExternSlot, // CallExtern, arg is the external slot
+    TailCallDirect, // TailCall, arg is the callee Function*
+    TailCallExternSlot, // TailCallExtern, arg is the external slot
+    SpawnDirect, // Spawn, arg is the Function*
+    INSTRUCTION_COUNT
 } InstructionType;
 
 typedef struct {
     InstructionType type;
-    Word arg;
+    int32_t aux; // second operand of superinstructions; cached slot + 1 for CallExtern, otherwise 0
+    WordSlot arg; // read and write through p_arg / p_set_arg
 } Instruction;
 
+static inline Word p_arg(const Instruction *inst) {
+    return word_unpack(inst->arg);
+}
+
+// False if w is an integer the build can't store (see word_fits)
+static inline bool p_set_arg(Instruction *inst, Word w) {
+    inst->arg = word_pack(w);
+    return word_fits(w);
+}
+
+static inline Instruction p_instruction(InstructionType type, Word arg) {
+    return (Instruction){.type = type, .aux = 0, .arg = word_pack(arg)};
+}
+
+// Operand stack. Holds WordSlots, so with PROST_NANBOX each entry is 8 bytes.
+typedef struct {
+    WordSlot *data;
+    size_t size;
+    size_t capacity;
+    size_t mapped; // bytes mapped with PROST_STACK_GUARD, else 0
+} PStack;
+
 
 typedef enum {
     P_OK = 0,
@@ -42,59 +106,159 @@ typedef enum {
     P_ERR_CALL_STACK_UNDERFLOW,
     P_ERR_INVALID_VM_STATE,
     P_ERR_GENERAL_VM_ERROR,
+    P_ERR_STACK_OVERFLOW,
+    P_ERR_CALL_STACK_OVERFLOW,
+    P_ERR_INT_OVERFLOW,
 } ProstStatus;
 
 typedef struct {
     const char *function_name;
     void *function_ptr;
     size_t return_ip;
+    bool fast_path; // caller's vm->fast_path, restored on return
 } CallFrame;
 
+// Frames are stored by value. The array doubles when full, up to
+// vm->max_call_depth frames, and is never shrunk.
+typedef struct {
+    CallFrame *data;
+    size_t size;
+    size_t capacity;
+} PCallStack;
+
 typedef struct {
     Instruction *data;
     size_t count;
     size_t capacity;
 } InstructionArray;
 
+// Filled in by p_verify. Depths count stack values, relative to the stack
+// size when the function is entered.
 typedef struct {
+    bool verified;     // cannot underflow when entered with stack_in values; targets and registers are valid
+    bool returns;      // some path returns to the caller (instead of halting)
+    int32_t stack_in;  // values the function consumes from its caller
+    int32_t stack_out; // values it leaves in their place, -1 if that differs between paths
+    int32_t max_stack; // peak depth above the entry size, -1 if unbounded
+    int32_t frame_stack; // like max_stack, but only this function's own pushes; -1 if unbounded
+} FunctionInfo;
+
+typedef struct {
+    char *name;
     InstructionArray instructions;
+    size_t index; // position in vm->function_list
+    bool in_arena; // struct, name, code and call strings live in a vm->arenas block
+    FunctionInfo info;
+#ifdef PROST_JIT
+    void *jit_code; // machine code, see jit.h
+    size_t jit_size;
+    void **jit_entries; // ip -> address in jit_code
+    uint32_t jit_counter; // calls and backward jumps so far
+    bool jit_failed;
+#endif
 } Function;
 
+// What an external does to the stack, for p_verify: it needs and removes
+// `pops` values, then pushes `pushes`. pops < 0 means unknown.
+typedef struct {
+    int8_t pops;
+    int8_t pushes;
+} PStackEffect;
+
 typedef struct ProstVM ProstVM;
+typedef struct PProfile PProfile; // see profile.h
+typedef struct PSampler PSampler; // see profile.h
+typedef struct PFiber PFiber; // see fiber.h
+typedef struct PFiberPool PFiberPool; // see fiber.h
 typedef void (*p_external_function)(ProstVM *vm);
 typedef ProstStatus (*InstructionHandler)(ProstVM *vm, Instruction *inst);
 
+// A VM shares no mutable state with other VMs, so different VMs can run on
+// different threads at once. A single VM is not synchronized: use it from one
+// thread at a time. Externals get the VM they run in; per-VM data belongs in
+// vm->context or memory handed to p_own, not in globals.
 struct ProstVM {
-    Word registers[P_REGISTERS_COUNT]; // TODO: implement usage
-    XVec stack;
-    XVec call_stack;
+    WordSlot registers[P_REGISTERS_COUNT];
+    PStack stack;
+    PCallStack call_stack;
+    size_t max_call_depth; // deeper calls fail with P_ERR_CALL_STACK_OVERFLOW
     XMap functions;
-    XMap external_functions;
+    XVec function_list; // Function* in load order, for iteration
+    XVec arenas; // one block per decoded bytecode, see p_decode
+    XMap external_functions; // name -> slot index
+    p_external_function *externals; // slot -> function, slots never move
+    char **external_names;
+    PStackEffect *external_effects;
+    size_t external_count;
+    size_t external_capacity;
     ProstStatus status;
     bool running;
     int exit_code;
     const char *current_function;
     Function *current_function_ptr;
     size_t current_ip;
+    bool fast_path; // current function is verified and was entered with enough values
     InstructionHandler jump_table[INSTRUCTION_COUNT];
-    CallFrame *frame_pool;
-    size_t frame_pool_index;
+    bool optimize; // run p_optimize when loading bytecode
+    FILE *verify_report; // if set, loading rejects bytecode that fails p_verify, reporting why here
+    size_t fusion_counts[INSTRUCTION_COUNT]; // superinstructions created, by opcode
+    PProfile *profile; // set by p_profile_enable, NULL otherwise
+    PSampler *sampler; // set by p_sampler_start, NULL otherwise
+    void *context; // the embedder's, for its externals; the VM never touches it
+    XVec owned; // blocks freed with the VM, see p_own
+    size_t fiber_workers; // threads that run fibers, counting the one in p_run; 0 = one per CPU
+    PFiberPool *fibers; // started by the first spawn, NULL before
+    PFiber *fiber; // the fiber this VM is running, NULL outside fibers
+#ifdef PROST_JIT
+    bool jit; // compile hot functions
+    uint32_t jit_threshold; // calls plus backward jumps before compiling
+    size_t jit_compiled;
+#endif
 };
 
 ProstVM *p_init();
 void p_free(ProstVM *vm);
+ProstStatus p_set_stack_capacity(ProstVM *vm, size_t capacity);
+void p_own(ProstVM *vm, void *ptr);
 ProstStatus p_load_library(ProstVM *vm, const char *path);
 ProstStatus p_register_external(ProstVM *vm, const char *name, p_external_function fn);
+ProstStatus p_register_external_ex(ProstVM *vm, const char *name, p_external_function fn, int pops, int pushes);
+int64_t p_external_slot(ProstVM *vm, const char *name);
+Function *p_add_function(ProstVM *vm, const char *name, Function *fn);
+Function *p_find_function(ProstVM *vm, const char *name);
+ProstStatus p_link(ProstVM *vm);
+ProstStatus p_optimize(ProstVM *vm);
+ProstStatus p_mark_tail_calls(ProstVM *vm);
+ProstStatus p_verify(ProstVM *vm, FILE *report);
+void p_print_fusion_stats(ProstVM *vm, FILE *out);
+const char *p_instr_to_str(InstructionType t);
 ByteBuf p_to_bytecode(ProstVM *vm);
 ProstStatus p_from_bytecode(ProstVM *vm, const char *bytecode);
+ProstStatus p_from_bytecode_n(ProstVM *vm, const char *bytecode, size_t size);
+ProstStatus p_decode_bytecode(ProstVM *vm, const char *bytecode);
+ProstStatus p_decode_bytecode_n(ProstVM *vm, const char *bytecode, size_t size);
+ProstStatus p_load_file(ProstVM *vm, const char *path);
 ProstStatus p_call(ProstVM *vm, const char *name);
+ProstStatus p_call_function(ProstVM *vm, Function *fn);
+ProstStatus p_tail_call_function(ProstVM *vm, Function *fn);
 ProstStatus p_call_extern(ProstVM *vm, const char *name);
 ProstStatus p_execute_instruction(ProstVM *vm, Instruction *instruction);
 ProstStatus p_run(ProstVM *vm);
+ProstStatus p_profile_enable(ProstVM *vm);
+void p_profile_report(ProstVM *vm, FILE *out);
+void p_profile_write_folded(ProstVM *vm, FILE *out);
+#ifndef _WIN32
+ProstStatus p_sampler_start(ProstVM *vm, unsigned hz);
+void p_sampler_stop(ProstVM *vm);
+void p_sampler_report(ProstVM *vm, FILE *out);
+void p_sampler_write_folded(ProstVM *vm, FILE *out);
+#endif
 
 static inline Word p_pop(ProstVM *vm);
-static inline void p_push(ProstVM *vm, Word w);
+static inline ProstStatus p_push(ProstVM *vm, Word w);
 static inline Word p_peek(ProstVM *vm);
+static inline size_t p_stack_size(ProstVM *vm);
+static inline Word p_stack_get(ProstVM *vm, size_t index);
 Word p_expect(ProstVM *vm, WordType t);
 void p_throw_warning(ProstVM *vm, const char *msg, ...);
 
@@ -112,44 +276,193 @@ char *format(char *fmt, ...) {
     return str;
 }
 
-static inline Word p_pop(ProstVM *vm) {
-    if (xvec_empty(&vm->stack)) {
+static const char *p_instruction_names[INSTRUCTION_COUNT] = {
+    [Push] = "push",
+    [PushRegister] = "push_register",
+    [Pop] = "pop",
+    [Drop] = "drop",
+    [Halt] = "halt",
+    [Call] = "call",
+    [CallExtern] = "call_extern",
+    [Return] = "return",
+    [Jmp] = "jmp",
+    [JmpIf] = "jmp_if",
+    [Dup] = "dup",
+    [Swap] = "swap",
+    [Over] = "over",
+    [Eq] = "eq",
+    [Neq] = "neq",
+    [Lt] = "lt",
+    [Lte] = "lte",
+    [Gt] = "gt",
+    [Gte] = "gte",
+    [Read8] = "read8",
+    [Write8] = "write8",
+    [Add] = "add",
+    [Sub] = "sub",
+    [Mul] = "mul",
+    [Div] = "div",
+    [Mod] = "mod",
+    [And] = "and",
+    [Or] = "or",
+    [Xor] = "xor",
+    [Shl] = "shl",
+    [Shr] = "shr",
+    [Not] = "not",
+    [AddImm] = "add_imm",
+    [LtImm] = "lt_imm",
+    [LteImm] = "lte_imm",
+    [GtImm] = "gt_imm",
+    [GteImm] = "gte_imm",
+    [BrLtImm] = "br_lt_imm",
+    [BrLteImm] = "br_lte_imm",
+    [BrGtImm] = "br_gt_imm",
+    [BrGteImm] = "br_gte_imm",
+    [RegAddImm] = "reg_add_imm",
+    [TailCall] = "tailcall",
+    [TailCallExtern] = "tailcall_extern",
+    [Spawn] = "spawn",
+    [Yield] = "yield",
+    [Join] = "join",
+    [CallDirect] = "call",
+    [CallExternSlot] = "call_extern",
+    [TailCallDirect] = "tailcall",
+    [TailCallExternSlot] = "tailcall_extern",
+    [SpawnDirect] = "spawn",
+};
+
+const char *p_instr_to_str(InstructionType t) {
+    if (t >= INSTRUCTION_COUNT || !p_instruction_names[t]) return "unknown";
+    return p_instruction_names[t];
+}
+
+// Superinstructions whose aux operand is part of the serialized form
+static inline bool p_instr_has_aux(InstructionType t) {
+    return t >= BrLtImm && t <= RegAddImm;
+}
+
+// Unlinked calls and spawns, whose arg is the callee's name
+static inline bool p_is_named_call(InstructionType t) {
+    return t == Call || t == CallExtern || t == TailCall || t == TailCallExtern || t == Spawn;
+}
+
+// Forms only p_link produces; bytecode must not contain them
+static inline bool p_is_linked_op(InstructionType t) {
+    return t >= CallDirect && t < INSTRUCTION_COUNT;
+}
+
+// The operand stack never grows: it is allocated once with vm->stack.capacity
+// slots (see p_set_stack_capacity) and a push past the end fails with
+// P_ERR_STACK_OVERFLOW. With PROST_STACK_GUARD it is mmap'ed between two
+// inaccessible pages, so a stray unchecked access faults instead of
+// corrupting the heap.
+#if defined(PROST_STACK_GUARD) && !defined(_WIN32)
+static size_t p_page_size(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    return page > 0 ? (size_t)page : 4096;
+}
+
+static bool p_stack_alloc(PStack *stack, size_t capacity) {
+    size_t page = p_page_size();
+    size_t bytes = (capacity * sizeof(WordSlot) + page - 1) / page * page;
+    uint8_t *base = mmap(NULL, bytes + 2 * page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return false;
+    if (mprotect(base + page, bytes, PROT_READ | PROT_WRITE) != 0) {
+        munmap(base, bytes + 2 * page);
+        return false;
+    }
+    stack->data = (WordSlot *)(base + page);
+    stack->capacity = capacity;
+    stack->mapped = bytes + 2 * page;
+    return true;
+}
+
+static void p_stack_release(PStack *stack) {
+    if (stack->data) munmap((uint8_t *)stack->data - p_page_size(), stack->mapped);
+    stack->data = NULL;
+}
+#else
+static bool p_stack_alloc(PStack *stack, size_t capacity) {
+    stack->data = malloc(capacity * sizeof(WordSlot));
+    if (!stack->data) return false;
+    stack->capacity = capacity;
+    stack->mapped = 0;
+    return true;
+}
+
+static void p_stack_release(PStack *stack) {
+    free(stack->data);
+    stack->data = NULL;
+}
+#endif
+
+static ProstStatus p_stack_overflow(ProstVM *vm) {
+    fprintf(stderr, "ERROR: Stack overflow (capacity %zu)\n", vm->stack.capacity);
+    vm->status = P_ERR_STACK_OVERFLOW;
+    vm->running = false;
+    return vm->status;
+}
+
+static ProstStatus p_int_overflow(ProstVM *vm) {
+    fprintf(stderr, "ERROR: Integer does not fit in a NaN-boxed word\n");
+    vm->status = P_ERR_INT_OVERFLOW;
+    vm->running = false;
+    return vm->status;
+}
+
+static WORD_ALWAYS_INLINE ProstStatus p_push_slot(ProstVM *vm, WordSlot w) {
+    if (vm->stack.size == vm->stack.capacity) {
+        return p_stack_overflow(vm);
+    }
+    vm->stack.data[vm->stack.size++] = w;
+    return P_OK;
+}
+
+static WORD_ALWAYS_INLINE Word p_pop(ProstVM *vm) {
+    if (vm->stack.size == 0) {
         vm->status = P_ERR_STACK_UNDERFLOW;
         return WORD(NULL);
     }
     vm->status = P_OK;
-    return xvec_pop(&vm->stack);
+    return word_unpack(vm->stack.data[--vm->stack.size]);
 }
 
-static inline void p_push(ProstVM *vm, Word w) {
-    xvec_push(&vm->stack, w);
+static WORD_ALWAYS_INLINE ProstStatus p_push(ProstVM *vm, Word w) {
+    if (!word_fits(w)) return p_int_overflow(vm);
+    return p_push_slot(vm, word_pack(w));
 }
 
 static inline Word p_peek(ProstVM *vm) {
-    if (xvec_empty(&vm->stack)) {
+    if (vm->stack.size == 0) {
         vm->status = P_ERR_STACK_UNDERFLOW;
         return WORD(NULL);
     }
-    Word *top = xvec_get(&vm->stack, xvec_len(&vm->stack) - 1);
-    return *top;
+    return word_unpack(vm->stack.data[vm->stack.size - 1]);
 }
 
-static ProstStatus handle_push(ProstVM *vm, Instruction *inst) {
-    p_push(vm, inst->arg);
-    return P_OK;
+static inline size_t p_stack_size(ProstVM *vm) {
+    return vm->stack.size;
 }
 
-static ProstStatus handle_push_register(ProstVM *vm, Instruction *inst) {
-    p_push(vm, vm->registers[inst->arg.as_int]);
-    return P_OK;
+// index 0 is the bottom of the stack
+static inline Word p_stack_get(ProstVM *vm, size_t index) {
+    return word_unpack(vm->stack.data[index]);
+}
+
+static inline ProstStatus handle_push(ProstVM *vm, Instruction *inst) {
+    return p_push_slot(vm, inst->arg);
+}
+
+static inline ProstStatus handle_push_register(ProstVM *vm, Instruction *inst) {
+    return p_push_slot(vm, vm->registers[p_arg(inst).as_int]);
 }
 
-static ProstStatus handle_pop(ProstVM *vm, Instruction *inst) {
-    vm->registers[inst->arg.as_int] = p_pop(vm);
+static inline ProstStatus handle_pop(ProstVM *vm, Instruction *inst) {
+    vm->registers[p_arg(inst).as_int] = word_pack(p_pop(vm));
     return P_OK;
 }
 
-static ProstStatus handle_read8(ProstVM *vm, Instruction *inst) {
+static inline ProstStatus handle_read8(ProstVM *vm, Instruction *inst) {
     Word addr_word = p_pop(vm);
     if (vm->status != P_OK) {
         return vm->status;
@@ -165,11 +478,10 @@ static ProstStatus handle_read8(ProstVM *vm, Instruction *inst) {
     uint64_t value = 0;
     memcpy(&value, ptr, 8);
 
-    p_push(vm, WORD((int64_t)value));
-    return P_OK;
+    return p_push(vm, WORD((int64_t)value));
 }
 
-static ProstStatus handle_write8(ProstVM *vm, Instruction *inst) {
+static inline ProstStatus handle_write8(ProstVM *vm, Instruction *inst) {
     Word value_word = p_pop(vm);
     if (vm->status != P_OK) {
         return vm->status;
@@ -203,454 +515,2210 @@ static ProstStatus handle_write8(ProstVM *vm, Instruction *inst) {
     return P_OK;
 }
 
-static ProstStatus handle_drop(ProstVM *vm, Instruction *inst) {
-    p_pop(vm);
-    return vm->status;
+static inline ProstStatus handle_drop(ProstVM *vm, Instruction *inst) {
+    if (vm->stack.size == 0) {
+        vm->status = P_ERR_STACK_UNDERFLOW;
+        return vm->status;
+    }
+    vm->stack.size--;
+    vm->status = P_OK;
+    return P_OK;
 }
 
-static ProstStatus handle_halt(ProstVM *vm, Instruction *inst) {
+static inline ProstStatus handle_halt(ProstVM *vm, Instruction *inst) {
     vm->running = false;
     return P_OK;
 }
 
-static ProstStatus handle_call(ProstVM *vm, Instruction *inst) {
-    const char *fn_name = (const char *)inst->arg.as_pointer;
+static inline ProstStatus handle_call(ProstVM *vm, Instruction *inst) {
+    const char *fn_name = (const char *)p_arg(inst).as_pointer;
     return p_call(vm, fn_name);
 }
 
-static ProstStatus handle_call_extern(ProstVM *vm, Instruction *inst) {
-    const char *fn_name = (const char *)inst->arg.as_pointer;
-    return p_call_extern(vm, fn_name);
+static inline ProstStatus handle_call_direct(ProstVM *vm, Instruction *inst) {
+    return p_call_function(vm, (Function *)p_arg(inst).as_pointer);
+}
+
+static inline ProstStatus p_call_extern_slot(ProstVM *vm, int64_t slot) {
+    vm->externals[slot](vm);
+    if (vm->status == P_ERR_STACK_OVERFLOW || vm->status == P_ERR_INT_OVERFLOW) return vm->status;
+    vm->status = P_OK;
+    return vm->status;
+}
+
+// An unlinked `call @name` looks the name up once and caches slot + 1 in aux.
+// Slots never move and re-registering a name replaces the function in its
+// slot, so the cache can't go stale.
+static inline ProstStatus handle_call_extern(ProstVM *vm, Instruction *inst) {
+    if (inst->aux > 0) return p_call_extern_slot(vm, inst->aux - 1);
+    const char *fn_name = (const char *)p_arg(inst).as_pointer;
+    int64_t slot = fn_name ? p_external_slot(vm, fn_name) : -1;
+    if (slot < 0 || slot >= INT32_MAX) return p_call_extern(vm, fn_name);
+    inst->aux = (int32_t)slot + 1;
+    return p_call_extern_slot(vm, slot);
 }
 
-static ProstStatus handle_return(ProstVM *vm, Instruction *inst) {
-    if (xvec_empty(&vm->call_stack)) {
-        return P_ERR_CALL_STACK_UNDERFLOW;
+static inline void p_return_from_frame(ProstVM *vm);
+
+static inline ProstStatus handle_call_extern_slot(ProstVM *vm, Instruction *inst) {
+    return p_call_extern_slot(vm, p_arg(inst).as_int);
+}
+
+static inline ProstStatus handle_tail_call(ProstVM *vm, Instruction *inst) {
+    Function *fn = p_find_function(vm, (const char *)p_arg(inst).as_pointer);
+    if (!fn) {
+        vm->status = P_ERR_FUNCTION_NOT_FOUND;
+        return vm->status;
     }
-    Word frame_word = xvec_pop(&vm->call_stack);
-    CallFrame *frame = (CallFrame *)frame_word.as_pointer;
-    vm->current_function = frame->function_name;
-    vm->current_function_ptr = (Function *)frame->function_ptr;
-    vm->current_ip = frame->return_ip;
-    if (vm->frame_pool_index > 0) {
-        vm->frame_pool_index--;
+    return p_tail_call_function(vm, fn);
+}
+
+static inline ProstStatus handle_tail_call_direct(ProstVM *vm, Instruction *inst) {
+    return p_tail_call_function(vm, (Function *)p_arg(inst).as_pointer);
+}
+
+// The external runs, then the current function returns. At the bottom of the
+// call stack execution just continues, as after a plain call.
+static inline ProstStatus handle_tail_call_extern(ProstVM *vm, Instruction *inst) {
+    ProstStatus status = handle_call_extern(vm, inst);
+    if (status != P_OK || !vm->running) return status;
+    if (vm->call_stack.size > 0) p_return_from_frame(vm);
+    return P_OK;
+}
+
+static inline ProstStatus handle_tail_call_extern_slot(ProstVM *vm, Instruction *inst) {
+    ProstStatus status = handle_call_extern_slot(vm, inst);
+    if (status != P_OK || !vm->running) return status;
+    if (vm->call_stack.size > 0) p_return_from_frame(vm);
+    return P_OK;
+}
+
+static inline ProstStatus handle_return(ProstVM *vm, Instruction *inst) {
+    if (vm->call_stack.size == 0) {
+        if (!vm->fiber) return P_ERR_CALL_STACK_UNDERFLOW;
+        // Returning from a fiber's function ends the fiber, as running off its end does
+        vm->current_ip = vm->current_function_ptr->instructions.count;
+        return P_OK;
     }
+    p_return_from_frame(vm);
     return P_OK;
 }
 
-static ProstStatus handle_jmp(ProstVM *vm, Instruction *inst) {
-    vm->current_ip = inst->arg.as_int;
+static inline ProstStatus handle_jmp(ProstVM *vm, Instruction *inst) {
+    vm->current_ip = p_arg(inst).as_int;
     return P_OK;
 }
 
-static ProstStatus handle_jmpif(ProstVM *vm, Instruction *inst) {
+static inline ProstStatus handle_jmpif(ProstVM *vm, Instruction *inst) {
     if (p_expect(vm, WINT).as_int == 1) {
-        vm->current_ip = inst->arg.as_int;
+        vm->current_ip = p_arg(inst).as_int;
     }
     return vm->status;
 }
 
-static ProstStatus handle_eq(ProstVM *vm, Instruction *inst) {
+static inline ProstStatus handle_eq(ProstVM *vm, Instruction *inst) {
     Word w1 = p_peek(vm);
     Word w2 = p_peek(vm);
     if (w1.type == WPOINTER && word_is_string(&w1) && w2.type == WPOINTER && word_is_string(&w2)) {
-        p_push(vm, WORD(strcmp(w1.as_pointer, w2.as_pointer) == 0 ? 1 : 0));
+        return p_push(vm, WORD(strcmp(w1.as_pointer, w2.as_pointer) == 0 ? 1 : 0));
     } else if (w1.type == WPOINTER && w1.type == w2.type) {
-        p_push(vm, WORD(w1.as_pointer == w2.as_pointer ? 1 : 0));
+        return p_push(vm, WORD(w1.as_pointer == w2.as_pointer ? 1 : 0));
     } else if (w1.type == w2.type && w1.type == WINT) {
-        p_push(vm, WORD(w1.as_int == w2.as_int ? 1 : 0));
+        return p_push(vm, WORD(w1.as_int == w2.as_int ? 1 : 0));
     } else if (w1.type == WFLOAT && w2.type == WFLOAT) {
-        p_push(vm, WORD(w1.as_float == w2.as_float ? 1 : 0));
-    } else {
-        p_push(vm, WORD(0));
+        return p_push(vm, WORD(w1.as_float == w2.as_float ? 1 : 0));
     }
-    return P_OK;
+    return p_push(vm, WORD(0));
 }
 
-static ProstStatus handle_neq(ProstVM *vm, Instruction *inst) {
+static inline ProstStatus handle_neq(ProstVM *vm, Instruction *inst) {
     Word w = p_peek(vm);
     if (w.type == WINT) {
-        p_push(vm, WORD(w.as_int != 0 ? 1 : 0));
+        return p_push(vm, WORD(w.as_int != 0 ? 1 : 0));
     }
     return P_OK;
 }
 
-static ProstStatus handle_lt(ProstVM *vm, Instruction *inst) {
-    Word w1 = p_pop(vm);
-    Word w2 = p_pop(vm);
+// Ordering shared by lt/lte/gt/gte and their fused forms. w1 is the value
+// that was on top of the stack.
+static inline bool p_word_compare(InstructionType op, Word w1, Word w2) {
     if (w1.type == WPOINTER && word_is_string(&w1) && w2.type == WPOINTER && word_is_string(&w2)) {
-        p_push(vm, WORD(strcmp(w1.as_pointer, w2.as_pointer) < 0 ? 1 : 0));
+        int c = strcmp(w1.as_pointer, w2.as_pointer);
+        switch (op) {
+            case Lt: return c < 0;
+            case Lte: return c <= 0;
+            case Gt: return c > 0;
+            default: return c >= 0;
+        }
     } else if (w1.type == WPOINTER && w1.type == w2.type) {
-        p_push(vm, WORD(w1.as_pointer < w2.as_pointer ? 1 : 0));
+        switch (op) {
+            case Lt: return w1.as_pointer < w2.as_pointer;
+            case Lte: return w1.as_pointer <= w2.as_pointer;
+            case Gt: return w1.as_pointer > w2.as_pointer;
+            default: return w1.as_pointer >= w2.as_pointer;
+        }
     } else if (w1.type == WINT && w2.type == WINT) {
-        p_push(vm, WORD(w1.as_int < w2.as_int ? 1 : 0));
+        switch (op) {
+            case Lt: return w1.as_int < w2.as_int;
+            case Lte: return w1.as_int <= w2.as_int;
+            case Gt: return w1.as_int > w2.as_int;
+            default: return w1.as_int >= w2.as_int;
+        }
     } else if (w1.type == WFLOAT && w2.type == WFLOAT) {
-        p_push(vm, WORD(w1.as_float < w2.as_float ? 1 : 0));
-    } else {
-        p_push(vm, WORD(0));
+        switch (op) {
+            case Lt: return w1.as_float < w2.as_float;
+            case Lte: return w1.as_float <= w2.as_float;
+            case Gt: return w1.as_float > w2.as_float;
+            default: return w1.as_float >= w2.as_float;
+        }
     }
-    return P_OK;
+    return false;
 }
 
-static ProstStatus handle_lte(ProstVM *vm, Instruction *inst) {
+static inline ProstStatus handle_lt(ProstVM *vm, Instruction *inst) {
     Word w1 = p_pop(vm);
     Word w2 = p_pop(vm);
-    if (w1.type == WPOINTER && word_is_string(&w1) && w2.type == WPOINTER && word_is_string(&w2)) {
-        p_push(vm, WORD(strcmp(w1.as_pointer, w2.as_pointer) <= 0 ? 1 : 0));
-    } else if (w1.type == WPOINTER && w1.type == w2.type) {
-        p_push(vm, WORD(w1.as_pointer <= w2.as_pointer ? 1 : 0));
-    } else if (w1.type == WINT && w2.type == WINT) {
-        p_push(vm, WORD(w1.as_int <= w2.as_int ? 1 : 0));
-    } else if (w1.type == WFLOAT && w2.type == WFLOAT) {
-        p_push(vm, WORD(w1.as_float <= w2.as_float ? 1 : 0));
-    } else {
-        p_push(vm, WORD(0));
-    }
-    return P_OK;
+    return p_push(vm, WORD(p_word_compare(Lt, w1, w2) ? 1 : 0));
 }
 
-static ProstStatus handle_gt(ProstVM *vm, Instruction *inst) {
+static inline ProstStatus handle_lte(ProstVM *vm, Instruction *inst) {
     Word w1 = p_pop(vm);
     Word w2 = p_pop(vm);
-    if (w1.type == WPOINTER && word_is_string(&w1) && w2.type == WPOINTER && word_is_string(&w2)) {
-        p_push(vm, WORD(strcmp(w1.as_pointer, w2.as_pointer) > 0 ? 1 : 0));
-    } else if (w1.type == WPOINTER && w1.type == w2.type) {
-        p_push(vm, WORD(w1.as_pointer > w2.as_pointer ? 1 : 0));
-    } else if (w1.type == WINT && w2.type == WINT) {
-        p_push(vm, WORD(w1.as_int > w2.as_int ? 1 : 0));
-    } else if (w1.type == WFLOAT && w2.type == WFLOAT) {
-        p_push(vm, WORD(w1.as_float > w2.as_float ? 1 : 0));
-    } else {
-        p_push(vm, WORD(0));
-    }
-    return P_OK;
+    return p_push(vm, WORD(p_word_compare(Lte, w1, w2) ? 1 : 0));
 }
 
-static ProstStatus handle_gte(ProstVM *vm, Instruction *inst) {
+static inline ProstStatus handle_gt(ProstVM *vm, Instruction *inst) {
     Word w1 = p_pop(vm);
     Word w2 = p_pop(vm);
-    if (w1.type == WPOINTER && word_is_string(&w1) && w2.type == WPOINTER && word_is_string(&w2)) {
-        p_push(vm, WORD(strcmp(w1.as_pointer, w2.as_pointer) >= 0 ? 1 : 0));
-    } else if (w1.type == WPOINTER && w1.type == w2.type) {
-        p_push(vm, WORD(w1.as_pointer >= w2.as_pointer ? 1 : 0));
-    } else if (w1.type == WINT && w2.type == WINT) {
-        p_push(vm, WORD(w1.as_int >= w2.as_int ? 1 : 0));
-    } else if (w1.type == WFLOAT && w2.type == WFLOAT) {
-        p_push(vm, WORD(w1.as_float >= w2.as_float ? 1 : 0));
-    } else {
-        p_push(vm, WORD(0));
-    }
-    return P_OK;
-}
-
-static ProstStatus handle_dup(ProstVM *vm, Instruction *inst) {
-    Word w = p_peek(vm);
-    p_push(vm, w);
-    return P_OK;
+    return p_push(vm, WORD(p_word_compare(Gt, w1, w2) ? 1 : 0));
 }
 
-static ProstStatus handle_swap(ProstVM *vm, Instruction *inst) {
+static inline ProstStatus handle_gte(ProstVM *vm, Instruction *inst) {
     Word w1 = p_pop(vm);
     Word w2 = p_pop(vm);
-    p_push(vm, w1);
-    p_push(vm, w2);
-    return P_OK;
+    return p_push(vm, WORD(p_word_compare(Gte, w1, w2) ? 1 : 0));
 }
 
-static ProstStatus handle_over(ProstVM *vm, Instruction *inst) {
-    Word *w = xvec_get(&vm->stack, vm->stack.size - 2);
-    p_push(vm, *w);
-    return P_OK;
+static inline ProstStatus handle_dup(ProstVM *vm, Instruction *inst) {
+    if (vm->stack.size == 0) {
+        return p_push(vm, p_peek(vm));
+    }
+    return p_push_slot(vm, vm->stack.data[vm->stack.size - 1]);
 }
 
-ProstVM *p_init() {
-    ProstVM *vm = (ProstVM *)malloc(sizeof(ProstVM));
-    if (!vm) return NULL;
-
-    xvec_init(&vm->stack, 0);
-    xvec_init(&vm->call_stack, 0);
-    xmap_init(&vm->functions, 0);
-    xmap_init(&vm->external_functions, 0);
-
-    vm->status = P_OK;
-    vm->running = false;
-    vm->exit_code = 0;
-    vm->current_function = NULL;
-    vm->current_function_ptr = NULL;
-    vm->current_ip = 0;
+static inline ProstStatus handle_swap(ProstVM *vm, Instruction *inst) {
+    if (vm->stack.size < 2) {
+        Word w1 = p_pop(vm);
+        Word w2 = p_pop(vm);
+        p_push(vm, w1);
+        return p_push(vm, w2);
+    }
+    WordSlot *top = &vm->stack.data[vm->stack.size - 1];
+    WordSlot tmp = top[0];
+    top[0] = top[-1];
+    top[-1] = tmp;
+    return P_OK;
+}
 
-    vm->frame_pool = (CallFrame *)malloc(sizeof(CallFrame) * CALL_FRAME_POOL_SIZE);
-    vm->frame_pool_index = 0;
-
-    vm->jump_table[Push] = handle_push;
-    vm->jump_table[PushRegister] = handle_push_register;
-    vm->jump_table[Pop] = handle_pop;
-    vm->jump_table[Drop] = handle_drop;
-    vm->jump_table[Halt] = handle_halt;
-    vm->jump_table[Call] = handle_call;
-    vm->jump_table[CallExtern] = handle_call_extern;
-    vm->jump_table[Return] = handle_return;
-    vm->jump_table[Jmp] = handle_jmp;
-    vm->jump_table[JmpIf] = handle_jmpif;
-    vm->jump_table[Eq] = handle_eq;
-    vm->jump_table[Neq] = handle_neq;
-    vm->jump_table[Lt] = handle_lt;
-    vm->jump_table[Lte] = handle_lte;
-    vm->jump_table[Gt] = handle_gt;
-    vm->jump_table[Gte] = handle_gte;
-    vm->jump_table[Dup] = handle_dup;
-    vm->jump_table[Swap] = handle_swap;
-    vm->jump_table[Over] = handle_over;
-    vm->jump_table[Write8] = handle_write8;
-    vm->jump_table[Read8] = handle_read8;
+static inline ProstStatus handle_over(ProstVM *vm, Instruction *inst) {
+    if (vm->stack.size < 2) {
+        vm->status = P_ERR_STACK_UNDERFLOW;
+        return vm->status;
+    }
+    return p_push_slot(vm, vm->stack.data[vm->stack.size - 2]);
+}
 
-    return vm;
+// Arithmetic and logic. Like the comparisons, binary ops take the top of the
+// stack as their left operand: `push 1; push 10; sub` leaves 9.
+// Mixing an int with a float promotes to float.
+static inline double p_word_as_float(Word w) {
+    return w.type == WFLOAT ? w.as_float : (double)w.as_int;
 }
 
-void p_free(ProstVM *vm) {
-    if (!vm) return;
+static inline Word p_word_add(Word a, Word b) {
+    if (a.type == WFLOAT || b.type == WFLOAT) {
+        return WORD(p_word_as_float(a) + p_word_as_float(b));
+    }
+    return WORD((int64_t)((uint64_t)a.as_int + (uint64_t)b.as_int));
+}
 
-    xvec_free(&vm->stack);
-    xvec_free(&vm->call_stack);
+static inline ProstStatus handle_add(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop(vm);
+    Word b = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    return p_push(vm, p_word_add(a, b));
+}
 
-    for (size_t i = 0; i < vm->functions.size; i++) {
-        XEntry iter = vm->functions.entries[i];
-        Function *fn = (Function *)iter.value.as_pointer;
-        if (fn) {
-            if (fn->instructions.data) {
-                free(fn->instructions.data);
-            }
-            free(fn);
-        }
+static inline Word p_word_sub(Word a, Word b) {
+    if (a.type == WFLOAT || b.type == WFLOAT) {
+        return WORD(p_word_as_float(a) - p_word_as_float(b));
     }
+    return WORD((int64_t)((uint64_t)a.as_int - (uint64_t)b.as_int));
+}
 
-    xmap_free(&vm->functions);
-    xmap_free(&vm->external_functions);
-
-    for (int i = 0; i < P_REGISTERS_COUNT; i++) {
-        vm->registers[i] = WORD(0);
+static inline Word p_word_mul(Word a, Word b) {
+    if (a.type == WFLOAT || b.type == WFLOAT) {
+        return WORD(p_word_as_float(a) * p_word_as_float(b));
     }
+    return WORD((int64_t)((uint64_t)a.as_int * (uint64_t)b.as_int));
+}
 
-    free(vm->frame_pool);
-    free(vm);
+static inline ProstStatus handle_sub(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop(vm);
+    Word b = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    return p_push(vm, p_word_sub(a, b));
 }
 
-ProstStatus p_load_library(ProstVM *vm, const char *path) {
-    if (!vm || !path) {
-        vm->status = P_ERR_INVALID_INDEX;
+static inline ProstStatus handle_mul(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop(vm);
+    Word b = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    return p_push(vm, p_word_mul(a, b));
+}
+
+static inline ProstStatus handle_div(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop(vm);
+    Word b = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    if (a.type == WFLOAT || b.type == WFLOAT) {
+        return p_push(vm, WORD(p_word_as_float(a) / p_word_as_float(b)));
+    }
+    if (b.as_int == 0) {
+        fprintf(stderr, "ERROR: Division by zero\n");
+        vm->status = P_ERR_GENERAL_VM_ERROR;
         return vm->status;
     }
+    if (b.as_int == -1) {
+        return p_push(vm, WORD((int64_t)(0 - (uint64_t)a.as_int)));
+    }
+    return p_push(vm, WORD(a.as_int / b.as_int));
+}
 
-#ifdef _WIN32
-    HMODULE handle = LoadLibraryA(path);
-    if (!handle) {
-        vm->status = P_ERR_LIBRARY_NOT_FOUND;
-        return vm->status;
+static inline ProstStatus handle_mod(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop(vm);
+    Word b = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    if (a.type == WFLOAT || b.type == WFLOAT) {
+        double y = p_word_as_float(b);
+        if (y == 0.0) {
+            fprintf(stderr, "ERROR: Division by zero\n");
+            vm->status = P_ERR_GENERAL_VM_ERROR;
+            return vm->status;
+        }
+        return p_push(vm, WORD(fmod(p_word_as_float(a), y)));
     }
-#else
-    void *handle = dlopen(path, RTLD_LAZY | RTLD_LOCAL);
-    if (!handle) {
-        vm->status = P_ERR_LIBRARY_NOT_FOUND;
+    if (b.as_int == 0) {
+        fprintf(stderr, "ERROR: Division by zero\n");
+        vm->status = P_ERR_GENERAL_VM_ERROR;
         return vm->status;
     }
-#endif
-
-    typedef ProstStatus (*p_lib_init_fn)(ProstVM*);
-    p_lib_init_fn init_fn;
+    return p_push(vm, WORD(b.as_int == -1 ? (int64_t)0 : a.as_int % b.as_int));
+}
 
-#ifdef _WIN32
-    init_fn = (p_lib_init_fn)GetProcAddress(handle, "p_register_library");
-#else
-    init_fn = (p_lib_init_fn)dlsym(handle, "p_register_library");
-#endif
+static inline ProstStatus handle_and(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop(vm);
+    Word b = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    return p_push(vm, WORD(a.as_int & b.as_int));
+}
 
-    if (!init_fn) {
-#ifdef _WIN32
-        FreeLibrary(handle);
-#else
-        dlclose(handle);
-#endif
-        vm->status = P_ERR_LIBRARY_NOT_FOUND;
-        return vm->status;
-    }
+static inline ProstStatus handle_or(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop(vm);
+    Word b = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    return p_push(vm, WORD(a.as_int | b.as_int));
+}
 
-    ProstStatus status = init_fn(vm);
+static inline ProstStatus handle_xor(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop(vm);
+    Word b = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    return p_push(vm, WORD(a.as_int ^ b.as_int));
+}
 
-#ifdef _WIN32
-    FreeLibrary(handle);
-#else
-    dlclose(handle);
-#endif
+static inline ProstStatus handle_shl(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop(vm);
+    Word b = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    return p_push(vm, WORD((int64_t)((uint64_t)a.as_int << (b.as_int & 63))));
+}
 
-    vm->status = status;
-    return vm->status;
+static inline ProstStatus handle_shr(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop(vm);
+    Word b = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    return p_push(vm, WORD(a.as_int >> (b.as_int & 63)));
 }
 
-ProstStatus p_register_external(ProstVM *vm, const char *name, p_external_function fn) {
-    if (!vm || !name || !fn) {
-        vm->status = P_ERR_INVALID_INDEX;
-        return vm->status;
+static inline ProstStatus handle_not(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    if (a.type == WFLOAT) {
+        return p_push(vm, WORD(a.as_float == 0.0 ? 1 : 0));
     }
-
-    xmap_set(&vm->external_functions, name, WORD(fn));
-    vm->status = P_OK;
-    return vm->status;
+    return p_push(vm, WORD(a.as_int == 0 ? 1 : 0));
 }
 
-ByteBuf p_to_bytecode(ProstVM *vm) {
-    ByteBuf bb;
-    bb_init(&bb, 1024);
+static inline ProstStatus handle_add_imm(ProstVM *vm, Instruction *inst) {
+    Word b = p_pop(vm);
+    if (vm->status != P_OK) return vm->status;
+    return p_push(vm, p_word_add(p_arg(inst), b));
+}
 
-    uint16_t fn_count = (uint16_t)vm->functions.size;
-    bb_append(&bb, &fn_count, sizeof(uint16_t));
+static inline ProstStatus handle_cmp_imm(ProstVM *vm, Instruction *inst, InstructionType op) {
+    Word w2 = p_pop(vm);
+    return p_push(vm, WORD(p_word_compare(op, p_arg(inst), w2) ? 1 : 0));
+}
 
-    for (size_t i = 0; i < vm->functions.size; i++) {
-        XEntry entry = vm->functions.entries[i];
-        const char *fn_name = entry.key;
-        Function *fn = (Function *)entry.value.as_pointer;
+static inline ProstStatus handle_lt_imm(ProstVM *vm, Instruction *inst) { return handle_cmp_imm(vm, inst, Lt); }
+static inline ProstStatus handle_lte_imm(ProstVM *vm, Instruction *inst) { return handle_cmp_imm(vm, inst, Lte); }
+static inline ProstStatus handle_gt_imm(ProstVM *vm, Instruction *inst) { return handle_cmp_imm(vm, inst, Gt); }
+static inline ProstStatus handle_gte_imm(ProstVM *vm, Instruction *inst) { return handle_cmp_imm(vm, inst, Gte); }
 
-        if (!fn) continue;
+static inline ProstStatus handle_br_cmp_imm(ProstVM *vm, Instruction *inst, InstructionType op) {
+    Word w2 = p_peek(vm);
+    if (vm->status != P_OK) return vm->status;
+    if (p_word_compare(op, p_arg(inst), w2)) {
+        vm->current_ip = inst->aux;
+    }
+    return P_OK;
+}
 
-        uint16_t name_len = (uint16_t)strlen(fn_name);
-        bb_append(&bb, &name_len, sizeof(uint16_t));
-        bb_append(&bb, fn_name, name_len);
+static inline ProstStatus handle_br_lt_imm(ProstVM *vm, Instruction *inst) { return handle_br_cmp_imm(vm, inst, Lt); }
+static inline ProstStatus handle_br_lte_imm(ProstVM *vm, Instruction *inst) { return handle_br_cmp_imm(vm, inst, Lte); }
+static inline ProstStatus handle_br_gt_imm(ProstVM *vm, Instruction *inst) { return handle_br_cmp_imm(vm, inst, Gt); }
+static inline ProstStatus handle_br_gte_imm(ProstVM *vm, Instruction *inst) { return handle_br_cmp_imm(vm, inst, Gte); }
 
-        uint16_t inst_count = (uint16_t)fn->instructions.count;
-        bb_append(&bb, &inst_count, sizeof(uint16_t));
+static inline ProstStatus handle_reg_add_imm(ProstVM *vm, Instruction *inst) {
+    Word w = p_word_add(p_arg(inst), word_unpack(vm->registers[inst->aux]));
+    if (!word_fits(w)) return p_int_overflow(vm);
+    vm->registers[inst->aux] = word_pack(w);
+    return P_OK;
+}
 
-        for (size_t j = 0; j < inst_count; j++) {
-            Instruction *inst = &fn->instructions.data[j];
+// Unchecked variants, used by p_run_threaded while vm->fast_path is set.
+// p_verify proved the stack holds enough values and p_can_run_fast that there
+// is room for what the function pushes, so they skip both checks.
+static WORD_ALWAYS_INLINE Word p_pop_unchecked(ProstVM *vm) {
+    return word_unpack(vm->stack.data[--vm->stack.size]);
+}
 
-            uint8_t inst_type = (uint8_t)inst->type;
-            bb_append(&bb, &inst_type, sizeof(uint8_t));
+static WORD_ALWAYS_INLINE ProstStatus p_push_slot_unchecked(ProstVM *vm, WordSlot w) {
+    vm->stack.data[vm->stack.size++] = w;
+    return P_OK;
+}
 
-            if (inst->type == Call || inst->type == CallExtern) {
-                const char *str = (const char *)inst->arg.as_pointer;
-                uint16_t str_len = str ? (uint16_t)strlen(str) : 0;
-                bb_append(&bb, &str_len, sizeof(uint16_t));
-                if (str_len > 0) {
-                    bb_append(&bb, str, str_len);
-                }
-            } else {
-                bb_append(&bb, &inst->arg, sizeof(Word));
-            }
-        }
-    }
+static WORD_ALWAYS_INLINE ProstStatus p_push_unchecked(ProstVM *vm, Word w) {
+    if (!word_fits(w)) return p_int_overflow(vm);
+    return p_push_slot_unchecked(vm, word_pack(w));
+}
 
-    return bb;
+static inline ProstStatus handle_push_fast(ProstVM *vm, Instruction *inst) {
+    return p_push_slot_unchecked(vm, inst->arg);
 }
 
-ProstStatus p_from_bytecode(ProstVM *vm, const char *bytecode) {
-    if (!vm || !bytecode) {
-        vm->status = P_ERR_INVALID_BYTECODE;
-        return vm->status;
-    }
+static inline ProstStatus handle_push_register_fast(ProstVM *vm, Instruction *inst) {
+    return p_push_slot_unchecked(vm, vm->registers[p_arg(inst).as_int]);
+}
 
-    const uint8_t *ptr = (const uint8_t *)bytecode;
+static inline ProstStatus handle_pop_fast(ProstVM *vm, Instruction *inst) {
+    vm->registers[p_arg(inst).as_int] = vm->stack.data[--vm->stack.size];
+    return P_OK;
+}
+
+static inline ProstStatus handle_drop_fast(ProstVM *vm, Instruction *inst) {
+    vm->stack.size--;
+    return P_OK;
+}
+
+static inline ProstStatus handle_dup_fast(ProstVM *vm, Instruction *inst) {
+    return p_push_slot_unchecked(vm, vm->stack.data[vm->stack.size - 1]);
+}
+
+static inline ProstStatus handle_swap_fast(ProstVM *vm, Instruction *inst) {
+    WordSlot *top = &vm->stack.data[vm->stack.size - 1];
+    WordSlot tmp = top[0];
+    top[0] = top[-1];
+    top[-1] = tmp;
+    return P_OK;
+}
+
+static inline ProstStatus handle_over_fast(ProstVM *vm, Instruction *inst) {
+    return p_push_slot_unchecked(vm, vm->stack.data[vm->stack.size - 2]);
+}
+
+static inline ProstStatus handle_cmp_fast(ProstVM *vm, InstructionType op) {
+    Word w1 = p_pop_unchecked(vm);
+    Word w2 = p_pop_unchecked(vm);
+    return p_push_unchecked(vm, WORD(p_word_compare(op, w1, w2) ? 1 : 0));
+}
+
+static inline ProstStatus handle_lt_fast(ProstVM *vm, Instruction *inst) { return handle_cmp_fast(vm, Lt); }
+static inline ProstStatus handle_lte_fast(ProstVM *vm, Instruction *inst) { return handle_cmp_fast(vm, Lte); }
+static inline ProstStatus handle_gt_fast(ProstVM *vm, Instruction *inst) { return handle_cmp_fast(vm, Gt); }
+static inline ProstStatus handle_gte_fast(ProstVM *vm, Instruction *inst) { return handle_cmp_fast(vm, Gte); }
+
+static inline ProstStatus handle_add_fast(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop_unchecked(vm);
+    Word b = p_pop_unchecked(vm);
+    return p_push_unchecked(vm, p_word_add(a, b));
+}
+
+static inline ProstStatus handle_sub_fast(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop_unchecked(vm);
+    Word b = p_pop_unchecked(vm);
+    return p_push_unchecked(vm, p_word_sub(a, b));
+}
+
+static inline ProstStatus handle_mul_fast(ProstVM *vm, Instruction *inst) {
+    Word a = p_pop_unchecked(vm);
+    Word b = p_pop_unchecked(vm);
+    return p_push_unchecked(vm, p_word_mul(a, b));
+}
+
+static inline ProstStatus handle_add_imm_fast(ProstVM *vm, Instruction *inst) {
+    Word b = p_pop_unchecked(vm);
+    return p_push_unchecked(vm, p_word_add(p_arg(inst), b));
+}
+
+static inline ProstStatus handle_cmp_imm_fast(ProstVM *vm, Instruction *inst, InstructionType op) {
+    Word w2 = p_pop_unchecked(vm);
+    return p_push_unchecked(vm, WORD(p_word_compare(op, p_arg(inst), w2) ? 1 : 0));
+}
+
+static inline ProstStatus handle_lt_imm_fast(ProstVM *vm, Instruction *inst) { return handle_cmp_imm_fast(vm, inst, Lt); }
+static inline ProstStatus handle_lte_imm_fast(ProstVM *vm, Instruction *inst) { return handle_cmp_imm_fast(vm, inst, Lte); }
+static inline ProstStatus handle_gt_imm_fast(ProstVM *vm, Instruction *inst) { return handle_cmp_imm_fast(vm, inst, Gt); }
+static inline ProstStatus handle_gte_imm_fast(ProstVM *vm, Instruction *inst) { return handle_cmp_imm_fast(vm, inst, Gte); }
+
+static inline ProstStatus handle_br_cmp_imm_fast(ProstVM *vm, Instruction *inst, InstructionType op) {
+    if (p_word_compare(op, p_arg(inst), word_unpack(vm->stack.data[vm->stack.size - 1]))) {
+        vm->current_ip = inst->aux;
+    }
+    return P_OK;
+}
+
+static inline ProstStatus handle_br_lt_imm_fast(ProstVM *vm, Instruction *inst) { return handle_br_cmp_imm_fast(vm, inst, Lt); }
+static inline ProstStatus handle_br_lte_imm_fast(ProstVM *vm, Instruction *inst) { return handle_br_cmp_imm_fast(vm, inst, Lte); }
+static inline ProstStatus handle_br_gt_imm_fast(ProstVM *vm, Instruction *inst) { return handle_br_cmp_imm_fast(vm, inst, Gt); }
+static inline ProstStatus handle_br_gte_imm_fast(ProstVM *vm, Instruction *inst) { return handle_br_cmp_imm_fast(vm, inst, Gte); }
+
+#ifdef PROST_JIT
+    #include "jit.h"
+#endif
+#include "profile.h"
+#include "fiber.h"
+
+static const InstructionHandler p_default_jump_table[INSTRUCTION_COUNT] = {
+    [Push] = handle_push,
+    [PushRegister] = handle_push_register,
+    [Pop] = handle_pop,
+    [Drop] = handle_drop,
+    [Halt] = handle_halt,
+    [Call] = handle_call,
+    [CallExtern] = handle_call_extern,
+    [Return] = handle_return,
+    [Jmp] = handle_jmp,
+    [JmpIf] = handle_jmpif,
+    [Eq] = handle_eq,
+    [Neq] = handle_neq,
+    [Lt] = handle_lt,
+    [Lte] = handle_lte,
+    [Gt] = handle_gt,
+    [Gte] = handle_gte,
+    [Dup] = handle_dup,
+    [Swap] = handle_swap,
+    [Over] = handle_over,
+    [Write8] = handle_write8,
+    [Read8] = handle_read8,
+    [Add] = handle_add,
+    [Sub] = handle_sub,
+    [Mul] = handle_mul,
+    [Div] = handle_div,
+    [Mod] = handle_mod,
+    [And] = handle_and,
+    [Or] = handle_or,
+    [Xor] = handle_xor,
+    [Shl] = handle_shl,
+    [Shr] = handle_shr,
+    [Not] = handle_not,
+    [AddImm] = handle_add_imm,
+    [LtImm] = handle_lt_imm,
+    [LteImm] = handle_lte_imm,
+    [GtImm] = handle_gt_imm,
+    [GteImm] = handle_gte_imm,
+    [BrLtImm] = handle_br_lt_imm,
+    [BrLteImm] = handle_br_lte_imm,
+    [BrGtImm] = handle_br_gt_imm,
+    [BrGteImm] = handle_br_gte_imm,
+    [RegAddImm] = handle_reg_add_imm,
+    [TailCall] = handle_tail_call,
+    [TailCallExtern] = handle_tail_call_extern,
+    [CallDirect] = handle_call_direct,
+    [CallExternSlot] = handle_call_extern_slot,
+    [TailCallDirect] = handle_tail_call_direct,
+    [TailCallExternSlot] = handle_tail_call_extern_slot,
+    [Spawn] = handle_spawn,
+    [Yield] = handle_yield,
+    [Join] = handle_join,
+    [SpawnDirect] = handle_spawn_direct,
+};
+
+ProstVM *p_init() {
+    ProstVM *vm = (ProstVM *)malloc(sizeof(ProstVM));
+    if (!vm) return NULL;
+
+    vm->stack.size = 0;
+    if (!p_stack_alloc(&vm->stack, P_STACK_DEFAULT_CAPACITY)) {
+        free(vm);
+        return NULL;
+    }
+    for (int i = 0; i < P_REGISTERS_COUNT; i++) {
+        vm->registers[i] = word_pack(WORD(0));
+    }
+    vm->call_stack.data = (CallFrame *)malloc(sizeof(CallFrame) * P_CALL_STACK_INITIAL);
+    vm->call_stack.size = 0;
+    vm->call_stack.capacity = P_CALL_STACK_INITIAL;
+    vm->max_call_depth = P_MAX_CALL_DEPTH;
+    xmap_init(&vm->functions, 0);
+    xvec_init(&vm->function_list, 0);
+    xvec_init(&vm->arenas, 0);
+    xmap_init(&vm->external_functions, 0);
+    vm->externals = NULL;
+    vm->external_names = NULL;
+    vm->external_effects = NULL;
+    vm->external_count = 0;
+    vm->external_capacity = 0;
+
+    vm->status = P_OK;
+    vm->running = false;
+    vm->exit_code = 0;
+    vm->current_function = NULL;
+    vm->current_function_ptr = NULL;
+    vm->current_ip = 0;
+    vm->fast_path = false;
+
+    vm->optimize = true;
+    vm->verify_report = NULL;
+    memset(vm->fusion_counts, 0, sizeof(vm->fusion_counts));
+    vm->profile = NULL;
+    vm->sampler = NULL;
+    vm->context = NULL;
+    xvec_init(&vm->owned, 0);
+    vm->fiber_workers = 0;
+    vm->fibers = NULL;
+    vm->fiber = NULL;
+#ifdef PROST_JIT
+    vm->jit = true;
+    vm->jit_threshold = P_JIT_THRESHOLD;
+    vm->jit_compiled = 0;
+#endif
+
+    memcpy(vm->jump_table, p_default_jump_table, sizeof(vm->jump_table));
+
+    return vm;
+}
+
+// Frees ptr (from malloc) when vm is freed. For memory that externals give
+// the program, which values on the stack or in registers may still point to.
+void p_own(ProstVM *vm, void *ptr) {
+    xvec_push(&vm->owned, word_pointer(ptr, true));
+}
+
+// Replaces the operand stack with one holding `capacity` values, keeping its
+// contents.
+ProstStatus p_set_stack_capacity(ProstVM *vm, size_t capacity) {
+    if (capacity == 0 || capacity < vm->stack.size) {
+        vm->status = P_ERR_INVALID_INDEX;
+        return vm->status;
+    }
+
+    PStack stack = {.size = vm->stack.size};
+    if (!p_stack_alloc(&stack, capacity)) {
+        vm->status = P_ERR_INVALID_VM_STATE;
+        return vm->status;
+    }
+    memcpy(stack.data, vm->stack.data, vm->stack.size * sizeof(WordSlot));
+    p_stack_release(&vm->stack);
+    vm->stack = stack;
+
+    vm->status = P_OK;
+    return vm->status;
+}
+
+static void p_function_free(Function *fn) {
+    if (!fn) return;
+#ifdef PROST_JIT
+    p_jit_free(fn);
+#endif
+    if (fn->in_arena) return; // freed with vm->arenas
+    for (size_t i = 0; i < fn->instructions.count; i++) {
+        Instruction *inst = &fn->instructions.data[i];
+        if (p_is_named_call(inst->type)) {
+            free(p_arg(inst).as_pointer);
+        }
+    }
+    free(fn->instructions.data);
+    free(fn->name);
+    free(fn);
+}
+
+void p_free(ProstVM *vm) {
+    if (!vm) return;
+
+    p_fiber_pool_free(vm->fibers);
+
+    for (size_t i = 0; i < vm->stack.size; i++) {
+        Word w = word_unpack(vm->stack.data[i]);
+        if (w.type == WPOINTER && word_owns_memory(&w) && w.as_pointer != NULL) {
+            free(w.as_pointer);
+        }
+    }
+    p_stack_release(&vm->stack);
+    free(vm->call_stack.data);
+
+    for (size_t i = 0; i < xvec_len(&vm->function_list); i++) {
+        p_function_free((Function *)xvec_get(&vm->function_list, i)->as_pointer);
+    }
+
+    xmap_free(&vm->functions);
+    xvec_free(&vm->function_list);
+    xvec_free(&vm->arenas);
+    xvec_free(&vm->owned);
+    xmap_free(&vm->external_functions);
+    for (size_t i = 0; i < vm->external_count; i++) {
+        free(vm->external_names[i]);
+    }
+    free(vm->externals);
+    free(vm->external_names);
+    free(vm->external_effects);
+    p_profile_free(vm->profile);
+#ifndef _WIN32
+    p_sampler_free(vm->sampler);
+#endif
+
+    for (int i = 0; i < P_REGISTERS_COUNT; i++) {
+        vm->registers[i] = word_pack(WORD(0));
+    }
+
+    free(vm);
+}
+
+ProstStatus p_load_library(ProstVM *vm, const char *path) {
+    if (!vm || !path) {
+        vm->status = P_ERR_INVALID_INDEX;
+        return vm->status;
+    }
+
+#ifdef _WIN32
+    HMODULE handle = LoadLibraryA(path);
+    if (!handle) {
+        vm->status = P_ERR_LIBRARY_NOT_FOUND;
+        return vm->status;
+    }
+#else
+    void *handle = dlopen(path, RTLD_LAZY | RTLD_LOCAL);
+    if (!handle) {
+        vm->status = P_ERR_LIBRARY_NOT_FOUND;
+        return vm->status;
+    }
+#endif
+
+    typedef ProstStatus (*p_lib_init_fn)(ProstVM*);
+    p_lib_init_fn init_fn;
+
+#ifdef _WIN32
+    init_fn = (p_lib_init_fn)GetProcAddress(handle, "p_register_library");
+#else
+    init_fn = (p_lib_init_fn)dlsym(handle, "p_register_library");
+#endif
+
+    if (!init_fn) {
+#ifdef _WIN32
+        FreeLibrary(handle);
+#else
+        dlclose(handle);
+#endif
+        vm->status = P_ERR_LIBRARY_NOT_FOUND;
+        return vm->status;
+    }
+
+    ProstStatus status = init_fn(vm);
+
+#ifdef _WIN32
+    FreeLibrary(handle);
+#else
+    dlclose(handle);
+#endif
+
+    vm->status = status;
+    return vm->status;
+}
+
+ProstStatus p_register_external(ProstVM *vm, const char *name, p_external_function fn) {
+    return p_register_external_ex(vm, name, fn, -1, 0);
+}
+
+// Like p_register_external, but also declares the function's stack effect so
+// p_verify can reason about code that calls it. The VM trusts the declaration:
+// an external that pops more than it declares breaks verified code.
+ProstStatus p_register_external_ex(ProstVM *vm, const char *name, p_external_function fn, int pops, int pushes) {
+    if (!vm || !name || !fn) {
+        vm->status = P_ERR_INVALID_INDEX;
+        return vm->status;
+    }
+
+    // Re-registering a name replaces the function in its existing slot, so
+    // instructions already bound to that slot pick up the new one.
+    Word *slot = xmap_get(&vm->external_functions, name);
+    PStackEffect effect = {.pops = (int8_t)pops, .pushes = (int8_t)pushes};
+    if (slot) {
+        vm->externals[slot->as_int] = fn;
+        vm->external_effects[slot->as_int] = effect;
+        vm->status = P_OK;
+        return vm->status;
+    }
+
+    if (vm->external_count >= vm->external_capacity) {
+        vm->external_capacity = vm->external_capacity == 0 ? 16 : vm->external_capacity * 2;
+        vm->externals = realloc(vm->externals, vm->external_capacity * sizeof(p_external_function));
+        vm->external_names = realloc(vm->external_names, vm->external_capacity * sizeof(char *));
+        vm->external_effects = realloc(vm->external_effects, vm->external_capacity * sizeof(PStackEffect));
+    }
+    vm->externals[vm->external_count] = fn;
+    vm->external_effects[vm->external_count] = effect;
+    vm->external_names[vm->external_count] = strdup(name);
+    xmap_set(&vm->external_functions, name, WORD((int64_t)vm->external_count));
+    vm->external_count++;
+
+    vm->status = P_OK;
+    return vm->status;
+}
+
+int64_t p_external_slot(ProstVM *vm, const char *name) {
+    Word *slot = xmap_get(&vm->external_functions, name);
+    return slot ? slot->as_int : -1;
+}
+
+// p_add_function for a fn whose name and in_arena are already set
+static Function *p_insert_function(ProstVM *vm, Function *fn) {
+    const char *name = fn->name;
+    memset(&fn->info, 0, sizeof(fn->info));
+#ifdef PROST_JIT
+    fn->jit_code = NULL;
+    fn->jit_size = 0;
+    fn->jit_entries = NULL;
+    fn->jit_counter = 0;
+    fn->jit_failed = false;
+#endif
+
+    Word *existing = xmap_get(&vm->functions, name);
+    if (existing && existing->as_pointer) {
+        Function *old = (Function *)existing->as_pointer;
+        for (size_t i = 0; i < xvec_len(&vm->function_list); i++) {
+            if (xvec_get(&vm->function_list, i)->as_pointer == old) {
+                xvec_set(&vm->function_list, i, WORD((void *)fn));
+                fn->index = i;
+                break;
+            }
+        }
+        existing->as_pointer = fn;
+        p_function_free(old);
+        return fn;
+    }
+
+    xmap_set(&vm->functions, name, WORD((void *)fn));
+    fn->index = xvec_len(&vm->function_list);
+    xvec_push(&vm->function_list, WORD((void *)fn));
+    return fn;
+}
+
+// Registers fn under name (the VM takes ownership). A function that already
+// has this name is replaced and freed.
+Function *p_add_function(ProstVM *vm, const char *name, Function *fn) {
+    fn->name = strdup(name);
+    fn->in_arena = false;
+    return p_insert_function(vm, fn);
+}
+
+Function *p_find_function(ProstVM *vm, const char *name) {
+    Word *fn_word = xmap_get(&vm->functions, name);
+    if (!fn_word) return NULL;
+    return (Function *)fn_word->as_pointer;
+}
+
+// Rewrites every `call <name>` (and `spawn <name>`) into a CallDirect
+// (SpawnDirect) holding the callee and every `call @name` into a
+// CallExternSlot holding the external's slot, so calls no longer hash the
+// name at runtime. Every unresolved name is reported here
+// instead of when (and if) the call executes.
+ProstStatus p_link(ProstVM *vm) {
+    ProstStatus status = P_OK;
+
+    for (size_t i = 0; i < xvec_len(&vm->function_list); i++) {
+        Function *fn = (Function *)xvec_get(&vm->function_list, i)->as_pointer;
+
+        for (size_t j = 0; j < fn->instructions.count; j++) {
+            Instruction *inst = &fn->instructions.data[j];
+
+            if (inst->type == CallExtern || inst->type == TailCallExtern) {
+                const char *name = (const char *)p_arg(inst).as_pointer;
+                int64_t slot = name ? p_external_slot(vm, name) : -1;
+                if (slot < 0) {
+                    fprintf(stderr, "ERROR: Missing external '@%s' called in function '%s' at %zu\n",
+                            name ? name : "", fn->name, j);
+                    status = P_ERR_FUNCTION_NOT_FOUND;
+                    continue;
+                }
+
+                if (!fn->in_arena) free(p_arg(inst).as_pointer);
+                inst->type = inst->type == TailCallExtern ? TailCallExternSlot : CallExternSlot;
+                p_set_arg(inst, WORD(slot));
+                continue;
+            }
+
+            if (inst->type != Call && inst->type != TailCall && inst->type != Spawn) continue;
+
+            const char *name = (const char *)p_arg(inst).as_pointer;
+            Function *callee = name ? p_find_function(vm, name) : NULL;
+            if (!callee) {
+                fprintf(stderr, "ERROR: Unresolved %s to '%s' in function '%s' at %zu\n",
+                        inst->type == Spawn ? "spawn" : "call", name ? name : "", fn->name, j);
+                status = P_ERR_FUNCTION_NOT_FOUND;
+                continue;
+            }
+
+            if (!fn->in_arena) free(p_arg(inst).as_pointer);
+            inst->type = inst->type == TailCall ? TailCallDirect : inst->type == Spawn ? SpawnDirect : CallDirect;
+            p_set_arg(inst, WORD((void *)callee));
+        }
+    }
+
+    vm->status = status;
+    return vm->status;
+}
+
+// Superinstruction fusion.
+// Runs after p_link on the resolved code. A sequence is only fused when none
+// of its instructions but the first is a jump target, and all jump targets
+// are remapped afterwards. vm->fusion_counts records what fired.
+static inline bool p_is_jump(InstructionType t) {
+    return t == Jmp || t == JmpIf;
+}
+
+static inline bool p_is_branch(InstructionType t) {
+    return t >= BrLtImm && t <= BrGteImm;
+}
+
+static inline int p_compare_index(InstructionType t) {
+    switch (t) {
+        case Lt: return 0;
+        case Lte: return 1;
+        case Gt: return 2;
+        case Gte: return 3;
+        default: return -1;
+    }
+}
+
+static size_t p_match_fusion(const Instruction *code, size_t count, size_t i, const bool *is_target, Instruction *out) {
+    // Number of instructions from i that can be fused, stopping at a jump target
+    size_t len = 1;
+    while (len < 4 && i + len < count && !is_target[i + len]) {
+        len++;
+    }
+
+    int cmp;
+    if (len >= 4 && code[i].type == Dup && code[i + 1].type == Push &&
+        (cmp = p_compare_index(code[i + 2].type)) >= 0 && code[i + 3].type == JmpIf &&
+        p_arg(&code[i + 3]).as_int >= 0 && (uint64_t)p_arg(&code[i + 3]).as_int <= count) {
+        *out = (Instruction){.type = BrLtImm + cmp, .aux = (int32_t)p_arg(&code[i + 3]).as_int, .arg = code[i + 1].arg};
+        return 4;
+    }
+
+    if (len >= 4 && code[i].type == PushRegister && code[i + 1].type == Push &&
+        code[i + 2].type == Add && code[i + 3].type == Pop &&
+        p_arg(&code[i]).as_int == p_arg(&code[i + 3]).as_int) {
+        *out = (Instruction){.type = RegAddImm, .aux = (int32_t)p_arg(&code[i]).as_int, .arg = code[i + 1].arg};
+        return 4;
+    }
+
+    if (len >= 2 && code[i].type == Push && code[i + 1].type == Add) {
+        *out = (Instruction){.type = AddImm, .arg = code[i].arg};
+        return 2;
+    }
+
+    if (len >= 2 && code[i].type == Push && (cmp = p_compare_index(code[i + 1].type)) >= 0) {
+        *out = (Instruction){.type = LtImm + cmp, .arg = code[i].arg};
+        return 2;
+    }
+
+    return 0;
+}
+
+static void p_fuse_function(ProstVM *vm, Function *fn) {
+    Instruction *code = fn->instructions.data;
+    size_t count = fn->instructions.count;
+    if (count == 0) return;
+
+    bool *is_target = calloc(count + 1, sizeof(bool));
+    size_t *new_index = malloc((count + 1) * sizeof(size_t));
+
+    for (size_t i = 0; i < count; i++) {
+        if (p_is_jump(code[i].type) && p_arg(&code[i]).as_int >= 0 && (uint64_t)p_arg(&code[i]).as_int <= count) {
+            is_target[p_arg(&code[i]).as_int] = true;
+        } else if (p_is_branch(code[i].type) && code[i].aux >= 0 && (size_t)code[i].aux <= count) {
+            is_target[code[i].aux] = true;
+        }
+    }
+
+    size_t out = 0;
+    for (size_t i = 0; i < count;) {
+        Instruction fused;
+        size_t len = p_match_fusion(code, count, i, is_target, &fused);
+        if (len == 0) {
+            new_index[i] = out;
+            code[out++] = code[i++];
+            continue;
+        }
+        for (size_t k = 0; k < len; k++) {
+            new_index[i + k] = out;
+        }
+        code[out++] = fused;
+        vm->fusion_counts[fused.type]++;
+        i += len;
+    }
+    new_index[count] = out;
+
+    for (size_t i = 0; i < out; i++) {
+        if (p_is_jump(code[i].type) && p_arg(&code[i]).as_int >= 0 && (uint64_t)p_arg(&code[i]).as_int <= count) {
+            p_set_arg(&code[i], WORD((int64_t)new_index[p_arg(&code[i]).as_int]));
+        } else if (p_is_branch(code[i].type) && code[i].aux >= 0 && (size_t)code[i].aux <= count) {
+            code[i].aux = (int32_t)new_index[code[i].aux];
+        }
+    }
+    fn->instructions.count = out;
+
+    free(is_target);
+    free(new_index);
+}
+
+// Turns every call that is followed by `return` or by the end of its function
+// into the matching tail call, so self- and mutual recursion in tail position
+// runs in constant call-stack space. The return itself stays, as it may be a
+// jump target. Works on linked and unlinked code.
+ProstStatus p_mark_tail_calls(ProstVM *vm) {
+    for (size_t i = 0; i < xvec_len(&vm->function_list); i++) {
+        Function *fn = (Function *)xvec_get(&vm->function_list, i)->as_pointer;
+        for (size_t j = 0; j < fn->instructions.count; j++) {
+            Instruction *inst = &fn->instructions.data[j];
+            if (j + 1 < fn->instructions.count && fn->instructions.data[j + 1].type != Return) continue;
+
+            InstructionType tail;
+            switch (inst->type) {
+                case Call: tail = TailCall; break;
+                case CallExtern: tail = TailCallExtern; break;
+                case CallDirect: tail = TailCallDirect; break;
+                case CallExternSlot: tail = TailCallExternSlot; break;
+                default: continue;
+            }
+            inst->type = tail;
+            vm->fusion_counts[tail]++;
+        }
+    }
+    vm->status = P_OK;
+    return vm->status;
+}
+
+ProstStatus p_optimize(ProstVM *vm) {
+    p_mark_tail_calls(vm);
+    for (size_t i = 0; i < xvec_len(&vm->function_list); i++) {
+        p_fuse_function(vm, (Function *)xvec_get(&vm->function_list, i)->as_pointer);
+    }
+    vm->status = P_OK;
+    return vm->status;
+}
+
+void p_print_fusion_stats(ProstVM *vm, FILE *out) {
+    fprintf(out, "Superinstruction fusions:\n");
+    size_t total = 0;
+    for (int t = 0; t < INSTRUCTION_COUNT; t++) {
+        if (vm->fusion_counts[t] == 0) continue;
+        fprintf(out, "  %-14s %zu\n", p_instr_to_str((InstructionType)t), vm->fusion_counts[t]);
+        total += vm->fusion_counts[t];
+    }
+    fprintf(out, "  %-14s %zu\n", "total", total);
+}
+
+// Bytecode verification.
+// Walks each function's control flow graph tracking the stack depth at every
+// instruction as a range relative to the depth on entry. Calls apply the
+// callee's FunctionInfo, so all functions are analyzed repeatedly until the
+// summaries stop changing; a callee without a summary yet is assumed not to
+// return, which lets recursion converge from its base case.
+//
+// Code whose depth can't be tracked (an external without a declared stack
+// effect, neq, which only pushes for ints, a callee whose result depth varies)
+// just leaves the function unverified, so it keeps the checked handlers.
+// Invalid jump targets, registers and external slots, and an __entry that may
+// underflow, are errors.
+#define P_DEPTH_INF (INT32_MAX / 4)
+#define P_VERIFY_WIDEN_AFTER 3
+
+static const PStackEffect p_stack_effects[INSTRUCTION_COUNT] = {
+    [Push] = {0, 1}, [PushRegister] = {0, 1}, [Pop] = {1, 0}, [Drop] = {1, 0}, [JmpIf] = {1, 0},
+    [Dup] = {1, 2}, [Swap] = {2, 2}, [Over] = {2, 3}, [Eq] = {1, 2},
+    [Lt] = {2, 1}, [Lte] = {2, 1}, [Gt] = {2, 1}, [Gte] = {2, 1},
+    [Read8] = {1, 1}, [Write8] = {2, 0},
+    [Add] = {2, 1}, [Sub] = {2, 1}, [Mul] = {2, 1}, [Div] = {2, 1}, [Mod] = {2, 1},
+    [And] = {2, 1}, [Or] = {2, 1}, [Xor] = {2, 1}, [Shl] = {2, 1}, [Shr] = {2, 1}, [Not] = {1, 1},
+    [AddImm] = {1, 1}, [LtImm] = {1, 1}, [LteImm] = {1, 1}, [GtImm] = {1, 1}, [GteImm] = {1, 1},
+    [BrLtImm] = {1, 1}, [BrLteImm] = {1, 1}, [BrGtImm] = {1, 1}, [BrGteImm] = {1, 1},
+    [Spawn] = {1, 1}, [SpawnDirect] = {1, 1}, [Join] = {1, 1},
+};
+
+typedef enum {
+    P_VERIFY_OK,
+    P_VERIFY_UNKNOWN,
+    P_VERIFY_ERROR,
+} PVerifyResult;
+
+typedef struct {
+    int32_t lo;
+    int32_t hi;
+    uint8_t changes;
+    bool seen;
+} PDepthRange;
+
+typedef struct {
+    PDepthRange *at;
+    size_t *work;
+    size_t work_len;
+    bool *queued;
+} PVerifyFlow;
+
+static inline int32_t p_depth_add(int32_t depth, int32_t delta) {
+    if (depth >= P_DEPTH_INF || depth <= -P_DEPTH_INF) return depth;
+    return depth + delta;
+}
+
+// Merges a depth range into the one at target and queues target if it grew.
+// A range that keeps growing (a loop that pushes or pops every iteration) is
+// widened to unbounded so the walk terminates.
+static void p_verify_flow(PVerifyFlow *flow, size_t target, int32_t lo, int32_t hi) {
+    PDepthRange *r = &flow->at[target];
+    if (!r->seen) {
+        r->seen = true;
+        r->lo = lo;
+        r->hi = hi;
+    } else {
+        if (lo >= r->lo && hi <= r->hi) return;
+        if (++r->changes > P_VERIFY_WIDEN_AFTER) {
+            if (lo < r->lo) lo = -P_DEPTH_INF;
+            if (hi > r->hi) hi = P_DEPTH_INF;
+        }
+        if (lo < r->lo) r->lo = lo;
+        if (hi > r->hi) r->hi = hi;
+    }
+    if (!flow->queued[target]) {
+        flow->queued[target] = true;
+        flow->work[flow->work_len++] = target;
+    }
+}
+
+static PVerifyResult p_verify_function(ProstVM *vm, Function *fn, const bool *analyzed, FILE *report, FunctionInfo *info) {
+    size_t count = fn->instructions.count;
+    PVerifyFlow flow = {
+        .at = calloc(count + 1, sizeof(PDepthRange)),
+        .work = malloc((count + 1) * sizeof(size_t)),
+        .work_len = 0,
+        .queued = calloc(count + 1, sizeof(bool)),
+    };
+
+    PVerifyResult result = P_VERIFY_OK;
+    int64_t needs = 0;
+    size_t needs_ip = 0;
+    int32_t max_depth = 0;
+    int32_t frame_depth = 0;
+    bool returns = false;
+    bool out_fixed = true;
+    int32_t out_depth = 0;
+
+    p_verify_flow(&flow, 0, 0, 0);
+    while (flow.work_len > 0 && result != P_VERIFY_ERROR) {
+        size_t ip = flow.work[--flow.work_len];
+        flow.queued[ip] = false;
+        int32_t lo = flow.at[ip].lo;
+        int32_t hi = flow.at[ip].hi;
+
+        Instruction *inst = ip < count ? &fn->instructions.data[ip] : NULL;
+        InstructionType type = inst ? inst->type : Return; // running off the end returns
+        int32_t pops = p_stack_effects[type].pops;
+        int32_t pushes = p_stack_effects[type].pushes;
+        bool falls_through = true;
+        bool jumps = false;
+        int64_t target = -1;
+        int32_t callee_peak = 0;
+        bool tail = false;
+        const char *error = NULL;
+        const char *unknown = NULL;
+
+        switch (type) {
+            case Jmp:
+                jumps = true;
+                target = p_arg(inst).as_int;
+                falls_through = false;
+                break;
+            case JmpIf:
+                jumps = true;
+                target = p_arg(inst).as_int;
+                break;
+            case BrLtImm: case BrLteImm: case BrGtImm: case BrGteImm:
+                jumps = true;
+                target = inst->aux;
+                break;
+            case Return:
+                if (lo != hi || (returns && lo != out_depth)) out_fixed = false;
+                returns = true;
+                out_depth = lo;
+                falls_through = false;
+                break;
+            case Halt:
+                falls_through = false;
+                break;
+            case Pop: case PushRegister:
+                if ((uint64_t)p_arg(inst).as_int >= P_REGISTERS_COUNT) error = "invalid register";
+                break;
+            case RegAddImm:
+                if ((uint32_t)inst->aux >= P_REGISTERS_COUNT) error = "invalid register";
+                break;
+            case Neq:
+                unknown = "neq only pushes a result for ints";
+                break;
+            case Call: case CallExtern: case TailCall: case TailCallExtern:
+                unknown = "call is not linked";
+                break;
+            case TailCallDirect:
+                tail = true;
+                // fallthrough
+            case CallDirect: {
+                Function *callee = (Function *)p_arg(inst).as_pointer;
+                if (!analyzed[callee->index]) {
+                    falls_through = false;
+                    break;
+                }
+                if (!callee->info.verified || (callee->info.returns && callee->info.stack_out < 0)) {
+                    unknown = "calls a function with an unknown stack effect";
+                    break;
+                }
+                pops = callee->info.stack_in;
+                pushes = callee->info.stack_out;
+                falls_through = callee->info.returns;
+                callee_peak = callee->info.max_stack < 0 ? P_DEPTH_INF : callee->info.max_stack;
+                break;
+            }
+            case TailCallExternSlot:
+                tail = true;
+                // fallthrough
+            case CallExternSlot: {
+                int64_t slot = p_arg(inst).as_int;
+                if (slot < 0 || (uint64_t)slot >= vm->external_count) {
+                    error = "invalid external slot";
+                } else if (vm->external_effects[slot].pops < 0) {
+                    unknown = "calls an external without a declared stack effect";
+                } else {
+                    pops = vm->external_effects[slot].pops;
+                    pushes = vm->external_effects[slot].pushes;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+
+        if (jumps && (target < 0 || (uint64_t)target > count)) {
+            error = "jump target out of range";
+        }
+
+        if (error) {
+            if (report) fprintf(report, "ERROR: %s in function '%s' at %zu\n", error, fn->name, ip);
+            result = P_VERIFY_ERROR;
+            break;
+        }
+        if (!unknown && lo <= -P_DEPTH_INF) {
+            unknown = "stack consumption is unbounded";
+        }
+        if (unknown) {
+            if (report && result == P_VERIFY_OK) {
+                fprintf(report, "NOTE: function '%s' not verified: %s at %zu\n", fn->name, unknown, ip);
+            }
+            result = P_VERIFY_UNKNOWN;
+            continue;
+        }
+
+        if (pops - (int64_t)lo > needs) {
+            needs = pops - (int64_t)lo;
+            needs_ip = ip;
+        }
+        int32_t next_lo = p_depth_add(lo, pushes - pops);
+        int32_t next_hi = p_depth_add(hi, pushes - pops);
+        if (next_hi > max_depth) max_depth = next_hi;
+        if (next_hi > frame_depth) frame_depth = next_hi;
+        if (callee_peak >= P_DEPTH_INF) {
+            max_depth = P_DEPTH_INF;
+        } else if (p_depth_add(hi, callee_peak) > max_depth) {
+            max_depth = p_depth_add(hi, callee_peak);
+        }
+
+        // A tail call returns with the callee's results, except at the bottom
+        // of the call stack, where it falls through like a plain call
+        if (tail && falls_through) {
+            if (next_lo != next_hi || (returns && next_lo != out_depth)) out_fixed = false;
+            returns = true;
+            out_depth = next_lo;
+        }
+
+        if (jumps) p_verify_flow(&flow, (size_t)target, next_lo, next_hi);
+        if (falls_through) p_verify_flow(&flow, ip + 1, next_lo, next_hi);
+    }
+
+    if (result != P_VERIFY_ERROR && needs > 0 && strcmp(fn->name, "__entry") == 0) {
+        if (report) fprintf(report, "ERROR: stack may underflow in function '%s' at %zu\n", fn->name, needs_ip);
+        result = P_VERIFY_ERROR;
+    }
+
+    info->verified = result == P_VERIFY_OK;
+    info->returns = returns;
+    info->stack_in = (int32_t)needs;
+    info->stack_out = returns && out_fixed ? (int32_t)needs + out_depth : -1;
+    info->max_stack = max_depth >= P_DEPTH_INF ? -1 : max_depth;
+    info->frame_stack = frame_depth >= P_DEPTH_INF ? -1 : frame_depth;
+
+    free(flow.at);
+    free(flow.work);
+    free(flow.queued);
+    return result;
+}
+
+static inline bool p_function_info_equal(const FunctionInfo *a, const FunctionInfo *b) {
+    return a->verified == b->verified && a->returns == b->returns && a->stack_in == b->stack_in &&
+           a->stack_out == b->stack_out && a->max_stack == b->max_stack && a->frame_stack == b->frame_stack;
+}
+
+// Orders the call graph for p_verify with Tarjan's algorithm, run without
+// recursion. Each strongly connected component is appended to order after
+// every component it calls, and its size to sizes. Returns the number of
+// components. self_call marks functions that call themselves directly.
+static size_t p_call_graph_sccs(ProstVM *vm, size_t count, size_t *order, size_t *sizes, bool *self_call) {
+    size_t *visit = calloc(count + 1, sizeof(size_t)); // 0 until visited
+    size_t *low = malloc((count + 1) * sizeof(size_t));
+    size_t *next_ip = malloc((count + 1) * sizeof(size_t));
+    size_t *path = malloc((count + 1) * sizeof(size_t));
+    size_t *stack = malloc((count + 1) * sizeof(size_t));
+    bool *on_stack = calloc(count + 1, sizeof(bool));
+    size_t visits = 0, path_len = 0, stack_len = 0, order_len = 0, scc_count = 0;
+
+    for (size_t root = 0; root < count; root++) {
+        if (visit[root]) continue;
+        size_t v = root;
+        for (;;) {
+            if (v < count) {
+                visit[v] = low[v] = ++visits;
+                next_ip[v] = 0;
+                path[path_len++] = v;
+                stack[stack_len++] = v;
+                on_stack[v] = true;
+            }
+            v = count; // nothing new to visit unless an edge below says so
+            if (path_len == 0) break;
+
+            size_t top = path[path_len - 1];
+            Function *fn = (Function *)xvec_get(&vm->function_list, top)->as_pointer;
+            if (next_ip[top] < fn->instructions.count) {
+                Instruction *inst = &fn->instructions.data[next_ip[top]++];
+                if (inst->type != CallDirect && inst->type != TailCallDirect) continue;
+                size_t callee = ((Function *)p_arg(inst).as_pointer)->index;
+                if (callee == top) self_call[top] = true;
+                if (!visit[callee]) {
+                    v = callee;
+                } else if (on_stack[callee] && visit[callee] < low[top]) {
+                    low[top] = visit[callee];
+                }
+                continue;
+            }
+
+            path_len--;
+            if (path_len > 0 && low[top] < low[path[path_len - 1]]) low[path[path_len - 1]] = low[top];
+            if (low[top] == visit[top]) {
+                size_t size = 0, member;
+                do {
+                    member = stack[--stack_len];
+                    on_stack[member] = false;
+                    order[order_len++] = member;
+                    size++;
+                } while (member != top);
+                sizes[scc_count++] = size;
+            }
+        }
+    }
+
+    free(visit);
+    free(low);
+    free(next_ip);
+    free(path);
+    free(stack);
+    free(on_stack);
+    return scc_count;
+}
+
+// Verifies every function and fills in its FunctionInfo. Errors and the reason
+// a function could not be verified are written to report, which may be NULL.
+// Returns P_ERR_INVALID_BYTECODE if any function has an error.
+//
+// Callees are verified before their callers, so most functions are analyzed
+// once. Only mutually recursive functions are iterated until their summaries
+// settle.
+ProstStatus p_verify(ProstVM *vm, FILE *report) {
+    size_t count = xvec_len(&vm->function_list);
+    bool *analyzed = calloc(count + 1, sizeof(bool));
+    uint8_t *max_growth = calloc(count + 1, sizeof(uint8_t));
+    size_t *order = malloc((count + 1) * sizeof(size_t));
+    size_t *sizes = malloc((count + 1) * sizeof(size_t));
+    bool *self_call = calloc(count + 1, sizeof(bool));
+
+    for (size_t i = 0; i < count; i++) {
+        Function *fn = (Function *)xvec_get(&vm->function_list, i)->as_pointer;
+        memset(&fn->info, 0, sizeof(fn->info));
+    }
+    size_t scc_count = p_call_graph_sccs(vm, count, order, sizes, self_call);
+
+    ProstStatus status = P_OK;
+    size_t *members = order;
+    for (size_t s = 0; s < scc_count; members += sizes[s++]) {
+        size_t size = sizes[s];
+        if (size == 1 && !self_call[members[0]]) {
+            Function *fn = (Function *)xvec_get(&vm->function_list, members[0])->as_pointer;
+            if (p_verify_function(vm, fn, analyzed, report, &fn->info) == P_VERIFY_ERROR) {
+                status = P_ERR_INVALID_BYTECODE;
+            }
+            analyzed[members[0]] = true;
+            continue;
+        }
+
+        // Recursion settles within a few rounds. The cap is a backstop: if the
+        // summaries never settle, nothing here is trusted to run unchecked.
+        size_t max_rounds = 2 * size + 4;
+        bool changed = true;
+        for (size_t round = 0; changed && round < max_rounds; round++) {
+            changed = false;
+            for (size_t m = 0; m < size; m++) {
+                size_t i = members[m];
+                Function *fn = (Function *)xvec_get(&vm->function_list, i)->as_pointer;
+                FunctionInfo info;
+                p_verify_function(vm, fn, analyzed, NULL, &info);
+                // Recursion deepens the stack without bound; stop chasing it
+                if (analyzed[i] && fn->info.max_stack >= 0 && info.max_stack > fn->info.max_stack &&
+                    ++max_growth[i] > P_VERIFY_WIDEN_AFTER) {
+                    info.max_stack = -1;
+                }
+                if (analyzed[i] && fn->info.max_stack < 0) {
+                    info.max_stack = -1;
+                }
+                if (!analyzed[i] || !p_function_info_equal(&info, &fn->info)) {
+                    changed = true;
+                }
+                fn->info = info;
+                analyzed[i] = true;
+            }
+        }
+
+        for (size_t m = 0; m < size; m++) {
+            Function *fn = (Function *)xvec_get(&vm->function_list, members[m])->as_pointer;
+            FunctionInfo info;
+            if (p_verify_function(vm, fn, analyzed, report, &info) == P_VERIFY_ERROR) {
+                status = P_ERR_INVALID_BYTECODE;
+            }
+            if (changed) {
+                fn->info.verified = false;
+            }
+        }
+    }
+
+    free(analyzed);
+    free(max_growth);
+    free(order);
+    free(sizes);
+    free(self_call);
+    vm->status = status;
+    return vm->status;
+}
+
+// Bytecode format, version 2 (see "Bytecode Format" in the README). Every
+// multi-byte field is little-endian, whatever the host.
+#define P_BC_MAGIC "PROST" // 6 bytes with the NUL
+#define P_BC_MAGIC_SIZE 6
+#define P_BC_VERSION 2
+#define P_BC_HEADER_SIZE 24
+#define P_BC_COMPACT 1 // header flag: compact instruction encoding
+
+// Compact encoding: the top two bits of the opcode byte say how the operand
+// follows. Operands that are plain ints never touch the pool.
+enum {
+    P_OPERAND_NONE,   // int 0, nothing follows
+    P_OPERAND_BYTE,   // int 1..255, one byte
+    P_OPERAND_VARINT, // any other int, zigzag varint
+    P_OPERAND_POOL,   // varint pool index
+};
+_Static_assert(INSTRUCTION_COUNT <= 64, "opcodes must fit in the low six bits");
+
+// Constant pool entry tags
+enum {
+    P_CONST_INT,    // flags u8 (WF_IS_UNSIGNED), value u64
+    P_CONST_FLOAT,  // bits u64
+    P_CONST_CHAR,   // u8
+    P_CONST_STRING, // length u32, bytes
+    P_CONST_NULL,   // null pointer; other pointers are process-local and load as null
+};
+
+static void p_put_u32(ByteBuf *b, uint32_t v) {
+    for (int i = 0; i < 4; i++) bb_push(b, (uint8_t)(v >> (8 * i)));
+}
+
+static void p_put_u64(ByteBuf *b, uint64_t v) {
+    for (int i = 0; i < 8; i++) bb_push(b, (uint8_t)(v >> (8 * i)));
+}
 
-    uint16_t fn_count;
-    memcpy(&fn_count, ptr, sizeof(uint16_t));
-    ptr += sizeof(uint16_t);
+// LEB128: seven bits per byte, low bits first, high bit set on all but the last
+static void p_put_varint(ByteBuf *b, uint64_t v) {
+    while (v >= 0x80) {
+        bb_push(b, (uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    bb_push(b, (uint8_t)v);
+}
 
-    for (uint16_t i = 0; i < fn_count; i++) {
-        uint16_t name_len;
-        memcpy(&name_len, ptr, sizeof(uint16_t));
-        ptr += sizeof(uint16_t);
+static inline uint64_t p_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
 
-        char *fn_name = (char *)malloc(name_len + 1);
-        if (!fn_name) {
-            vm->status = P_ERR_INVALID_VM_STATE;
-            return vm->status;
+static inline int64_t p_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline uint32_t p_get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t p_get_u64(const uint8_t *p) {
+    return (uint64_t)p_get_u32(p) | (uint64_t)p_get_u32(p + 4) << 32;
+}
+
+// Deduplicating constant pool for p_to_bytecode. Entries are compared by
+// their encoded bytes.
+typedef struct {
+    ByteBuf bytes;     // encoded entries, back to back
+    ByteBuf scratch;   // the entry being added
+    size_t *offsets;   // entry -> offset in bytes, plus the end
+    uint32_t count;
+    uint32_t *table;   // open addressing on the entry hash: index + 1, 0 = empty
+    size_t table_size; // power of two
+} PConstPool;
+
+static uint32_t p_pool_hash(const uint8_t *data, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+static void p_pool_grow(PConstPool *pool) {
+    size_t size = pool->table_size ? pool->table_size * 2 : 256;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    for (uint32_t i = 0; i < pool->count; i++) {
+        size_t off = pool->offsets[i];
+        size_t h = p_pool_hash(pool->bytes.data + off, pool->offsets[i + 1] - off) & (size - 1);
+        while (table[h]) h = (h + 1) & (size - 1);
+        table[h] = i + 1;
+    }
+    free(pool->table);
+    pool->table = table;
+    pool->table_size = size;
+    pool->offsets = realloc(pool->offsets, (size / 2 + 1) * sizeof(size_t));
+}
+
+// Adds the entry in pool->scratch unless it is already there; returns its index
+static uint32_t p_pool_commit(PConstPool *pool) {
+    const uint8_t *entry = pool->scratch.data;
+    size_t len = pool->scratch.len;
+    if ((size_t)pool->count * 2 >= pool->table_size) p_pool_grow(pool);
+
+    size_t mask = pool->table_size - 1;
+    size_t h = p_pool_hash(entry, len) & mask;
+    for (; pool->table[h]; h = (h + 1) & mask) {
+        uint32_t i = pool->table[h] - 1;
+        size_t off = pool->offsets[i];
+        if (pool->offsets[i + 1] - off == len && memcmp(pool->bytes.data + off, entry, len) == 0) return i;
+    }
+
+    if (pool->count == 0) pool->offsets[0] = 0;
+    bb_append(&pool->bytes, entry, len);
+    pool->table[h] = pool->count + 1;
+    pool->offsets[++pool->count] = pool->bytes.len;
+    return pool->count - 1;
+}
+
+static uint32_t p_pool_string(PConstPool *pool, const char *s) {
+    uint32_t len = (uint32_t)strlen(s);
+    bb_clear(&pool->scratch);
+    bb_push(&pool->scratch, P_CONST_STRING);
+    p_put_u32(&pool->scratch, len);
+    bb_append(&pool->scratch, s, len);
+    return p_pool_commit(pool);
+}
+
+static uint32_t p_pool_word(PConstPool *pool, Word w) {
+    if (w.type == WPOINTER && word_is_string(&w) && w.as_pointer) {
+        return p_pool_string(pool, (const char *)w.as_pointer);
+    }
+
+    bb_clear(&pool->scratch);
+    switch (w.type) {
+        case WINT:
+            bb_push(&pool->scratch, P_CONST_INT);
+            bb_push(&pool->scratch, w.flags & WF_IS_UNSIGNED);
+            p_put_u64(&pool->scratch, (uint64_t)w.as_int);
+            break;
+        case WFLOAT: {
+            uint64_t bits;
+            memcpy(&bits, &w.as_float, sizeof(bits));
+            bb_push(&pool->scratch, P_CONST_FLOAT);
+            p_put_u64(&pool->scratch, bits);
+            break;
         }
-        memcpy(fn_name, ptr, name_len);
-        fn_name[name_len] = '\0';
-        ptr += name_len;
+        case WCHAR_:
+            bb_push(&pool->scratch, P_CONST_CHAR);
+            bb_push(&pool->scratch, (uint8_t)w.as_char);
+            break;
+        default:
+            bb_push(&pool->scratch, P_CONST_NULL);
+            break;
+    }
+    return p_pool_commit(pool);
+}
 
-        Function *fn = (Function *)malloc(sizeof(Function));
-        if (!fn) {
-            free(fn_name);
-            vm->status = P_ERR_INVALID_VM_STATE;
-            return vm->status;
+ByteBuf p_to_bytecode(ProstVM *vm) {
+    PConstPool pool = {0};
+    bb_init(&pool.bytes, 1024);
+    bb_init(&pool.scratch, 64);
+    ByteBuf code;
+    bb_init(&code, 1024);
+
+    uint32_t fn_count = (uint32_t)xvec_len(&vm->function_list);
+    for (size_t i = 0; i < fn_count; i++) {
+        Function *fn = (Function *)xvec_get(&vm->function_list, i)->as_pointer;
+        p_put_varint(&code, p_pool_string(&pool, fn->name));
+        p_put_varint(&code, fn->instructions.count);
+
+        for (size_t j = 0; j < fn->instructions.count; j++) {
+            Instruction *inst = &fn->instructions.data[j];
+
+            uint8_t inst_type = (uint8_t)inst->type;
+            const char *str = (const char *)p_arg(inst).as_pointer;
+            if (inst->type == CallDirect || inst->type == TailCallDirect) {
+                inst_type = inst->type == CallDirect ? Call : TailCall;
+                str = ((Function *)p_arg(inst).as_pointer)->name;
+            } else if (inst->type == CallExternSlot || inst->type == TailCallExternSlot) {
+                inst_type = inst->type == CallExternSlot ? CallExtern : TailCallExtern;
+                str = vm->external_names[p_arg(inst).as_int];
+            } else if (inst->type == SpawnDirect) {
+                inst_type = Spawn;
+                str = ((Function *)p_arg(inst).as_pointer)->name;
+            }
+
+            Word arg = p_arg(inst);
+            if (p_is_named_call((InstructionType)inst_type)) {
+                bb_push(&code, inst_type | P_OPERAND_POOL << 6);
+                p_put_varint(&code, p_pool_string(&pool, str ? str : ""));
+            } else if (arg.type != WINT || arg.flags != 0) {
+                bb_push(&code, inst_type | P_OPERAND_POOL << 6);
+                p_put_varint(&code, p_pool_word(&pool, arg));
+            } else if (arg.as_int == 0) {
+                bb_push(&code, inst_type | P_OPERAND_NONE << 6);
+            } else if (arg.as_int > 0 && arg.as_int <= 255) {
+                bb_push(&code, inst_type | P_OPERAND_BYTE << 6);
+                bb_push(&code, (uint8_t)arg.as_int);
+            } else {
+                bb_push(&code, inst_type | P_OPERAND_VARINT << 6);
+                p_put_varint(&code, p_zigzag(arg.as_int));
+            }
+            if (p_instr_has_aux(inst->type)) {
+                p_put_varint(&code, p_zigzag(inst->aux));
+            }
         }
+    }
+
+    ByteBuf bb;
+    bb_init(&bb, P_BC_HEADER_SIZE + pool.bytes.len + code.len);
+    bb_append(&bb, P_BC_MAGIC, P_BC_MAGIC_SIZE);
+    bb_push(&bb, P_BC_VERSION);
+    bb_push(&bb, P_BC_COMPACT);
+    p_put_u32(&bb, pool.count);
+    p_put_u32(&bb, (uint32_t)pool.bytes.len);
+    p_put_u32(&bb, fn_count);
+    p_put_u32(&bb, (uint32_t)code.len);
+    bb_append(&bb, pool.bytes.data, pool.bytes.len);
+    bb_append(&bb, code.data, code.len);
+
+    bb_free(&pool.bytes);
+    bb_free(&pool.scratch);
+    free(pool.offsets);
+    free(pool.table);
+    bb_free(&code);
+    return bb;
+}
 
-        uint16_t inst_count;
-        memcpy(&inst_count, ptr, sizeof(uint16_t));
-        ptr += sizeof(uint16_t);
+// Checks every instruction's register, jump target and external slot, which
+// the handlers index with unchecked. Unlike p_verify it looks at unreachable
+// code too. Errors go to report, or stderr if it is NULL.
+static ProstStatus p_check_operands(ProstVM *vm, FILE *report) {
+    vm->status = P_OK;
+    for (size_t i = 0; i < xvec_len(&vm->function_list); i++) {
+        Function *fn = (Function *)xvec_get(&vm->function_list, i)->as_pointer;
+        size_t count = fn->instructions.count;
+        for (size_t ip = 0; ip < count; ip++) {
+            Instruction *inst = &fn->instructions.data[ip];
+            const char *error = NULL;
+            if (inst->type == Pop || inst->type == PushRegister) {
+                if ((uint64_t)p_arg(inst).as_int >= P_REGISTERS_COUNT) error = "invalid register";
+            } else if (inst->type == RegAddImm) {
+                if ((uint32_t)inst->aux >= P_REGISTERS_COUNT) error = "invalid register";
+            } else if (p_is_jump(inst->type)) {
+                if ((uint64_t)p_arg(inst).as_int > count) error = "jump target out of range";
+            } else if (p_is_branch(inst->type)) {
+                if ((uint32_t)inst->aux > count) error = "jump target out of range";
+            } else if (inst->type == CallExternSlot || inst->type == TailCallExternSlot) {
+                if ((uint64_t)p_arg(inst).as_int >= vm->external_count) error = "invalid external slot";
+            }
+            if (error) {
+                fprintf(report ? report : stderr, "ERROR: %s in function '%s' at %zu\n", error, fn->name, ip);
+                vm->status = P_ERR_INVALID_BYTECODE;
+            }
+        }
+    }
+    return vm->status;
+}
 
-        fn->instructions.data = (Instruction *)malloc(sizeof(Instruction) * inst_count);
-        fn->instructions.count = inst_count;
-        fn->instructions.capacity = inst_count;
+// Links, (if vm->optimize) fuses and verifies freshly decoded functions
+static ProstStatus p_prepare(ProstVM *vm) {
+    if (p_link(vm) != P_OK) {
+        return vm->status;
+    }
+    if (vm->optimize) {
+        p_optimize(vm);
+    }
+    if (p_check_operands(vm, vm->verify_report) != P_OK) {
+        return vm->status;
+    }
+    // Decides which functions may run unchecked. Stack depth errors only
+    // reject the bytecode if vm->verify_report asks for it.
+    if (p_verify(vm, vm->verify_report) != P_OK && vm->verify_report) {
+        return vm->status;
+    }
+    vm->status = P_OK;
+    return vm->status;
+}
 
-        for (uint16_t j = 0; j < inst_count; j++) {
-            Instruction *inst = &fn->instructions.data[j];
+// Loads the functions in bytecode, then links, (if vm->optimize) fuses and
+// verifies them. bytecode must hold a whole program; use p_from_bytecode_n
+// for bytes that may be truncated.
+ProstStatus p_from_bytecode(ProstVM *vm, const char *bytecode) {
+    return p_from_bytecode_n(vm, bytecode, SIZE_MAX);
+}
 
+// p_from_bytecode reading at most size bytes
+ProstStatus p_from_bytecode_n(ProstVM *vm, const char *bytecode, size_t size) {
+    if (p_decode_bytecode_n(vm, bytecode, size) != P_OK) {
+        return vm->status;
+    }
+    return p_prepare(vm);
+}
+
+typedef struct {
+    const uint8_t *ptr;
+    size_t left;
+} PReader;
+
+static inline const uint8_t *p_take(PReader *r, size_t n) {
+    if (r->left < n) return NULL;
+    const uint8_t *p = r->ptr;
+    r->ptr += n;
+    r->left -= n;
+    return p;
+}
+
+static inline bool p_read(PReader *r, void *out, size_t n) {
+    const uint8_t *p = p_take(r, n);
+    if (p) memcpy(out, p, n);
+    return p != NULL;
+}
+
+// What the functions in a bytecode blob need from their arena
+typedef struct {
+    size_t functions;
+    size_t instructions;
+    size_t chars; // names and call targets, NUL-terminated
+} PDecodeSize;
+
+// Walks the encoded functions. Without an arena this only checks bounds and
+// opcodes and fills *size; with an arena laid out from that size it builds
+// the functions inside it and adds them to the VM.
+// Version 1: no header, uint16 counts, operands as raw host Words.
+static bool p_walk_v1(ProstVM *vm, PReader r, PDecodeSize *size, uint8_t *arena) {
+    Function *fns = (Function *)arena;
+    Instruction *code = arena ? (Instruction *)(fns + size->functions) : NULL;
+    char *chars = arena ? (char *)(code + size->instructions) : NULL;
+    size_t n_inst = 0, n_char = 0;
+
+    uint16_t fn_count;
+    if (!p_read(&r, &fn_count, sizeof(uint16_t))) return false;
+
+    for (uint16_t i = 0; i < fn_count; i++) {
+        uint16_t name_len, inst_count;
+        const uint8_t *name;
+        if (!p_read(&r, &name_len, sizeof(uint16_t)) || !(name = p_take(&r, name_len)) ||
+            !p_read(&r, &inst_count, sizeof(uint16_t))) {
+            return false;
+        }
+
+        char *fn_name = chars ? chars + n_char : NULL;
+        if (fn_name) {
+            memcpy(fn_name, name, name_len);
+            fn_name[name_len] = '\0';
+        }
+        n_char += name_len + 1;
+        Instruction *fn_code = code ? code + n_inst : NULL;
+        n_inst += inst_count;
+
+        for (uint16_t j = 0; j < inst_count; j++) {
             uint8_t inst_type;
-            memcpy(&inst_type, ptr, sizeof(uint8_t));
-            ptr += sizeof(uint8_t);
-            inst->type = (InstructionType)inst_type;
+            if (!p_read(&r, &inst_type, sizeof(uint8_t)) ||
+                inst_type >= INSTRUCTION_COUNT || p_is_linked_op((InstructionType)inst_type)) {
+                return false;
+            }
+            Instruction inst = {.type = (InstructionType)inst_type, .aux = 0};
 
-            if (inst->type == Call || inst->type == CallExtern) {
+            if (p_is_named_call(inst.type)) {
                 uint16_t str_len;
-                memcpy(&str_len, ptr, sizeof(uint16_t));
-                ptr += sizeof(uint16_t);
+                const uint8_t *str;
+                if (!p_read(&r, &str_len, sizeof(uint16_t)) || !(str = p_take(&r, str_len))) return false;
 
+                char *target = NULL;
                 if (str_len > 0) {
-                    char *str = (char *)malloc(str_len + 1);
-                    if (!str) {
-                        vm->status = P_ERR_INVALID_VM_STATE;
-                        return vm->status;
+                    if (chars) {
+                        target = chars + n_char;
+                        memcpy(target, str, str_len);
+                        target[str_len] = '\0';
                     }
-                    memcpy(str, ptr, str_len);
-                    str[str_len] = '\0';
-                    ptr += str_len;
-                    inst->arg = WORD(str);
-                } else {
-                    inst->arg = WORD(NULL);
+                    n_char += str_len + 1;
                 }
+                p_set_arg(&inst, word_pointer(target, false));
             } else {
-                memcpy(&inst->arg, ptr, sizeof(Word));
-                ptr += sizeof(Word);
+                Word arg;
+                if (!p_read(&r, &arg, sizeof(Word)) || !p_set_arg(&inst, arg)) return false;
+            }
+            if (p_instr_has_aux(inst.type) && !p_read(&r, &inst.aux, sizeof(int32_t))) return false;
+
+            if (fn_code) fn_code[j] = inst;
+        }
+
+        if (arena) {
+            Function *fn = &fns[i];
+            fn->name = fn_name;
+            fn->in_arena = true;
+            fn->instructions = (InstructionArray){.data = fn_code, .count = inst_count, .capacity = inst_count};
+            p_insert_function(vm, fn);
+        }
+    }
+
+    size->functions = fn_count;
+    size->instructions = n_inst;
+    size->chars = n_char;
+    return true;
+}
+
+static inline bool p_read_u32(PReader *r, uint32_t *out) {
+    const uint8_t *p = p_take(r, 4);
+    if (p) *out = p_get_u32(p);
+    return p != NULL;
+}
+
+static bool p_read_varint(PReader *r, uint64_t *out) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        const uint8_t *p = p_take(r, 1);
+        if (!p) return false;
+        v |= (uint64_t)(*p & 0x7F) << shift;
+        if (!(*p & 0x80)) {
+            *out = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+// A u32 field: fixed width, or a varint in compact sections
+static bool p_read_index(PReader *r, bool compact, uint32_t *out) {
+    uint64_t v;
+    if (!compact) return p_read_u32(r, out);
+    if (!p_read_varint(r, &v) || v > UINT32_MAX) return false;
+    *out = (uint32_t)v;
+    return true;
+}
+
+// Decodes the constant pool into consts. Strings are copied into chars (when
+// given) and *n_char counts the bytes they need.
+static bool p_read_pool(PReader r, uint32_t count, Word *consts, char *chars, size_t *n_char) {
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *tag = p_take(&r, 1);
+        const uint8_t *p;
+        if (!tag) return false;
+
+        switch (*tag) {
+            case P_CONST_INT:
+                if (!(p = p_take(&r, 9))) return false;
+                consts[i] = (p[0] & WF_IS_UNSIGNED) ? word_uint(p_get_u64(p + 1)) : word_int((int64_t)p_get_u64(p + 1));
+                break;
+            case P_CONST_FLOAT: {
+                if (!(p = p_take(&r, 8))) return false;
+                uint64_t bits = p_get_u64(p);
+                double d;
+                memcpy(&d, &bits, sizeof(d));
+                consts[i] = word_float(d);
+                break;
             }
+            case P_CONST_CHAR:
+                if (!(p = p_take(&r, 1))) return false;
+                consts[i] = word_char((char)p[0]);
+                break;
+            case P_CONST_STRING: {
+                uint32_t len;
+                if (!p_read_u32(&r, &len) || !(p = p_take(&r, len))) return false;
+                char *str = chars ? chars + *n_char : NULL;
+                if (str) {
+                    memcpy(str, p, len);
+                    str[len] = '\0';
+                }
+                *n_char += (size_t)len + 1;
+                consts[i] = (Word){.type = WPOINTER, .as_pointer = str, .flags = WF_IS_STRING};
+                break;
+            }
+            case P_CONST_NULL:
+                consts[i] = word_pointer(NULL, false);
+                break;
+            default:
+                return false;
+        }
+    }
+    return r.left == 0;
+}
+
+static inline bool p_pool_is_string(const Word *consts, uint32_t count, uint32_t index) {
+    return index < count && consts[index].type == WPOINTER && word_is_string(&consts[index]);
+}
+
+// Reads one instruction from the function section
+static bool p_read_instruction(PReader *r, bool compact, const Word *consts, uint32_t pool_count, Instruction *inst) {
+    const uint8_t *op = p_take(r, 1);
+    if (!op) return false;
+    uint8_t type = compact ? *op & 0x3F : *op;
+    int form = compact ? *op >> 6 : P_OPERAND_POOL;
+    if (type >= INSTRUCTION_COUNT || p_is_linked_op((InstructionType)type)) return false;
+    *inst = (Instruction){.type = (InstructionType)type, .aux = 0};
+
+    Word arg = word_int(0);
+    uint64_t v;
+    uint32_t index;
+    switch (form) {
+        case P_OPERAND_BYTE: {
+            const uint8_t *p = p_take(r, 1);
+            if (!p) return false;
+            arg = word_int(*p);
+            break;
+        }
+        case P_OPERAND_VARINT:
+            if (!p_read_varint(r, &v)) return false;
+            arg = word_int(p_unzigzag(v));
+            break;
+        case P_OPERAND_POOL:
+            if (!p_read_index(r, compact, &index) || index >= pool_count) return false;
+            arg = consts[index];
+            break;
+        default:
+            break;
+    }
+    if (p_is_named_call(inst->type) && !(arg.type == WPOINTER && word_is_string(&arg))) {
+        return false;
+    }
+    if (!p_set_arg(inst, arg)) return false;
+
+    if (p_instr_has_aux(inst->type)) {
+        uint32_t aux;
+        if (compact) {
+            if (!p_read_varint(r, &v)) return false;
+            aux = (uint32_t)p_unzigzag(v);
+        } else if (!p_read_u32(r, &aux)) {
+            return false;
+        }
+        inst->aux = (int32_t)aux;
+    }
+    return true;
+}
+
+static bool p_walk_v2_functions(ProstVM *vm, PReader r, bool compact, uint32_t fn_count, const Word *consts,
+                                uint32_t pool_count, PDecodeSize *size, uint8_t *arena) {
+    Function *fns = (Function *)arena;
+    Instruction *code = arena ? (Instruction *)(fns + size->functions) : NULL;
+    size_t n_inst = 0;
+
+    for (uint32_t i = 0; i < fn_count; i++) {
+        uint32_t name, inst_count;
+        if (!p_read_index(&r, compact, &name) || !p_read_index(&r, compact, &inst_count) ||
+            !p_pool_is_string(consts, pool_count, name) || inst_count > r.left) {
+            return false;
+        }
+        Instruction *fn_code = code ? code + n_inst : NULL;
+        n_inst += inst_count;
+
+        for (uint32_t j = 0; j < inst_count; j++) {
+            Instruction inst;
+            if (!p_read_instruction(&r, compact, consts, pool_count, &inst)) return false;
+            if (fn_code) fn_code[j] = inst;
         }
 
-        xmap_set(&vm->functions, fn_name, WORD(fn));
+        if (arena) {
+            Function *fn = &fns[i];
+            fn->name = (char *)consts[name].as_pointer;
+            fn->in_arena = true;
+            fn->instructions = (InstructionArray){.data = fn_code, .count = inst_count, .capacity = inst_count};
+            p_insert_function(vm, fn);
+        }
+    }
+
+    size->functions = fn_count;
+    size->instructions = n_inst;
+    return r.left == 0;
+}
+
+// Version 2: header, deduplicated constant pool, then the functions, either
+// with u32 pool-index operands or (P_BC_COMPACT) in the compact encoding.
+// Instructions are expanded to full Instructions here, at load time. Strings
+// from the pool are stored once in the arena and shared by every instruction
+// and function name that refers to them.
+static bool p_walk_v2(ProstVM *vm, PReader r, PDecodeSize *size, uint8_t *arena) {
+    const uint8_t *header = p_take(&r, P_BC_HEADER_SIZE);
+    if (!header || header[P_BC_MAGIC_SIZE] != P_BC_VERSION || (header[P_BC_MAGIC_SIZE + 1] & ~P_BC_COMPACT)) {
+        return false;
+    }
+    bool compact = header[P_BC_MAGIC_SIZE + 1] & P_BC_COMPACT;
+
+    uint32_t pool_count = p_get_u32(header + 8);
+    uint32_t pool_size = p_get_u32(header + 12);
+    uint32_t fn_count = p_get_u32(header + 16);
+    uint32_t code_size = p_get_u32(header + 20);
+    PReader pool = {.ptr = p_take(&r, pool_size), .left = pool_size};
+    PReader code = {.ptr = p_take(&r, code_size), .left = code_size};
+    if (!pool.ptr || !code.ptr || pool_count > pool_size) return false;
+
+    char *chars = arena ? (char *)((Instruction *)((Function *)arena + size->functions) + size->instructions) : NULL;
+    size_t n_char = 0;
+    Word *consts = malloc((pool_count ? pool_count : 1) * sizeof(Word));
+    bool ok = consts && p_read_pool(pool, pool_count, consts, chars, &n_char) &&
+              p_walk_v2_functions(vm, code, compact, fn_count, consts, pool_count, size, arena);
+    free(consts);
+
+    size->chars = n_char;
+    return ok;
+}
+
+// Decodes size bytes of bytecode. Everything the functions own goes into a
+// single arena (kept in vm->arenas) instead of one allocation per function,
+// name and call target. Nothing is added unless the whole blob is valid.
+static ProstStatus p_decode(ProstVM *vm, const void *bytes, size_t size) {
+    PReader r = {.ptr = (const uint8_t *)bytes, .left = size};
+    PDecodeSize need;
+    bool v2 = size >= P_BC_MAGIC_SIZE && memcmp(bytes, P_BC_MAGIC, P_BC_MAGIC_SIZE) == 0;
+    bool (*walk)(ProstVM *, PReader, PDecodeSize *, uint8_t *) = v2 ? p_walk_v2 : p_walk_v1;
+    if (!walk(vm, r, &need, NULL)) {
+        fprintf(stderr, "ERROR: Truncated or invalid bytecode\n");
+        vm->status = P_ERR_INVALID_BYTECODE;
+        return vm->status;
+    }
+
+    uint8_t *arena = malloc(need.functions * sizeof(Function) + need.instructions * sizeof(Instruction) + need.chars);
+    if (!arena) {
+        vm->status = P_ERR_INVALID_VM_STATE;
+        return vm->status;
     }
+    xvec_push(&vm->arenas, word_pointer(arena, true));
+    walk(vm, r, &need, arena);
 
     vm->status = P_OK;
     return vm->status;
 }
 
+// Only decodes the functions in bytecode; calls stay unresolved
+ProstStatus p_decode_bytecode(ProstVM *vm, const char *bytecode) {
+    return p_decode_bytecode_n(vm, bytecode, SIZE_MAX);
+}
+
+// p_decode_bytecode reading at most size bytes, rejecting truncated bytecode
+ProstStatus p_decode_bytecode_n(ProstVM *vm, const char *bytecode, size_t size) {
+    if (!vm || !bytecode) {
+        vm->status = P_ERR_INVALID_BYTECODE;
+        return vm->status;
+    }
+    return p_decode(vm, bytecode, size);
+}
+
+// p_from_bytecode on the contents of a .pco file. The file is mapped
+// read-only and decoded straight from the mapping, so it is never copied into
+// a private buffer and its pages stay shared in the page cache.
+ProstStatus p_load_file(ProstVM *vm, const char *path) {
+    if (!vm || !path) {
+        vm->status = P_ERR_INVALID_BYTECODE;
+        return vm->status;
+    }
+
+#ifdef _WIN32
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "ERROR: Could not open '%s'\n", path);
+        vm->status = P_ERR_INVALID_BYTECODE;
+        return vm->status;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *bytes = malloc(size > 0 ? size : 1);
+    size_t got = bytes ? fread(bytes, 1, size, f) : 0;
+    fclose(f);
+    ProstStatus status = p_decode(vm, bytes, got);
+    free(bytes);
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "ERROR: Could not open '%s'\n", path);
+        if (fd >= 0) close(fd);
+        vm->status = P_ERR_INVALID_BYTECODE;
+        return vm->status;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map '%s'\n", path);
+        vm->status = P_ERR_INVALID_BYTECODE;
+        return vm->status;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    ProstStatus status = p_decode(vm, map, size);
+    munmap(map, size);
+#endif
+
+    if (status != P_OK) {
+        return status;
+    }
+    return p_prepare(vm);
+}
+
+// A verified function may skip its stack checks, but only if the caller really
+// left it the values p_verify assumed and there is room for its own pushes.
+static inline bool p_can_run_fast(ProstVM *vm, Function *fn) {
+    return fn->info.verified && fn->info.frame_stack >= 0 &&
+           vm->stack.size >= (size_t)fn->info.stack_in &&
+           vm->stack.capacity - vm->stack.size >= (size_t)fn->info.frame_stack;
+}
+
 ProstStatus p_call(ProstVM *vm, const char *name) {
     if (!vm || !name) {
         vm->status = P_ERR_INVALID_INDEX;
         return vm->status;
     }
 
-    Word *fn_word = xmap_get(&vm->functions, name);
-    if (!fn_word || fn_word->as_pointer == NULL) {
+    Function *fn = p_find_function(vm, name);
+    if (!fn) {
         vm->status = P_ERR_FUNCTION_NOT_FOUND;
         return vm->status;
     }
 
-    CallFrame *frame;
-    if (vm->frame_pool_index < CALL_FRAME_POOL_SIZE) {
-        frame = &vm->frame_pool[vm->frame_pool_index++];
-    } else {
-        frame = (CallFrame *)malloc(sizeof(CallFrame));
-        if (!frame) {
-            vm->status = P_ERR_INVALID_VM_STATE;
-            return vm->status;
-        }
+    return p_call_function(vm, fn);
+}
+
+// Makes room for one more frame; fails past vm->max_call_depth
+static ProstStatus p_call_stack_grow(ProstVM *vm) {
+    PCallStack *cs = &vm->call_stack;
+    if (cs->size >= vm->max_call_depth) {
+        fprintf(stderr, "ERROR: Call stack overflow (max depth %zu)\n", vm->max_call_depth);
+        vm->status = P_ERR_CALL_STACK_OVERFLOW;
+        vm->running = false;
+        return vm->status;
+    }
+
+    size_t capacity = cs->capacity * 2;
+    if (capacity > vm->max_call_depth) capacity = vm->max_call_depth;
+    CallFrame *data = (CallFrame *)malloc(capacity * sizeof(CallFrame));
+    if (!data) {
+        vm->status = P_ERR_INVALID_VM_STATE;
+        vm->running = false;
+        return vm->status;
+    }
+    // Not realloc: the sampling profiler's signal handler may read the frames
+    // at any point, so the old array stays valid until cs->data is replaced.
+    memcpy(data, cs->data, cs->size * sizeof(CallFrame));
+    CallFrame *old = cs->data;
+    atomic_signal_fence(memory_order_release);
+    cs->data = data;
+    cs->capacity = capacity;
+    atomic_signal_fence(memory_order_release);
+    free(old);
+    return P_OK;
+}
+
+ProstStatus p_call_function(ProstVM *vm, Function *fn) {
+    if (vm->call_stack.size == vm->call_stack.capacity || vm->call_stack.size >= vm->max_call_depth) {
+        if (p_call_stack_grow(vm) != P_OK) return vm->status;
     }
 
+    CallFrame *frame = &vm->call_stack.data[vm->call_stack.size];
     frame->function_name = vm->current_function;
     frame->function_ptr = vm->current_function_ptr;
     frame->return_ip = vm->current_ip;
-    xvec_push(&vm->call_stack, WORD(frame));
+    frame->fast_path = vm->fast_path;
+    atomic_signal_fence(memory_order_release); // the sampler only sees complete frames
+    vm->call_stack.size++;
+
+    vm->current_function = fn->name;
+    vm->current_function_ptr = fn;
+    vm->current_ip = 0;
+    vm->fast_path = p_can_run_fast(vm, fn);
+
+    vm->status = P_OK;
+    return vm->status;
+}
+
+// Runs fn in place of the current function: the caller's frame is kept, so
+// fn returns straight to it. With no caller to return to, this is a normal
+// call.
+ProstStatus p_tail_call_function(ProstVM *vm, Function *fn) {
+    if (vm->call_stack.size == 0) {
+        return p_call_function(vm, fn);
+    }
 
-    vm->current_function = name;
-    vm->current_function_ptr = (Function *)fn_word->as_pointer;
+    vm->current_function = fn->name;
+    vm->current_function_ptr = fn;
     vm->current_ip = 0;
+    vm->fast_path = p_can_run_fast(vm, fn);
 
     vm->status = P_OK;
     return vm->status;
@@ -662,14 +2730,14 @@ ProstStatus p_call_extern(ProstVM *vm, const char *name) {
         return vm->status;
     }
 
-    Word *fn_word = xmap_get(&vm->external_functions, name);
-    if (!fn_word || fn_word->as_pointer == NULL) {
+    int64_t slot = p_external_slot(vm, name);
+    if (slot < 0) {
         vm->status = P_ERR_FUNCTION_NOT_FOUND;
         return vm->status;
     }
 
-    p_external_function fn = (p_external_function)fn_word->as_pointer;
-    fn(vm);
+    vm->externals[slot](vm);
+    if (vm->status == P_ERR_STACK_OVERFLOW || vm->status == P_ERR_INT_OVERFLOW) return vm->status;
 
     vm->status = P_OK;
     return vm->status;
@@ -686,39 +2754,27 @@ ProstStatus p_execute_instruction(ProstVM *vm, Instruction *instruction) {
     return vm->jump_table[instruction->type](vm, instruction);
 }
 
-ProstStatus p_run(ProstVM *vm) {
-    if (!vm) return P_ERR_INVALID_VM_STATE;
-
-    vm->running = true;
-    vm->current_function = "__entry";
-    vm->current_ip = 0;
+static inline void p_return_from_frame(ProstVM *vm) {
+    CallFrame *frame = &vm->call_stack.data[--vm->call_stack.size];
 
-    Word *fn_word = xmap_get(&vm->functions, "__entry");
-    if (!fn_word || fn_word->as_pointer == NULL) {
-        vm->status = P_ERR_FUNCTION_NOT_FOUND;
-        return vm->status;
-    }
-    vm->current_function_ptr = (Function *)fn_word->as_pointer;
+    vm->current_function = frame->function_name;
+    vm->current_function_ptr = (Function *)frame->function_ptr;
+    vm->current_ip = frame->return_ip;
+    vm->fast_path = frame->fast_path;
+}
 
+// Classic loop, one indirect call through vm->jump_table per instruction.
+// Used whenever an embedder replaced one of the default handlers.
+static ProstStatus p_run_table(ProstVM *vm) {
     while (vm->running) {
         Function *fn = vm->current_function_ptr;
 
         if (vm->current_ip >= fn->instructions.count) {
-            if (xvec_empty(&vm->call_stack)) {
+            if (vm->call_stack.size == 0) {
                 vm->running = false;
                 break;
             }
-
-            Word frame_word = xvec_pop(&vm->call_stack);
-            CallFrame *frame = (CallFrame *)frame_word.as_pointer;
-
-            vm->current_function = frame->function_name;
-            vm->current_function_ptr = (Function *)frame->function_ptr;
-            vm->current_ip = frame->return_ip;
-
-            if (vm->frame_pool_index > 0) {
-                vm->frame_pool_index--;
-            }
+            p_return_from_frame(vm);
             continue;
         }
 
@@ -734,6 +2790,245 @@ ProstStatus p_run(ProstVM *vm) {
     return P_OK;
 }
 
+// Direct-threaded loop. The default handlers are called directly so they get
+// inlined here, and every opcode jumps straight to the next one instead of
+// going back through a shared dispatch point. Falls back to a switch when
+// labels-as-values are not available (or with PROST_NO_COMPUTED_GOTO).
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(PROST_NO_COMPUTED_GOTO)
+    #define P_COMPUTED_GOTO
+#endif
+
+static ProstStatus p_run_threaded(ProstVM *vm) {
+    Function *fn = vm->current_function_ptr;
+    Instruction *inst;
+    ProstStatus status;
+
+#define P_FETCH() \
+    do { \
+        if (vm->current_ip >= fn->instructions.count) goto end_of_function; \
+        inst = &fn->instructions.data[vm->current_ip++]; \
+    } while (0)
+#define P_HANDLE(handler) \
+    do { \
+        status = handler(vm, inst); \
+        if (status != P_OK) return status; \
+    } while (0)
+
+#ifdef P_COMPUTED_GOTO
+    // Opcodes with an unchecked variant dispatch through fast_labels while the
+    // current function is on the fast path; the rest share one label.
+#define P_CHECKED_OPS(X) \
+    X(Halt) X(Call) X(CallExtern) X(Return) X(Jmp) X(JmpIf) \
+    X(Eq) X(Neq) X(Read8) X(Write8) X(Div) X(Mod) X(And) X(Or) X(Xor) X(Shl) X(Shr) X(Not) \
+    X(RegAddImm) X(TailCall) X(TailCallExtern) X(CallDirect) X(CallExternSlot) X(TailCallDirect) X(TailCallExternSlot) \
+    X(Spawn) X(SpawnDirect) X(Yield) X(Join)
+#define P_FAST_OPS(X) \
+    X(Push) X(PushRegister) X(Pop) X(Drop) X(Dup) X(Swap) X(Over) X(Lt) X(Lte) X(Gt) X(Gte) X(Add) X(Sub) X(Mul) \
+    X(AddImm) X(LtImm) X(LteImm) X(GtImm) X(GteImm) X(BrLtImm) X(BrLteImm) X(BrGtImm) X(BrGteImm)
+#define P_LABEL(op) [op] = &&op_##op,
+#define P_FAST_LABEL(op) [op] = &&fast_##op,
+    static void *labels[INSTRUCTION_COUNT] = { P_CHECKED_OPS(P_LABEL) P_FAST_OPS(P_LABEL) };
+    static void *fast_labels[INSTRUCTION_COUNT] = { P_CHECKED_OPS(P_LABEL) P_FAST_OPS(P_FAST_LABEL) };
+#undef P_CHECKED_OPS
+#undef P_FAST_OPS
+#undef P_LABEL
+#undef P_FAST_LABEL
+    void **table = vm->fast_path ? fast_labels : labels;
+    #define P_OP(op) op_##op:
+    #define P_FAST(op) fast_##op:
+    #define P_NEXT() do { P_FETCH(); goto *table[inst->type]; } while (0)
+    #define P_SELECT_TABLE() table = vm->fast_path ? fast_labels : labels
+#else
+    #define P_OP(op) case op:
+    #define P_NEXT() goto dispatch
+    #define P_SELECT_TABLE() (void)0
+#endif
+
+#ifdef PROST_JIT
+    // Runs compiled code from vm->current_ip if fn is (or just became) hot; it
+    // returns at the next instruction the interpreter has to execute.
+    #define P_JIT_TRY() \
+        do { \
+            if (p_jit_ready(vm, fn)) { \
+                status = p_jit_run(vm, fn); \
+                if (status != P_OK) return status; \
+            } \
+        } while (0)
+    // After a jump: only backward jumps count towards hotness
+    #define P_JIT_BACKEDGE() \
+        do { \
+            if (vm->current_ip <= (size_t)(inst - fn->instructions.data)) P_JIT_TRY(); \
+        } while (0)
+#else
+    #define P_JIT_TRY() (void)0
+    #define P_JIT_BACKEDGE() (void)0
+#endif
+    #define P_ENTER() do { fn = vm->current_function_ptr; P_SELECT_TABLE(); P_JIT_TRY(); } while (0)
+
+dispatch:
+    P_FETCH();
+#ifdef P_COMPUTED_GOTO
+    goto *table[inst->type];
+#else
+    switch (inst->type) {
+#endif
+
+    P_OP(Push) P_HANDLE(handle_push); P_NEXT();
+    P_OP(PushRegister) P_HANDLE(handle_push_register); P_NEXT();
+    P_OP(Pop) P_HANDLE(handle_pop); P_NEXT();
+    P_OP(Drop) P_HANDLE(handle_drop); P_NEXT();
+    P_OP(Halt) vm->running = false; return P_OK;
+    P_OP(Call) P_HANDLE(handle_call); P_ENTER(); P_NEXT();
+    P_OP(CallDirect) P_HANDLE(handle_call_direct); P_ENTER(); P_NEXT();
+    P_OP(CallExtern) {
+        P_HANDLE(handle_call_extern);
+        if (!vm->running) return P_OK;
+        P_NEXT();
+    }
+    P_OP(CallExternSlot) {
+        P_HANDLE(handle_call_extern_slot);
+        if (!vm->running) return P_OK;
+        P_JIT_TRY();
+        P_NEXT();
+    }
+    P_OP(TailCall) P_HANDLE(handle_tail_call); P_ENTER(); P_NEXT();
+    P_OP(TailCallDirect) P_HANDLE(handle_tail_call_direct); P_ENTER(); P_NEXT();
+    P_OP(TailCallExtern) {
+        P_HANDLE(handle_tail_call_extern);
+        if (!vm->running) return P_OK;
+        P_ENTER();
+        P_NEXT();
+    }
+    P_OP(TailCallExternSlot) {
+        P_HANDLE(handle_tail_call_extern_slot);
+        if (!vm->running) return P_OK;
+        P_ENTER();
+        P_NEXT();
+    }
+    P_OP(Return) P_HANDLE(handle_return); P_ENTER(); P_NEXT();
+    P_OP(Jmp) P_HANDLE(handle_jmp); P_JIT_BACKEDGE(); P_NEXT();
+    P_OP(JmpIf) P_HANDLE(handle_jmpif); P_JIT_BACKEDGE(); P_NEXT();
+    P_OP(Dup) P_HANDLE(handle_dup); P_NEXT();
+    P_OP(Swap) P_HANDLE(handle_swap); P_NEXT();
+    P_OP(Over) P_HANDLE(handle_over); P_NEXT();
+    P_OP(Eq) P_HANDLE(handle_eq); P_NEXT();
+    P_OP(Neq) P_HANDLE(handle_neq); P_NEXT();
+    P_OP(Lt) P_HANDLE(handle_lt); P_NEXT();
+    P_OP(Lte) P_HANDLE(handle_lte); P_NEXT();
+    P_OP(Gt) P_HANDLE(handle_gt); P_NEXT();
+    P_OP(Gte) P_HANDLE(handle_gte); P_NEXT();
+    P_OP(Read8) P_HANDLE(handle_read8); P_NEXT();
+    P_OP(Write8) P_HANDLE(handle_write8); P_NEXT();
+    P_OP(Add) P_HANDLE(handle_add); P_NEXT();
+    P_OP(Sub) P_HANDLE(handle_sub); P_NEXT();
+    P_OP(Mul) P_HANDLE(handle_mul); P_NEXT();
+    P_OP(Div) P_HANDLE(handle_div); P_NEXT();
+    P_OP(Mod) P_HANDLE(handle_mod); P_NEXT();
+    P_OP(And) P_HANDLE(handle_and); P_NEXT();
+    P_OP(Or) P_HANDLE(handle_or); P_NEXT();
+    P_OP(Xor) P_HANDLE(handle_xor); P_NEXT();
+    P_OP(Shl) P_HANDLE(handle_shl); P_NEXT();
+    P_OP(Shr) P_HANDLE(handle_shr); P_NEXT();
+    P_OP(Not) P_HANDLE(handle_not); P_NEXT();
+    P_OP(AddImm) P_HANDLE(handle_add_imm); P_NEXT();
+    P_OP(LtImm) P_HANDLE(handle_lt_imm); P_NEXT();
+    P_OP(LteImm) P_HANDLE(handle_lte_imm); P_NEXT();
+    P_OP(GtImm) P_HANDLE(handle_gt_imm); P_NEXT();
+    P_OP(GteImm) P_HANDLE(handle_gte_imm); P_NEXT();
+    P_OP(BrLtImm) P_HANDLE(handle_br_lt_imm); P_JIT_BACKEDGE(); P_NEXT();
+    P_OP(BrLteImm) P_HANDLE(handle_br_lte_imm); P_JIT_BACKEDGE(); P_NEXT();
+    P_OP(BrGtImm) P_HANDLE(handle_br_gt_imm); P_JIT_BACKEDGE(); P_NEXT();
+    P_OP(BrGteImm) P_HANDLE(handle_br_gte_imm); P_JIT_BACKEDGE(); P_NEXT();
+    P_OP(RegAddImm) P_HANDLE(handle_reg_add_imm); P_NEXT();
+    P_OP(Spawn) P_HANDLE(handle_spawn); P_NEXT();
+    P_OP(SpawnDirect) P_HANDLE(handle_spawn_direct); P_NEXT();
+    P_OP(Yield) {
+        P_HANDLE(handle_yield);
+        if (!vm->running) return P_OK;
+        P_NEXT();
+    }
+    P_OP(Join) {
+        P_HANDLE(handle_join);
+        if (!vm->running) return P_OK;
+        P_NEXT();
+    }
+
+#ifdef P_COMPUTED_GOTO
+    P_FAST(Push) P_HANDLE(handle_push_fast); P_NEXT();
+    P_FAST(PushRegister) P_HANDLE(handle_push_register_fast); P_NEXT();
+    P_FAST(Pop) P_HANDLE(handle_pop_fast); P_NEXT();
+    P_FAST(Drop) P_HANDLE(handle_drop_fast); P_NEXT();
+    P_FAST(Dup) P_HANDLE(handle_dup_fast); P_NEXT();
+    P_FAST(Swap) P_HANDLE(handle_swap_fast); P_NEXT();
+    P_FAST(Over) P_HANDLE(handle_over_fast); P_NEXT();
+    P_FAST(Lt) P_HANDLE(handle_lt_fast); P_NEXT();
+    P_FAST(Lte) P_HANDLE(handle_lte_fast); P_NEXT();
+    P_FAST(Gt) P_HANDLE(handle_gt_fast); P_NEXT();
+    P_FAST(Gte) P_HANDLE(handle_gte_fast); P_NEXT();
+    P_FAST(Add) P_HANDLE(handle_add_fast); P_NEXT();
+    P_FAST(Sub) P_HANDLE(handle_sub_fast); P_NEXT();
+    P_FAST(Mul) P_HANDLE(handle_mul_fast); P_NEXT();
+    P_FAST(AddImm) P_HANDLE(handle_add_imm_fast); P_NEXT();
+    P_FAST(LtImm) P_HANDLE(handle_lt_imm_fast); P_NEXT();
+    P_FAST(LteImm) P_HANDLE(handle_lte_imm_fast); P_NEXT();
+    P_FAST(GtImm) P_HANDLE(handle_gt_imm_fast); P_NEXT();
+    P_FAST(GteImm) P_HANDLE(handle_gte_imm_fast); P_NEXT();
+    P_FAST(BrLtImm) P_HANDLE(handle_br_lt_imm_fast); P_JIT_BACKEDGE(); P_NEXT();
+    P_FAST(BrLteImm) P_HANDLE(handle_br_lte_imm_fast); P_JIT_BACKEDGE(); P_NEXT();
+    P_FAST(BrGtImm) P_HANDLE(handle_br_gt_imm_fast); P_JIT_BACKEDGE(); P_NEXT();
+    P_FAST(BrGteImm) P_HANDLE(handle_br_gte_imm_fast); P_JIT_BACKEDGE(); P_NEXT();
+#else
+    default:
+        vm->status = P_ERR_INVALID_BYTECODE;
+        return vm->status;
+    }
+#endif
+
+end_of_function:
+    if (vm->call_stack.size == 0) {
+        vm->running = false;
+        return P_OK;
+    }
+    p_return_from_frame(vm);
+    P_ENTER();
+    goto dispatch;
+
+#undef P_FETCH
+#undef P_HANDLE
+#undef P_OP
+#undef P_FAST
+#undef P_NEXT
+#undef P_ENTER
+#undef P_SELECT_TABLE
+#undef P_JIT_TRY
+#undef P_JIT_BACKEDGE
+}
+
+ProstStatus p_run(ProstVM *vm) {
+    if (!vm) return P_ERR_INVALID_VM_STATE;
+
+    vm->running = true;
+    vm->current_function = "__entry";
+    vm->current_ip = 0;
+
+    vm->current_function_ptr = p_find_function(vm, "__entry");
+    if (!vm->current_function_ptr) {
+        vm->status = P_ERR_FUNCTION_NOT_FOUND;
+        return vm->status;
+    }
+    vm->fast_path = p_can_run_fast(vm, vm->current_function_ptr);
+
+    ProstStatus status;
+    if (vm->profile) {
+        status = p_run_profiled(vm);
+    } else if (memcmp(vm->jump_table, p_default_jump_table, sizeof(vm->jump_table)) == 0) {
+        status = p_run_threaded(vm);
+    } else {
+        status = p_run_table(vm);
+    }
+    return p_fiber_wait_all(vm, status);
+}
+
 Word p_expect(ProstVM *vm, WordType t) {
     Word w = p_pop(vm);
     if (w.type != t) {
@@ -7,7 +7,7 @@ void print(ProstVM *vm) {
 
     switch (w.type) {
         case WINT:
-            printf("%llu\n", w.as_int);
+            printf("%llu\n", (unsigned long long)w.as_int);
             break;
         case WPOINTER: // treat as string
             printf("%s\n", (char *)w.as_pointer);
@@ -101,32 +101,31 @@ void typeof_(ProstVM *vm) {
 }
 
 
-static XVec allocation_state = {0};
-
-// Allocates memory and saves pointer
+// Allocates memory that lives as long as the VM
 void alloc(ProstVM* vm) {
     const int64_t size = p_expect(vm, WINT).as_int;
     void *m = malloc(size);
-    xvec_push(&allocation_state, WORD(m));
+    p_own(vm, m);
 
-    p_push(vm, word_pointer(m, true)); // by saying owns memory it will be cleaned up at free time of stack
+    p_push(vm, word_pointer(m, false)); // freed by p_free through vm->owned, not with the stack
 }
 
 
 
 void dump_p_state(ProstVM *vm) {
     printf("=== PROST STATE DUMP ===\n");
-    printf("  STACK (size: %zu):\n", xvec_len(&vm->stack));
-    for (size_t i = 0; i < xvec_len(&vm->stack); i++) {
-        printf("    %s\n", word_to_str(xvec_get(&vm->stack, i)));
+    printf("  STACK (size: %zu):\n", p_stack_size(vm));
+    for (size_t i = 0; i < p_stack_size(vm); i++) {
+        Word w = p_stack_get(vm, i);
+        printf("    %s\n", word_to_str(&w));
     }
     printf("  CALL STACK: \n");
-    for (size_t i = 0; i < xvec_len(&vm->call_stack); i++) {
-        printf("    %s\n", ((CallFrame*)xvec_get(&vm->call_stack, i)->as_pointer)->function_name);
+    for (size_t i = 0; i < vm->call_stack.size; i++) {
+        printf("    %s\n", vm->call_stack.data[i].function_name);
     }
     printf("  EXTERNAL FUNCTIONS: \n");
-    for (size_t i = 0; i < vm->external_functions.size; i++) {
-        printf("    %s\n", vm->external_functions.entries[i].key);
+    for (size_t i = 0; i < vm->external_count; i++) {
+        printf("    %s\n", vm->external_names[i]);
     }
 }
 
@@ -136,28 +135,26 @@ void aabort(ProstVM *vm) {
     abort();
 }
 
+// std keeps no state outside the VM, so it can be registered in VMs that run
+// on different threads.
 void register_std(ProstVM *vm) {
-    allocation_state = xvec_create(1);
-
-    p_register_external(vm, "print", print);
-    p_register_external(vm, "add", add);
-    p_register_external(vm, "sub", sub);
-    p_register_external(vm, "mul", mul);
-    p_register_external(vm, "divi", divi);
-    p_register_external(vm, "cmp", cmp);
-    p_register_external(vm, "neg", neg);
-    p_register_external(vm, "alloc", alloc); // TODO: remove?
-    p_register_external(vm, "typeof", typeof_);
-    p_register_external(vm, "dump_p_state", dump_p_state);
-    p_register_external(vm, "abort", aabort);
+    // stack effects (values popped, values pushed) let p_verify see through calls
+    p_register_external_ex(vm, "print", print, 1, 1);
+    p_register_external_ex(vm, "add", add, 2, 1);
+    p_register_external_ex(vm, "sub", sub, 2, 1);
+    p_register_external_ex(vm, "mul", mul, 2, 1);
+    p_register_external_ex(vm, "divi", divi, 2, 1);
+    p_register_external_ex(vm, "cmp", cmp, 2, 1);
+    p_register_external_ex(vm, "neg", neg, 1, 1);
+    p_register_external_ex(vm, "alloc", alloc, 1, 1); // TODO: remove?
+    p_register_external_ex(vm, "typeof", typeof_, 1, 2);
+    p_register_external_ex(vm, "dump_p_state", dump_p_state, 0, 0);
+    p_register_external_ex(vm, "abort", aabort, 0, 0);
 }
 
+// Nothing to do anymore, alloc's memory is freed by p_free. Kept for older
+// embedders.
 void unload_std() {
-    for (int i = 0; i < xvec_len(&allocation_state); i++) {
-        void *ptr = xvec_get(&allocation_state, i)->as_pointer;
-        if (ptr != NULL) free(ptr);
-    }
-    xvec_free(&allocation_state);
 }
 
 #endif //STD_H
\ No newline at end of file